@@ -0,0 +1,54 @@
+#ifndef clock_scale_HAS_ALREADY_BEEN_INCLUDED
+#define clock_scale_HAS_ALREADY_BEEN_INCLUDED
+/**
+ * @file
+ * Clock scaling API declaration
+ * @addtogroup service
+ * @{
+ * @addtogroup clock_scale
+ * @{
+ *****************************************************************************
+ * Scaling of the main clock to the load of the reactor.
+ * The load is the time the reactor is not asleep over each
+ *  CLOCK_SCALE_WINDOW_MS. Below CLOCK_SCALE_DOWN_PERCENT, the main clock is
+ *  divided by 2^CLOCK_SCALE_SHIFT. Above CLOCK_SCALE_UP_PERCENT, it is back
+ *  to full speed.
+ * A module which needs the full speed holds it for as long as it needs it,
+ *  and the clock goes back to full speed at once. The TWI master holds it
+ *  for each transfer, and the piezzo for each tune.
+ * On each change, the 1ms tick follows (see timer_rescale), so the time
+ *  stays exact, and so does the peripheral which set a hook.
+ * Enabled with CLOCK_SCALE.
+ * @author gax
+ */
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Called with the interrupts disabled once the clock has changed */
+typedef void (*clock_scale_hook_t)(void);
+
+/** Start scaling the clock to the load */
+void clock_scale_init(void);
+
+/** Keep the clock at full speed until released */
+void clock_scale_hold(void);
+
+/** Release a hold on the full speed */
+void clock_scale_release(void);
+
+/** @return The current frequency of CLK_PER (Hz) */
+uint32_t clock_scale_get_hz(void);
+
+/** Set the hook of the peripheral which follows the clock */
+void clock_scale_set_hook(clock_scale_hook_t hook);
+
+#ifdef __cplusplus
+}
+#endif
+
+/** @} */
+/** @} */
+#endif /* ndef clock_scale_HAS_ALREADY_BEEN_INCLUDED */
@@ -413,12 +413,15 @@ ERROR_FUNC(compiler_demux_bad_size, "Invalid parameter size");
  * This annotation instructs the compiler to ignore its inlining
  * heuristics and inline the function no matter how big it thinks it
  * becomes.
+ * The C library of the host (sys/cdefs.h) may define it already.
  */
+#ifndef __always_inline
 #if (defined __GNUC__)
 	#define __always_inline     inline __attribute__((__always_inline__))
 #elif (defined __ICCAVR__)
 	#define __always_inline     _Pragma("inline=forced")
 #endif
+#endif
 
 //! \name Optimization Control
 //@{
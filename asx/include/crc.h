@@ -0,0 +1,51 @@
+#ifndef crc_HAS_ALREADY_BEEN_INCLUDED
+#define crc_HAS_ALREADY_BEEN_INCLUDED
+/**
+ * @file
+ * CRC API declaration
+ * @addtogroup service
+ * @{
+ * @addtogroup crc
+ * @{
+ *****************************************************************************
+ * Small footprint CRC computation.
+ * The CRC-8 uses the polynomial 0x2F (as AUTOSAR) which keeps a Hamming
+ *  distance of 4 for up to 14 bytes of data - so any 1, 2 or 3 bit error
+ *  in a frame is always detected.
+ * The CRC-16 is the CCITT (polynomial 0x1021, seed 0xFFFF, no final xor) as
+ *  appended to the flash image by srec_cat -CRC16_Big_Endian -broken.
+ * Nibble tables (16 entries) are used rather than full 256 entries tables
+ *  which would not fit the tiny devices.
+ * @author gax
+ */
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Initial value of a CRC-8 computation */
+#define CRC8_INIT 0xFF
+
+/** Add one byte to a running CRC-8 */
+uint8_t crc8_update(uint8_t crc, uint8_t data);
+
+/** Compute the CRC-8 of a block, starting from the given seed */
+uint8_t crc8(const uint8_t *data, uint8_t length, uint8_t seed);
+
+/** Initial value of a CRC-16 computation */
+#define CRC16_INIT 0xFFFF
+
+/** Add one byte to a running CRC-16 */
+uint16_t crc16_update(uint16_t crc, uint8_t data);
+
+/** Compute the CRC-16 of a block, starting from the given seed */
+uint16_t crc16(const uint8_t *data, uint16_t length, uint16_t seed);
+
+#ifdef __cplusplus
+}
+#endif
+
+/** @} */
+/** @} */
+#endif /* ndef crc_HAS_ALREADY_BEEN_INCLUDED */
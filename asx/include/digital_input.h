@@ -121,6 +121,14 @@ digital_input_handle_t digital_input(
 /** Grab the value directly */
 bool digital_input_value( digital_input_handle_t );
 
+#ifdef REACTOR_STANDBY
+/** Stop the sampling, waking up on any edge of the sampled inputs */
+bool digital_input_suspend(void);
+
+/** Sample the inputs again after a standby */
+void digital_input_resume(void);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,45 @@
+#ifndef flash_crc_HAS_ALREADY_BEEN_INCLUDED
+#define flash_crc_HAS_ALREADY_BEEN_INCLUDED
+/**
+ * @file
+ * Flash self-test API declaration
+ * @addtogroup service
+ * @{
+ * @addtogroup flash_crc
+ * @{
+ *****************************************************************************
+ * Background check of the integrity of the flash.
+ * The build appends the CRC-16 of the flash at CRC_AT (see make/avr.mak).
+ * The flash is read back a few bytes at a time in the idle time of the
+ *  reactor, and an alert is raised if the CRC does not match.
+ * The _crc.hex image must be programmed, else every pass fails.
+ *
+ * Each step processes FLASH_CRC_BLOCK bytes (about 5us each at 10MHz), so a
+ *  handler never waits for more than one step. When idle, a full pass of a
+ *  16K flash takes about 80ms, and a new pass starts every
+ *  FLASH_CRC_PERIOD_MS.
+ * @author gax
+ */
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Start checking the flash in the idle time of the reactor */
+void flash_crc_init(void);
+
+/** @return true once a pass has found a CRC mismatch */
+bool flash_crc_failed(void);
+
+/** @return The number of full passes done so far */
+uint16_t flash_crc_passes(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+/** @} */
+/** @} */
+#endif /* ndef flash_crc_HAS_ALREADY_BEEN_INCLUDED */
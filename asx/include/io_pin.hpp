@@ -0,0 +1,123 @@
+#ifndef io_pin_hpp_HAS_ALREADY_BEEN_INCLUDED
+#define io_pin_hpp_HAS_ALREADY_BEEN_INCLUDED
+/**
+ * @file
+ * Compile-time pins
+ * @addtogroup service
+ * @{
+ * @addtogroup io_pin
+ * @{
+ *****************************************************************************
+ * Pins known at compile time, for the C++ code.
+ * The port and the mask are constants, so each access is a single
+ *  instruction on the virtual port (sbi, cbi, sbis or sbic) where the
+ *  ioport API goes through the port of a pin given at runtime.
+ * A group of pins is set or cleared with one OUTSET or OUTCLR write per
+ *  port, so the pins of a port change together.
+ *
+ * On the host, the virtual ports are not aliased to the ports, so the port
+ *  registers are used instead.
+ *
+ * Usage:
+ *  io_pin<LED_FAULT>::set();
+ *  if ( io_pin<IN_DOOR_UP>::get() ) ...
+ *  io_pins<LED_CHUCK, LED_DOOR_CLOSING, LED_DOOR_OPENING>::clear();
+ *****************************************************************************
+ * @author gax
+ */
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ioport.h"
+
+template <ioport_pin_t PIN>
+struct io_pin
+{
+   static constexpr ioport_port_t port = PIN >> 3;
+   static constexpr ioport_port_mask_t mask = 1U << (PIN & 0x07);
+
+   static_assert(port <= IOPORT_PORTC, "The pin is not on a port of the device");
+
+#ifdef _POSIX
+   static inline void set()           { arch_ioport_port_to_base(port)->OUTSET = mask; }
+   static inline void clear()         { arch_ioport_port_to_base(port)->OUTCLR = mask; }
+   static inline void toggle()        { arch_ioport_port_to_base(port)->OUTTGL = mask; }
+   static inline bool get()           { return arch_ioport_port_to_base(port)->IN & mask; }
+   static inline void set_output()    { arch_ioport_port_to_base(port)->DIRSET = mask; }
+   static inline void set_input()     { arch_ioport_port_to_base(port)->DIRCLR = mask; }
+#else
+   /** The virtual port, in the low I/O space reached by the bit instructions */
+   static inline VPORT_t &vport()     { return *arch_ioport_port_to_vbase(port); }
+
+   static inline void set()           { vport().OUT |= mask; }
+   static inline void clear()         { vport().OUT &= ~mask; }
+   static inline void toggle()        { vport().IN = mask; } // Writing 1 to IN toggles OUT
+   static inline bool get()           { return vport().IN & mask; }
+   static inline void set_output()    { vport().DIR |= mask; }
+   static inline void set_input()     { vport().DIR &= ~mask; }
+#endif
+
+   static inline void set(bool level)
+   {
+      if ( level )
+      {
+         set();
+      }
+      else
+      {
+         clear();
+      }
+   }
+};
+
+template <ioport_pin_t... PINS>
+struct io_pins
+{
+   /** Mask of the pins of the group on the given port */
+   template <ioport_port_t PORT>
+   static constexpr ioport_port_mask_t mask_of =
+      (ioport_port_mask_t)((io_pin<PINS>::port == PORT ? io_pin<PINS>::mask : 0) | ... | 0);
+
+   static inline void set()        { each_port([](PORT_t *base, ioport_port_mask_t mask) { base->OUTSET = mask; }); }
+   static inline void clear()      { each_port([](PORT_t *base, ioport_port_mask_t mask) { base->OUTCLR = mask; }); }
+   static inline void toggle()     { each_port([](PORT_t *base, ioport_port_mask_t mask) { base->OUTTGL = mask; }); }
+   static inline void set_output() { each_port([](PORT_t *base, ioport_port_mask_t mask) { base->DIRSET = mask; }); }
+   static inline void set_input()  { each_port([](PORT_t *base, ioport_port_mask_t mask) { base->DIRCLR = mask; }); }
+
+   static inline void set(bool level)
+   {
+      if ( level )
+      {
+         set();
+      }
+      else
+      {
+         clear();
+      }
+   }
+
+private:
+   /** Apply to each port with pins in the group, with the mask of the pins */
+   template <class F>
+   static inline void each_port(F apply)
+   {
+      if constexpr ( mask_of<IOPORT_PORTA> != 0 )
+      {
+         apply(arch_ioport_port_to_base(IOPORT_PORTA), mask_of<IOPORT_PORTA>);
+      }
+
+      if constexpr ( mask_of<IOPORT_PORTB> != 0 )
+      {
+         apply(arch_ioport_port_to_base(IOPORT_PORTB), mask_of<IOPORT_PORTB>);
+      }
+
+      if constexpr ( mask_of<IOPORT_PORTC> != 0 )
+      {
+         apply(arch_ioport_port_to_base(IOPORT_PORTC), mask_of<IOPORT_PORTC>);
+      }
+   }
+};
+
+/**@}*/
+/**@}*/
+#endif /* ndef io_pin_hpp_HAS_ALREADY_BEEN_INCLUDED */
@@ -71,8 +71,16 @@ extern "C" {
  * \param pin IOPORT zero-based index of the I/O pin
  */
 #define IOPORT_CREATE_PIN(port, pin) ((IOPORT_ ## port) * 8 + (pin))
+#ifdef _POSIX
+/** On the host, the ports are plain memory provided by the simulation */
+extern uint8_t ioport_posix_ports[];
+extern uint8_t ioport_posix_vports[];
+#define IOPORT_BASE_ADDRESS ((uintptr_t)ioport_posix_ports)
+#define IOPORT_VBASE_ADDRESS ((uintptr_t)ioport_posix_vports)
+#else
 #define IOPORT_BASE_ADDRESS 0x400
 #define IOPORT_VBASE_ADDRESS 0x0000
+#endif
 #define IOPORT_PORT_OFFSET  0x20
 #define IOPORT_PORT_VOFFSET  0x4
 #define IOPORT_PORTA  0
@@ -285,12 +293,12 @@ __always_inline static void arch_ioport_set_port_level(ioport_port_t port,
 ioport_port_mask_t mask, enum ioport_value level)
 {
    PORT_t *base = arch_ioport_port_to_base(port);
+
+   // OUTSET and OUTCLR only act on the bits written to 1
    if (level) {
-      base->OUTSET |= mask;
-      base->OUTCLR &= ~mask;
+      base->OUTSET = mask;
       } else {
-      base->OUTSET &= ~mask;
-      base->OUTCLR |= mask;
+      base->OUTCLR = mask;
    }
 }
 
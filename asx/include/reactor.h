@@ -31,6 +31,7 @@
  */
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "queue.h"
 
 #ifdef __cplusplus
@@ -81,6 +82,13 @@ typedef uint8_t reactor_handle_t;
 /** Callback type called by the reactor when an event has been logged */
 typedef void (*reactor_handler_t)(void *);
 
+/**
+ * Task run by the reactor when no handler is pending, in short steps.
+ * @return true to be called again straight away, false to let the reactor
+ *  sleep until the next interrupt
+ */
+typedef bool (*reactor_idle_task_t)(void);
+
 /** Initialize the reactor API */
 void reactor_init(void);
 
@@ -95,6 +103,41 @@ reactor_handle_t reactor_register( const reactor_handler_t, reactor_priorities_t
 void reactor_notify( reactor_handle_t handle, void * );
 
 
+/** Set the task to run in the idle time of the reactor */
+void reactor_set_idle_task( reactor_idle_task_t task );
+
+/**
+ * @def REACTOR_SLEEP_STATS
+ * Account for the time spent asleep. Used by the standby and the clock scaling
+ */
+#if defined(REACTOR_STANDBY) || defined(CLOCK_SCALE)
+#  define REACTOR_SLEEP_STATS
+#endif
+
+#ifdef REACTOR_SLEEP_STATS
+/** Time spent in each sleep level since the reset (ms) */
+typedef struct
+{
+   uint32_t idle;    ///< CPU stopped, peripherals and the 1ms tick running
+   uint32_t standby; ///< All stopped but the RTC, the TWI slave and the pin sense
+} reactor_sleep_stats_t;
+
+/** Get the time spent in each sleep level */
+void reactor_get_sleep_stats( reactor_sleep_stats_t *stats );
+#endif
+
+#ifdef REACTOR_STANDBY
+/**
+ * Check of the application before a standby, called with the interrupts
+ *  disabled (i.e. no bus transaction on-going).
+ * @return true if the CPU can stop its clock
+ */
+typedef bool (*reactor_standby_check_t)(void);
+
+/** Set the check of the application before a standby */
+void reactor_set_standby_check( reactor_standby_check_t check );
+#endif
+
 /** Process the reactor loop */
 void reactor_run(void);
 
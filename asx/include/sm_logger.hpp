@@ -0,0 +1,134 @@
+#ifndef sm_logger_hpp_HAS_ALREADY_BEEN_INCLUDED
+#define sm_logger_hpp_HAS_ALREADY_BEEN_INCLUDED
+/**
+ * @file
+ * Logger policy of the Boost SML state machines
+ * @addtogroup service
+ * @{
+ * @addtogroup sm_logger
+ * @{
+ *****************************************************************************
+ * Record the transitions of a state machine into a ring buffer in RAM.
+ * Each entry holds the time (ms), the event, the source and the target
+ *  states. The names are pointers to the strings of the types which, on the
+ *  AVRxt core, stay in flash (mapped in the data space), so an entry is
+ *  10 bytes and nothing is allocated.
+ * The states are named after their "name"_s. An event is named by its
+ *  static c_str() function, else it is recorded as null.
+ * The buffer is read from the debugger by watching the logger object, or
+ *  printed by the simulator with dump().
+ *
+ * Usage:
+ *  sm_logger<16> logger;
+ *  boost::sml::sm<my_sm, boost::sml::logger<sm_logger<16>>> sm{logger};
+ *****************************************************************************
+ * @author gax
+ */
+#include <stdint.h>
+
+#include "timer.h"
+
+#ifdef _POSIX
+#  include <stdio.h>
+#endif
+
+template <uint8_t N>
+struct sm_logger
+{
+   static_assert(N > 0, "The logger needs one entry at least");
+
+   /** A transition */
+   struct entry_t
+   {
+      timer_count_t time;  ///< When the transition took place (ms)
+      const char *event;   ///< Event processed, or null if it has no name
+      const char *src;     ///< State left
+      const char *dst;     ///< State entered (the same for an internal transition)
+   };
+
+   /** Ring buffer of the transitions */
+   entry_t entries[N];
+
+   /** Next entry to write */
+   uint8_t next;
+
+   /** Number of entries written, up to N */
+   uint8_t count;
+
+   /** Event being processed */
+   const char *event;
+
+   template <class SM, class TEvent>
+   void log_process_event(const TEvent &)
+   {
+      event = name_of<TEvent>(0);
+   }
+
+   template <class SM, class TGuard, class TEvent>
+   void log_guard(const TGuard &, const TEvent &, bool) {}
+
+   template <class SM, class TAction, class TEvent>
+   void log_action(const TAction &, const TEvent &) {}
+
+   template <class SM, class TSrcState, class TDstState>
+   void log_state_change(const TSrcState &, const TDstState &)
+   {
+      entries[next] = { timer_get_count(), event, TSrcState::c_str(), TDstState::c_str() };
+
+      next = (next + 1) % N;
+
+      if ( count < N )
+      {
+         ++count;
+      }
+   }
+
+   /** @return The i-th oldest entry recorded. i must be below count */
+   const entry_t &operator[](uint8_t i) const
+   {
+      return entries[(next + N - count + i) % N];
+   }
+
+   /** Forget all entries */
+   void clear()
+   {
+      next = count = 0;
+   }
+
+#ifdef _POSIX
+   /** Print the entries from the oldest */
+   void dump(const char *name) const
+   {
+      printf("%s transitions\n", name);
+
+      for ( uint8_t i=0; i<count; ++i )
+      {
+         const entry_t &e = (*this)[i];
+
+         printf(
+            "  %8lu %-14s %s -> %s\n",
+            (unsigned long)e.time, e.event ? e.event : "?", e.src, e.dst
+         );
+      }
+   }
+#endif
+
+private:
+   /** Name of an event with a static c_str() */
+   template <class TEvent>
+   static auto name_of(int) -> decltype(TEvent::c_str())
+   {
+      return TEvent::c_str();
+   }
+
+   /** Other events (i.e. internal to the SML) have no name */
+   template <class TEvent>
+   static const char *name_of(...)
+   {
+      return nullptr;
+   }
+};
+
+/**@}*/
+/**@}*/
+#endif /* ndef sm_logger_hpp_HAS_ALREADY_BEEN_INCLUDED */
@@ -285,6 +285,9 @@ static inline void sysclk_lock(void)
 
 extern void sysclk_init(void);
 
+/** Clock the RTC from the internal 32.768kHz oscillator, which runs in standby */
+extern void sysclk_enable_rtc(void);
+
 //@}
 
 #endif /* !__ASSEMBLY__ */
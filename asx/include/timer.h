@@ -96,6 +96,9 @@ timer_count_t timer_get_count_from_now( timer_count_t count );
 /** Get time elapsed from a previous time */
 timer_count_t timer_time_lapsed_since( timer_count_t count );
 
+/** Get a free running count of microseconds for short measurements */
+uint16_t timer_get_us( void );
+
 /** Arm a timer */
 timer_instance_t timer_arm(
 	reactor_handle_t reactor,
@@ -106,6 +109,25 @@ timer_instance_t timer_arm(
 /** Cancel an active timer instance */
 bool timer_cancel(timer_instance_t);
 
+#ifdef CLOCK_SCALE
+/** Follow a change of the main clock prescaler */
+void timer_rescale( uint8_t shift );
+#endif
+
+#ifdef REACTOR_STANDBY
+/** No timer is armed - see timer_idle_for */
+#define TIMER_IDLE_FOREVER ((timer_count_t)-1)
+
+/** Time until the next timer expires */
+timer_count_t timer_idle_for( void );
+
+/** Hand the time over to the RTC for a standby of up to the given time */
+bool timer_suspend( timer_count_t count );
+
+/** Take the time back from the RTC after a standby */
+timer_count_t timer_resume( void );
+#endif
+
 #ifdef __cplusplus
 }
 #endif
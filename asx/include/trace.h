@@ -0,0 +1,114 @@
+#ifndef trace_HAS_ALREADY_BEEN_INCLUDED
+#define trace_HAS_ALREADY_BEEN_INCLUDED
+/**
+ * @file
+ * Trace API declaration
+ * @addtogroup service
+ * @{
+ * @addtogroup trace
+ * @{
+ *****************************************************************************
+ * Compact binary trace of the reactor, the timer and the digital I/Os.
+ * Each event is a 6 bytes record (event, id, time in us) kept in a ring
+ *  buffer of TRACE_SIZE records. Once full, the oldest record is dropped,
+ *  and the number dropped is given by a trace_lost record.
+ *
+ * The records are drained in the idle time of the reactor, as a UART-like
+ *  stream (8N1, TRACE_BAUD) on TRACE_PIN, if the board defines it. Each
+ *  record is sent as TRACE_SYNC followed by the 6 bytes, little endian.
+ *  One byte is sent per pass of the reactor, so a handler never waits more
+ *  than a byte time (20us at 500kbaud).
+ * The host builds write the same stream to a file (trace_posix_dump).
+ * make/trace.py converts the stream to the Chrome trace format, to be
+ *  loaded in chrome://tracing or ui.perfetto.dev.
+ *
+ * Recording costs about 5us per event at 20MHz. Enabled with TRACE, else
+ *  trace_event expands to nothing.
+ * @author gax
+ */
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef TRACE
+#include "conf_board.h"
+#endif
+
+/** Byte which starts each record of the stream */
+#define TRACE_SYNC 0xA5
+
+/**
+ * @def TRACE_DRAIN
+ * Defined if the records are drained on TRACE_PIN
+ */
+#if defined(TRACE) && defined(TRACE_PIN) && !defined(_POSIX)
+#  define TRACE_DRAIN
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Events recorded. The id is given for each */
+typedef enum
+{
+   trace_notify = 1,       ///< reactor_notify - the handle
+   trace_dispatch_start,   ///< A handler is called - its handle
+   trace_dispatch_end,     ///< The handler returns - its handle
+   trace_timer_arm,        ///< timer_arm - the handle to notify
+   trace_timer_cancel,     ///< timer_cancel of a pending timer - the handle
+   trace_timer_fire,       ///< A timer is due - the handle notified
+   trace_pin_edge,         ///< Edge of a direct input - the pin, and the level in bit 7
+   trace_input_change,     ///< A sampled input changes once filtered - as trace_pin_edge
+   trace_output_set,       ///< A digital output is set - as trace_pin_edge
+   trace_sleep,            ///< The reactor has nothing to do - 0
+   trace_wake,             ///< The reactor is woken up - 0
+   trace_lost,             ///< Records dropped before the next one - the number, up to 255
+} trace_event_t;
+
+/** A record, as stored and streamed */
+typedef struct __attribute__((packed))
+{
+   uint8_t event;
+   uint8_t id;
+   uint32_t us;
+} trace_record_t;
+
+/** Set TRACE_PIN idle (high), if the records are drained */
+void trace_init(void);
+
+/** Record an event, time stamped with the time now */
+void trace_record(trace_event_t event, uint8_t id);
+
+#ifdef TRACE_DRAIN
+/**
+ * Send the next byte of the stream on TRACE_PIN
+ * @return true if a byte was sent
+ */
+bool trace_drain(void);
+#endif
+
+#ifdef _POSIX
+/**
+ * Write the records held to a file, as streamed
+ * @return false if the file cannot be written
+ */
+bool trace_posix_dump(const char *path);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+/** Id of a pin and its level */
+#define TRACE_ID_OF_PIN(pin, level) ((uint8_t)((pin) | ((level) ? 0x80 : 0)))
+
+/** Record an event, if the trace is enabled */
+#ifdef TRACE
+#  define trace_event(event, id) trace_record(event, id)
+#else
+#  define trace_event(event, id) do {} while (0)
+#endif
+
+/** @} */
+/** @} */
+#endif /* ndef trace_HAS_ALREADY_BEEN_INCLUDED */
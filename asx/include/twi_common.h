@@ -54,6 +54,13 @@
  * \{
  */
 
+/*!
+ * \brief Largest address segment of a package. Can be set by conf_twim.h
+ */
+#ifndef TWI_ADDR_MAX_LENGTH
+#define TWI_ADDR_MAX_LENGTH 4
+#endif
+
 /*!
  * \brief Callback from the interrupt to indicate end of the packet
  */
@@ -80,8 +87,8 @@ typedef struct
   //! TWI chip address to communicate with.
   char chip;
   //! TWI address/commands to issue to the other chip (node).
-  uint8_t addr[3];
-  //! Length of the TWI data address segment (1-3 bytes).
+  uint8_t addr[TWI_ADDR_MAX_LENGTH];
+  //! Length of the TWI data address segment (1-TWI_ADDR_MAX_LENGTH bytes).
   int addr_length;
   //! Where to find the data to be written.
   void *buffer;
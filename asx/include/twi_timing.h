@@ -0,0 +1,114 @@
+#ifndef twi_timing_HAS_ALREADY_BEEN_INCLUDED
+#define twi_timing_HAS_ALREADY_BEEN_INCLUDED
+/**
+ * @file
+ * TWI bus timing API declaration
+ * @addtogroup service
+ * @{
+ * @addtogroup twi_timing
+ * @{
+ *****************************************************************************
+ * Timing model of the TWI bus.
+ * Computes the baud register from the bus frequency and the rise time, and
+ *  the time a transaction holds the bus.
+ * The functions are pure, so the same model is used by the master driver
+ *  and by the host tests.
+ * The rise time depends on the pull-up resistors and the bus capacitance.
+ *  The defaults assume a short bus (<100pF) on a PCB.
+ * @author gax
+ */
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Highest frequency of the fast mode. Above, the fast mode plus is required */
+#define TWI_FM_MAX_FREQUENCY 400000
+
+/** Frequency of the fast mode plus profile */
+#define TWI_FMP_FREQUENCY 1000000
+
+/** Rise time in standard mode (100kHz) assuming 4.7kOhm */
+#ifndef TWI_RISE_TIME_SM_NS
+#define TWI_RISE_TIME_SM_NS 600
+#endif
+
+/** Rise time in fast mode (400kHz) assuming 2.2kOhm */
+#ifndef TWI_RISE_TIME_FM_NS
+#define TWI_RISE_TIME_FM_NS 350
+#endif
+
+/** Rise time in fast mode plus (1MHz) assuming 1kOhm. The spec allows 120ns at most */
+#ifndef TWI_RISE_TIME_FMP_NS
+#define TWI_RISE_TIME_FMP_NS 120
+#endif
+
+/**
+ * Below 400kHz, the bus is assumed to have the pull-ups of the standard mode
+ * @return The rise time to account for at the given bus frequency
+ */
+static inline uint16_t twi_timing_rise_time(uint32_t f_scl)
+{
+   if ( f_scl > TWI_FM_MAX_FREQUENCY )
+   {
+      return TWI_RISE_TIME_FMP_NS;
+   }
+   else if ( f_scl == TWI_FM_MAX_FREQUENCY )
+   {
+      return TWI_RISE_TIME_FM_NS;
+   }
+
+   return TWI_RISE_TIME_SM_NS;
+}
+
+/**
+ * Compute the baud of the master (datasheet formula)
+ *  BAUD = f_cpu / (2 * f_scl) - (5 + f_cpu * t_rise / 2)
+ * @return The baud value, which could be out of range
+ */
+static inline int16_t twi_timing_baud(uint32_t f_cpu, uint32_t f_scl, uint16_t t_rise_ns)
+{
+   return (int16_t)((f_cpu / f_scl) / 2) - (5 + (int16_t)(((f_cpu / 1000000) * t_rise_ns) / 2000));
+}
+
+/**
+ * Compute the actual frequency of the bus for a baud value
+ *  f_scl = f_cpu / (10 + 2 * BAUD + f_cpu * t_rise)
+ */
+static inline uint32_t twi_timing_frequency(uint32_t f_cpu, uint8_t baud, uint16_t t_rise_ns)
+{
+   return f_cpu / (10 + 2 * (uint32_t)baud + ((f_cpu / 1000000) * t_rise_ns) / 1000);
+}
+
+/**
+ * Compute how long a write then read transaction holds the bus.
+ * Each byte is 9 clocks (8 bits and the ack), and the start, repeated start
+ *  and stop conditions take about 1 clock each. Clock stretching by the slave
+ *  is not accounted for.
+ * @param f_scl The actual frequency of the bus
+ * @param write Number of bytes written (excluding the address)
+ * @param read Number of bytes read (excluding the address). 0 for a write only
+ * @return The duration in nanoseconds
+ */
+static inline uint32_t twi_timing_transaction_ns(uint32_t f_scl, uint8_t write, uint8_t read)
+{
+   // Start, address and data, stop
+   uint32_t clocks = 1 + 9 * (1 + (uint32_t)write) + 1;
+
+   if ( read )
+   {
+      // Repeated start, address and data
+      clocks += 1 + 9 * (1 + (uint32_t)read);
+   }
+
+   return (uint32_t)(((uint64_t)clocks * 1000000000) / f_scl);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+/** @} */
+/** @} */
+#endif /* ndef twi_timing_HAS_ALREADY_BEEN_INCLUDED */
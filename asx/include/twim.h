@@ -143,6 +143,23 @@ static inline void twi_master_disable(TWI_t *twi)
 
 status_code_t twim_release();
 
+/*! \brief Start or chain a no_wait transfer without waiting for the bus
+ *
+ * \param twi       Base address of the TWI (i.e. &TWI_t).
+ * \param package   Package information and data, kept until its callback
+ * \param read      Selects the transfer direction
+ * \return STATUS_OK if started or queued, ERR_BUSY if the queue is full
+ */
+status_code_t twi_master_queue(TWI_t *twi, const twi_package_t *package,
+		bool read);
+
+/*! \brief Clock out a slave holding the bus and restart the TWI master
+ *
+ * \param twi       Base address of the TWI (i.e. &TWI_t).
+ * \return STATUS_OK if the bus is released, ERR_IO_ERROR otherwise
+ */
+status_code_t twim_recover_bus(TWI_t *twi);
+
 
 /**
  * \internal
@@ -0,0 +1,232 @@
+/**
+ * @addtogroup service
+ * @{
+ * @addtogroup clock_scale
+ * @{
+ *****************************************************************************
+ * Implementation of the clock scaling.
+ * Only the main clock prescaler changes, so the oscillator keeps running and
+ *  the change is immediate. The prescaler is a power of 2 so the 1ms tick
+ *  stays a whole number of ticks.
+ * The load is measured at the current clock. The thresholds leave a margin
+ *  so that a load which scales down does not scale up right away.
+ *****************************************************************************
+ * @file
+ * Implementation of the clock scaling API
+ * @author gax
+ * @internal
+ */
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "compiler.h"
+#include "utils/interrupt.h"
+#include "sysclk.h"
+#include "reactor.h"
+#include "timer.h"
+#include "clock_scale.h"
+
+/************************************************************************/
+/* Defines                                                              */
+/************************************************************************/
+
+/**
+ * @def CLOCK_SCALE_SHIFT
+ * The scaled clock is the full speed divided by 2^CLOCK_SCALE_SHIFT (1 to 4).
+ * Defaults to 5MHz from 20MHz.
+ */
+#ifndef CLOCK_SCALE_SHIFT
+#  define CLOCK_SCALE_SHIFT 2
+#endif
+
+/**
+ * @def CLOCK_SCALE_WINDOW_MS
+ * Period of the measure of the load
+ */
+#ifndef CLOCK_SCALE_WINDOW_MS
+#  define CLOCK_SCALE_WINDOW_MS TIMER_MILLISECONDS(50)
+#endif
+
+/**
+ * @def CLOCK_SCALE_DOWN_PERCENT
+ * Load at full speed under which the clock is scaled down
+ */
+#ifndef CLOCK_SCALE_DOWN_PERCENT
+#  define CLOCK_SCALE_DOWN_PERCENT 10
+#endif
+
+/**
+ * @def CLOCK_SCALE_UP_PERCENT
+ * Load at the scaled clock above which the clock is back to full speed
+ */
+#ifndef CLOCK_SCALE_UP_PERCENT
+#  define CLOCK_SCALE_UP_PERCENT 60
+#endif
+
+/**
+ * @def CLOCK_SCALE_PRIO
+ * Priority of the measure of the load
+ */
+#ifndef CLOCK_SCALE_PRIO
+#  define CLOCK_SCALE_PRIO reactor_prio_low
+#endif
+
+#if CONFIG_SYSCLK_PSDIV != SYSCLK_PSDIV_1
+#  error The clock must be at full speed to be scaled
+#endif
+
+#if (CLOCK_SCALE_DOWN_PERCENT << CLOCK_SCALE_SHIFT) >= CLOCK_SCALE_UP_PERCENT
+#  error The clock would scale up right after scaling down
+#endif
+
+#if CLOCK_SCALE_SHIFT == 1
+#  define CLOCK_SCALE_PSDIV SYSCLK_PSDIV_2
+#elif CLOCK_SCALE_SHIFT == 2
+#  define CLOCK_SCALE_PSDIV SYSCLK_PSDIV_4
+#elif CLOCK_SCALE_SHIFT == 3
+#  define CLOCK_SCALE_PSDIV SYSCLK_PSDIV_8
+#elif CLOCK_SCALE_SHIFT == 4
+#  define CLOCK_SCALE_PSDIV SYSCLK_PSDIV_16
+#else
+#  error Bad CLOCK_SCALE_SHIFT value
+#endif
+
+/************************************************************************/
+/* Local variables                                                      */
+/************************************************************************/
+
+/** Current shift of the clock. 0 at full speed */
+static volatile uint8_t _clock_scale_shift = 0;
+
+/** Number of holds on the full speed */
+static volatile uint8_t _clock_scale_holds = 0;
+
+/** Peripheral to tell of the changes */
+static clock_scale_hook_t _clock_scale_hook = NULL;
+
+/** Time asleep (ms) at the start of the window */
+static uint32_t _clock_scale_asleep = 0;
+
+/************************************************************************/
+/* Private functions                                                    */
+/************************************************************************/
+
+/** Change the clock, and everything which counts with it */
+static void _clock_scale_set(uint8_t shift)
+{
+   irqflags_t flags = cpu_irq_save();
+
+   sysclk_set_prescalers(shift ? CLOCK_SCALE_PSDIV : SYSCLK_PSDIV_1);
+   timer_rescale(shift);
+   _clock_scale_shift = shift;
+
+   if ( _clock_scale_hook != NULL )
+   {
+      _clock_scale_hook();
+   }
+
+   cpu_irq_restore(flags);
+}
+
+/** Called at the end of each window to measure the load */
+static void _clock_scale_check(void *arg)
+{
+   reactor_sleep_stats_t stats;
+   uint32_t asleep, busy;
+
+   reactor_get_sleep_stats(&stats);
+   asleep = stats.idle + stats.standby;
+   busy = CLOCK_SCALE_WINDOW_MS - Min(asleep - _clock_scale_asleep, (uint32_t)CLOCK_SCALE_WINDOW_MS);
+   _clock_scale_asleep = asleep;
+
+   // A hold keeps the full speed
+   if ( _clock_scale_holds )
+   {
+      return;
+   }
+
+   if ( _clock_scale_shift == 0 )
+   {
+      if ( busy * 100 < CLOCK_SCALE_WINDOW_MS * CLOCK_SCALE_DOWN_PERCENT )
+      {
+         _clock_scale_set(CLOCK_SCALE_SHIFT);
+      }
+   }
+   else if ( busy * 100 > CLOCK_SCALE_WINDOW_MS * CLOCK_SCALE_UP_PERCENT )
+   {
+      _clock_scale_set(0);
+   }
+}
+
+/************************************************************************/
+/* Public API                                                           */
+/************************************************************************/
+
+/**
+ * Start measuring the load, and scale the clock accordingly.
+ * The clock starts at full speed.
+ */
+void clock_scale_init(void)
+{
+   reactor_handle_t react_check = reactor_register(_clock_scale_check, CLOCK_SCALE_PRIO, 1);
+
+   timer_arm(react_check, timer_get_count_from_now(CLOCK_SCALE_WINDOW_MS), CLOCK_SCALE_WINDOW_MS, NULL);
+}
+
+/**
+ * Keep the clock at full speed, switching to it at once if scaled.
+ * Each hold must be released. Can be called from an interrupt.
+ */
+void clock_scale_hold(void)
+{
+   irqflags_t flags = cpu_irq_save();
+
+   ++_clock_scale_holds;
+
+   if ( _clock_scale_shift )
+   {
+      _clock_scale_set(0);
+   }
+
+   cpu_irq_restore(flags);
+}
+
+/**
+ * Release a hold. The clock is scaled down again by the next measure of
+ *  the load, if low. Can be called from an interrupt.
+ */
+void clock_scale_release(void)
+{
+   irqflags_t flags = cpu_irq_save();
+
+   if ( _clock_scale_holds )
+   {
+      --_clock_scale_holds;
+   }
+
+   cpu_irq_restore(flags);
+}
+
+/**
+ * @return The current frequency of CLK_PER (Hz)
+ */
+uint32_t clock_scale_get_hz(void)
+{
+   return F_CPU >> _clock_scale_shift;
+}
+
+/**
+ * Set the hook of a peripheral clocked by CLK_PER which must follow the
+ *  clock (i.e. a baud rate). It is called with the interrupts disabled,
+ *  right after the change. Whilst the full speed is held, the clock does
+ *  not change.
+ * @param hook The hook, or NULL
+ */
+void clock_scale_set_hook(clock_scale_hook_t hook)
+{
+   _clock_scale_hook = hook;
+}
+
+/**@}*/
+/**@}*/
+/**@} ---------------------------  End of file  --------------------------- */
@@ -0,0 +1,111 @@
+/**
+ * @addtogroup service
+ * @{
+ * @addtogroup crc
+ * @{
+ *****************************************************************************
+ * Implementation of the CRC API.
+ * The CRC-8 is processed 4 bits at a time which is a good trade-off
+ *  between flash and speed on the AVR (about 30 cycles per byte for the
+ *  CRC-8, 45 for the CRC-16).
+ *****************************************************************************
+ * @file
+ * Implementation of the CRC API
+ * @author gax
+ * @internal
+ */
+#include "crc.h"
+
+/************************************************************************/
+/* Local variables                                                      */
+/************************************************************************/
+
+/**
+ * CRC-8 of each nibble for the polynomial 0x2F.
+ * On the AVRxt core, const data is kept in flash (mapped in the data space)
+ */
+static const uint8_t _crc8_nibble_table[16] = {
+   0x00, 0x2F, 0x5E, 0x71, 0xBC, 0x93, 0xE2, 0xCD,
+   0x57, 0x78, 0x09, 0x26, 0xEB, 0xC4, 0xB5, 0x9A
+};
+
+/** CRC-16 of each nibble for the polynomial 0x1021 (CCITT) */
+static const uint16_t _crc16_nibble_table[16] = {
+   0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+   0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+};
+
+/************************************************************************/
+/* Public API                                                           */
+/************************************************************************/
+
+/**
+ * Add one byte to a running CRC-8
+ * @param crc The CRC so far. Use CRC8_INIT to start a new CRC
+ * @param data The byte to add
+ * @return The updated CRC
+ */
+uint8_t crc8_update(uint8_t crc, uint8_t data)
+{
+   crc ^= data;
+   crc = (uint8_t)(crc << 4) ^ _crc8_nibble_table[crc >> 4];
+   crc = (uint8_t)(crc << 4) ^ _crc8_nibble_table[crc >> 4];
+
+   return crc;
+}
+
+/**
+ * Compute the CRC-8 of a block of data
+ * @param data Pointer to the first byte
+ * @param length Number of bytes to process
+ * @param seed Starting value. Use CRC8_INIT or a previous CRC to chain blocks
+ * @return The CRC of the block
+ */
+uint8_t crc8(const uint8_t *data, uint8_t length, uint8_t seed)
+{
+   uint8_t crc = seed;
+
+   while ( length-- )
+   {
+      crc = crc8_update(crc, *data++);
+   }
+
+   return crc;
+}
+
+/**
+ * Add one byte to a running CRC-16
+ * @param crc The CRC so far. Use CRC16_INIT to start a new CRC
+ * @param data The byte to add
+ * @return The updated CRC
+ */
+uint16_t crc16_update(uint16_t crc, uint8_t data)
+{
+   crc = (uint16_t)(crc << 4) ^ _crc16_nibble_table[(crc >> 12) ^ (data >> 4)];
+   crc = (uint16_t)(crc << 4) ^ _crc16_nibble_table[(crc >> 12) ^ (data & 0x0F)];
+
+   return crc;
+}
+
+/**
+ * Compute the CRC-16 of a block of data
+ * @param data Pointer to the first byte
+ * @param length Number of bytes to process
+ * @param seed Starting value. Use CRC16_INIT or a previous CRC to chain blocks
+ * @return The CRC of the block
+ */
+uint16_t crc16(const uint8_t *data, uint16_t length, uint16_t seed)
+{
+   uint16_t crc = seed;
+
+   while ( length-- )
+   {
+      crc = crc16_update(crc, *data++);
+   }
+
+   return crc;
+}
+
+/**@}*/
+/**@}*/
+/**@} ---------------------------  End of file  --------------------------- */
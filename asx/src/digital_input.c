@@ -14,6 +14,7 @@
 #include "alert.h"
 #include "digital_input.h"
 #include "timer.h"
+#include "trace.h"
 #include "mem.h"
 
 
@@ -62,6 +63,14 @@ static digital_input_t *_first_direct = {0};
 /** Reactor for managing the sampling of the inputs */
 static reactor_handle_t _react_sample;
 
+/** Repeating timer of the sampling */
+static timer_instance_t _sample_timer = TIMER_INVALID_INSTANCE;
+
+#ifdef REACTOR_STANDBY
+/** Sampled pins which wake the CPU up from standby, per port */
+static volatile uint8_t _wake_mask[2] = {0,0};
+#endif
+
 /** Reactor for acknowledging the interrupts */
 static reactor_handle_t _react_direct_handler;
 
@@ -121,6 +130,7 @@ static void _digital_input_sample(void *arg)
          pin_and_value_t pav = {.pin=di->pin};
          pav.value = di->sampled.input == di_on_e ? true : false;
          
+         trace_event(trace_input_change, TRACE_ID_OF_PIN(di->pin, pav.value));
          reactor_notify(di->handler, pav.as_arg);
       }
       
@@ -237,6 +247,7 @@ static void _handle_pin_change_isr(
          
          // Turn interrupts off until acknowledge is called
          ioport_enable_pin(pav.pin);
+         trace_event(trace_pin_edge, TRACE_ID_OF_PIN(pav.pin, port_value & (1 << i)));
          
          // Handle in the reactor - not in the interrupt
          reactor_notify( _react_direct_handler, pav.as_arg);
@@ -329,7 +340,7 @@ void digital_input_init(void)
       _clear_interrupt, DIGITAL_INPUT_ACK_PRIO, 1);
 
    // Start a repeating timer to sample the inputs at regular interval
-   timer_arm(_react_sample, timer_get_count_from_now(0), DIGITAL_INPUT_SAMPLE_PERIOD, NULL);
+   _sample_timer = timer_arm(_react_sample, timer_get_count_from_now(0), DIGITAL_INPUT_SAMPLE_PERIOD, NULL);
 }
 
 /**
@@ -341,12 +352,75 @@ bool digital_input_value(digital_input_handle_t di)
    return di->sampled.input == di_on_e ? true : false;
 }
 
+#ifdef REACTOR_STANDBY
+/**
+ * Stop the sampling before a standby, as its timer stops.
+ * Only done if all sampled inputs are at rest (no integration on-going).
+ * The sampled pins sense both edges instead, so a change wakes the CPU up
+ *  to sample again. Called with the interrupts disabled.
+ * @return true if the sampling is stopped
+ */
+bool digital_input_suspend(void)
+{
+   digital_input_t *di;
+
+   for ( di = _first_sampled; di; di = di->next )
+   {
+      bool level = ioport_get_pin_level(di->pin);
+
+      if ( level ? (di->sampled.integrator != di->sampled.integrator_threshold) : (di->sampled.integrator != 0) )
+      {
+         return false;
+      }
+   }
+
+   timer_cancel(_sample_timer);
+   _sample_timer = TIMER_INVALID_INSTANCE;
+
+   for ( di = _first_sampled; di; di = di->next )
+   {
+      _wake_mask[ioport_pin_to_port_id(di->pin)] |= ioport_pin_to_mask(di->pin);
+   }
+
+   // The ioport sense modes do not match the ISC values of this family
+   ioport_set_port_sense_mode(IOPORT_PORTA, _wake_mask[IOPORT_PORTA], (enum ioport_sense)PORT_ISC_BOTHEDGES_gc);
+   ioport_set_port_sense_mode(IOPORT_PORTB, _wake_mask[IOPORT_PORTB], (enum ioport_sense)PORT_ISC_BOTHEDGES_gc);
+
+   return true;
+}
+
+/**
+ * Stop sensing the edges of the sampled pins, and sample them right away
+ * Called with the interrupts disabled, after a digital_input_suspend.
+ */
+void digital_input_resume(void)
+{
+   ioport_enable_port(IOPORT_PORTA, _wake_mask[IOPORT_PORTA]);
+   ioport_enable_port(IOPORT_PORTB, _wake_mask[IOPORT_PORTB]);
+
+   PORTA.INTFLAGS = _wake_mask[IOPORT_PORTA];
+   PORTB.INTFLAGS = _wake_mask[IOPORT_PORTB];
+
+   _wake_mask[IOPORT_PORTA] = 0;
+   _wake_mask[IOPORT_PORTB] = 0;
+
+   _sample_timer = timer_arm(_react_sample, timer_get_count_from_now(0), DIGITAL_INPUT_SAMPLE_PERIOD, NULL);
+}
+#endif
+
 /************************************************************************/
 /* ISRs                                                                 */
 /************************************************************************/
+#ifdef REACTOR_STANDBY
+   // The edges of the sampled pins only wake up the CPU
+   #define DIGITAL_INPUT_DIRECT_FLAGS(port) (PORT##port.INTFLAGS & ~_wake_mask[IOPORT_PORT##port])
+#else
+   #define DIGITAL_INPUT_DIRECT_FLAGS(port) PORT##port.INTFLAGS
+#endif
+
 ISR(PORTA_PORT_vect)
 {
-   _handle_pin_change_isr(IOPORT_PORTA, PORTA.IN, PORTA.INTFLAGS);
+   _handle_pin_change_isr(IOPORT_PORTA, PORTA.IN, DIGITAL_INPUT_DIRECT_FLAGS(A));
 
    // Clear the interrupt
    PORTA.INTFLAGS |= PORTA.INTFLAGS;
@@ -354,7 +428,7 @@ ISR(PORTA_PORT_vect)
 
 ISR(PORTB_PORT_vect)
 {
-   _handle_pin_change_isr(IOPORT_PORTB, PORTB.IN, PORTB.INTFLAGS);
+   _handle_pin_change_isr(IOPORT_PORTB, PORTB.IN, DIGITAL_INPUT_DIRECT_FLAGS(B));
 
    // Clear the interrupt
    PORTB.INTFLAGS |= PORTB.INTFLAGS;
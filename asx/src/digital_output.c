@@ -9,6 +9,7 @@
  * @internal
  */
 #include "digital_output.h"
+#include "trace.h"
 #include "mem.h"
 
 #include <ctype.h> // For isdigit
@@ -106,10 +107,12 @@ static inline bool _parse_next(_digital_output_t *out)
          if (c == '+')
          {
             ioport_set_pin_level(out->pin, true);
+            trace_event(trace_output_set, TRACE_ID_OF_PIN(out->pin, true));
          }
          else if ( c == '-' )
          {
             ioport_set_pin_level(out->pin, false);
+            trace_event(trace_output_set, TRACE_ID_OF_PIN(out->pin, false));
          }
          else
          {
@@ -186,6 +189,7 @@ void digitial_output_set(digital_output_t handle, bool value)
 
    _cancel_sequence(out->timer);
    ioport_set_pin_level(out->pin, value);
+   trace_event(trace_output_set, TRACE_ID_OF_PIN(out->pin, value));
 }
 
 void digitial_output_toggle(digital_output_t handle)
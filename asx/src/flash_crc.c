@@ -0,0 +1,159 @@
+/**
+ * @addtogroup service
+ * @{
+ * @addtogroup flash_crc
+ * @{
+ *****************************************************************************
+ * Implementation of the flash self-test.
+ * The CRCSCAN peripheral is not used, as it halts the CPU for the whole scan
+ *  (about 2.5ms for 16K) which would hold the handlers back. The CRC-16 is
+ *  rather computed in software, reading the flash from the data space.
+ *****************************************************************************
+ * @file
+ * Implementation of the flash self-test API
+ * @author gax
+ * @internal
+ */
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef _POSIX
+#include <avr/io.h>
+#endif
+
+#include "alert.h"
+#include "crc.h"
+#include "reactor.h"
+#include "timer.h"
+#include "flash_crc.h"
+
+/************************************************************************/
+/* Defines                                                              */
+/************************************************************************/
+
+/**
+ * @def FLASH_CRC_BLOCK
+ * Number of bytes processed by each step in the idle time
+ */
+#ifndef FLASH_CRC_BLOCK
+#  define FLASH_CRC_BLOCK 2
+#endif
+
+/**
+ * @def FLASH_CRC_PERIOD_MS
+ * Time from the start of a pass to the start of the next one
+ */
+#ifndef FLASH_CRC_PERIOD_MS
+#  define FLASH_CRC_PERIOD_MS TIMER_SECONDS(10)
+#endif
+
+/**
+ * The flash as seen from the data space, and the size covered by the CRC.
+ * The host builds provide their own image.
+ */
+#ifdef _POSIX
+extern const uint8_t *flash_crc_posix_image;
+extern uint16_t flash_crc_posix_crc_at;
+#  define FLASH_CRC_BASE flash_crc_posix_image
+#  define FLASH_CRC_AT flash_crc_posix_crc_at
+#else
+#  define FLASH_CRC_BASE ((const uint8_t *)MAPPED_PROGMEM_START)
+#  define FLASH_CRC_AT ((uint16_t)CRC_AT)
+#endif
+
+/************************************************************************/
+/* Local variables                                                      */
+/************************************************************************/
+
+/** Next address to read */
+static uint16_t _flash_crc_address = 0;
+
+/** CRC so far of the current pass */
+static uint16_t _flash_crc = CRC16_INIT;
+
+/** When the current pass started */
+static timer_count_t _flash_crc_started_at = 0;
+
+/** Passes done and failed */
+static uint16_t _flash_crc_passes = 0;
+static bool _flash_crc_failed = false;
+
+/************************************************************************/
+/* Private helpers                                                      */
+/************************************************************************/
+
+/**
+ * Idle task of the reactor - process a block, or wait for the next pass
+ * @return true if there is more to process straight away
+ */
+static bool _flash_crc_step(void)
+{
+   const uint8_t *flash = FLASH_CRC_BASE;
+
+   if ( _flash_crc_address == FLASH_CRC_AT )
+   {
+      if ( timer_time_lapsed_since(_flash_crc_started_at) < FLASH_CRC_PERIOD_MS )
+      {
+         return false;
+      }
+
+      _flash_crc_address = 0;
+      _flash_crc = CRC16_INIT;
+      _flash_crc_started_at = timer_get_count();
+   }
+
+   for (uint8_t i=0; i<FLASH_CRC_BLOCK && _flash_crc_address != FLASH_CRC_AT; ++i)
+   {
+      _flash_crc = crc16_update(_flash_crc, flash[_flash_crc_address++]);
+   }
+
+   if ( _flash_crc_address == FLASH_CRC_AT )
+   {
+      // The CRC is stored big endian
+      uint16_t expected = ((uint16_t)flash[FLASH_CRC_AT] << 8) | flash[FLASH_CRC_AT + 1];
+
+      ++_flash_crc_passes;
+
+      if ( _flash_crc != expected )
+      {
+         _flash_crc_failed = true;
+         alert();
+      }
+
+      return false;
+   }
+
+   return true;
+}
+
+/************************************************************************/
+/* Public API                                                           */
+/************************************************************************/
+
+/** Start checking the flash in the idle time of the reactor */
+void flash_crc_init(void)
+{
+   _flash_crc_address = 0;
+   _flash_crc = CRC16_INIT;
+   _flash_crc_started_at = timer_get_count();
+   _flash_crc_passes = 0;
+   _flash_crc_failed = false;
+
+   reactor_set_idle_task(_flash_crc_step);
+}
+
+/** @return true once a pass has found a CRC mismatch */
+bool flash_crc_failed(void)
+{
+   return _flash_crc_failed;
+}
+
+/** @return The number of full passes done so far */
+uint16_t flash_crc_passes(void)
+{
+   return _flash_crc_passes;
+}
+
+/**@}*/
+/**@}*/
+/**@} ---------------------------  End of file  --------------------------- */
@@ -28,6 +28,10 @@
 #include "timer.h"
 #include "piezzo.h"
 
+#ifdef CLOCK_SCALE
+#include "clock_scale.h"
+#endif
+
 #include "conf_piezzo.h"
 
 /************************************************************************/
@@ -135,6 +139,14 @@ static inline uint16_t _get_cmp_value(void)
 
 static inline void _set_timer_compare_period(uint16_t new_tc_value)
 {
+#ifdef CLOCK_SCALE
+   // The pitch is counted in CLK_PER, which must not change whilst playing
+   if ( ! (PIEZZO_TCB.SINGLE.CTRLB & TCA_SINGLE_CMP2EN_bm) )
+   {
+      clock_scale_hold();
+   }
+#endif
+
    PIEZZO_TCB.SINGLE.CNT = 0;
    PIEZZO_TCB.SINGLE.CMP0 = new_tc_value;
 
@@ -144,6 +156,13 @@ static inline void _set_timer_compare_period(uint16_t new_tc_value)
 
 static inline void _stop_timer_compare(void)
 {
+#ifdef CLOCK_SCALE
+   if ( PIEZZO_TCB.SINGLE.CTRLB & TCA_SINGLE_CMP2EN_bm )
+   {
+      clock_scale_release();
+   }
+#endif
+
    PIEZZO_TCB.SINGLE.CTRLB &= ~TCA_SINGLE_CMP2EN_bm;
 }
 
@@ -11,6 +11,12 @@
  *  sleep saving power.
  * The reactor cycle time can be monitored defining debug pins REACTOR_IDLE
  *  and REACTOR_BUSY
+ * With REACTOR_STANDBY, the CPU goes into standby rather than idle when no
+ *  timer is due for REACTOR_STANDBY_MIN_MS and the sampled inputs are at
+ *  rest. The RTC keeps the time and wakes the CPU for the next timer, and
+ *  any edge of a sampled input wakes it earlier.
+ * With TRACE, the notifications, the calls of the handlers and the sleeps
+ *  are recorded, and the records are drained in the idle time.
  *****************************************************************************
  * @file
  * Implementation of the reactor API
@@ -30,6 +36,15 @@
 #include "alert.h"
 #include "debug.h"
 #include "reactor.h"
+#include "trace.h"
+
+#ifdef REACTOR_SLEEP_STATS
+#include "timer.h"
+#endif
+
+#ifdef REACTOR_STANDBY
+#include "digital_input.h"
+#endif
 
 #include "debug.h"
 
@@ -46,6 +61,24 @@
 #endif
 
 
+/**
+ * @def REACTOR_STANDBY_MIN_MS
+ * Shortest time to the next timer worth a standby. Waking up from standby
+ *  takes a few us for the main oscillator to start.
+ */
+#ifndef REACTOR_STANDBY_MIN_MS
+   #define REACTOR_STANDBY_MIN_MS 4
+#endif
+
+/**
+ * @def REACTOR_STANDBY_MAX_MS
+ * Longest standby. Must be well within the watchdog period (1s) which
+ *  keeps running in standby.
+ */
+#ifndef REACTOR_STANDBY_MAX_MS
+   #define REACTOR_STANDBY_MAX_MS 500
+#endif
+
 /**
  * @def reactor_mask_t
  * Event a bits in a mask. The type is large enough to support the maximum number of reactors
@@ -93,6 +126,21 @@ static reactor_item_t _handlers[REACTOR_MAX_HANDLERS] = {0};
 /** Lock new registrations */
 static bool reactor_lock = false;
 
+/** Task to run when idle, and if it has more to do before sleeping */
+static reactor_idle_task_t _idle_task = NULL;
+static bool _idle_task_busy = false;
+
+#ifdef REACTOR_SLEEP_STATS
+/** Time spent in each sleep level, and the us of idle not accounted yet */
+static reactor_sleep_stats_t _sleep_stats = {0};
+static uint16_t _idle_us = 0;
+#endif
+
+#ifdef REACTOR_STANDBY
+/** Check of the application before a standby */
+static reactor_standby_check_t _standby_check = NULL;
+#endif
+
 static volatile uint8_t DEBUG_INDEX;
 
 /** Initialize the reactor API */
@@ -150,6 +198,115 @@ reactor_handle_t reactor_register( const reactor_handler_t handler, reactor_prio
 }
 
 
+/**
+ * Set the task to run in the idle time of the reactor.
+ * The task is called in place of sleeping, once after each wake up, and
+ *  again for as long as it returns true. It must return quickly as a
+ *  handler notified meanwhile waits for it.
+ *
+ * @param task The task, or NULL to stop it
+ */
+void reactor_set_idle_task( reactor_idle_task_t task )
+{
+   _idle_task = task;
+   _idle_task_busy = (task != NULL);
+}
+
+#ifdef REACTOR_SLEEP_STATS
+/**
+ * Get the time spent in each sleep level since the reset.
+ * The time awake is the rest of timer_get_count().
+ * @param stats Filled with the times (ms)
+ */
+void reactor_get_sleep_stats( reactor_sleep_stats_t *stats )
+{
+   irqflags_t flags = cpu_irq_save();
+   *stats = _sleep_stats;
+   cpu_irq_restore(flags);
+}
+#endif
+
+/**
+ * Sleep in idle until the next interrupt.
+ * Called with the interrupts disabled.
+ */
+static inline void _reactor_idle(void)
+{
+#ifdef REACTOR_SLEEP_STATS
+   uint16_t start = timer_get_us();
+#endif
+
+   // The AVR guarantees that sleep is executed before any pending interrupts
+   sei();
+   sleep_cpu();
+
+#ifdef REACTOR_SLEEP_STATS
+   _idle_us += timer_get_us() - start;
+
+   if ( _idle_us >= 1000 )
+   {
+      _sleep_stats.idle += _idle_us / 1000;
+      _idle_us %= 1000;
+   }
+#endif
+}
+
+#ifdef REACTOR_STANDBY
+/**
+ * Set the check of the application before a standby
+ * @param check The check, or NULL if the application never vetoes
+ */
+void reactor_set_standby_check( reactor_standby_check_t check )
+{
+   _standby_check = check;
+}
+
+/**
+ * Go into standby if nothing is due soon.
+ * Called with the interrupts disabled and no notification pending.
+ * @return true if the CPU went into standby and is awake again
+ */
+static bool _reactor_standby(void)
+{
+   timer_count_t idle_for;
+
+   if ( _standby_check != NULL && ! _standby_check() )
+   {
+      return false;
+   }
+
+   // Stops the sampling - so its timer does not count
+   if ( ! digital_input_suspend() )
+   {
+      return false;
+   }
+
+   idle_for = timer_idle_for();
+
+   if ( idle_for < REACTOR_STANDBY_MIN_MS || ! timer_suspend(idle_for < REACTOR_STANDBY_MAX_MS ? idle_for : REACTOR_STANDBY_MAX_MS) )
+   {
+      digital_input_resume();
+      return false;
+   }
+
+   debug_set(REACTOR_IDLE);
+   set_sleep_mode(SLEEP_MODE_STANDBY);
+   wdt_reset();
+
+   // As for idle, the sleep is executed before any pending interrupts
+   sei();
+   sleep_cpu();
+   cli();
+
+   set_sleep_mode(SLEEP_MODE_IDLE);
+   _sleep_stats.standby += timer_resume();
+   digital_input_resume();
+   debug_clear(REACTOR_IDLE);
+
+   return true;
+}
+#endif
+
 /**
  * Interrupts are disabled for atomic operations
  * This function can be called from within interrupts
@@ -159,6 +316,7 @@ void reactor_notify( reactor_handle_t handle, void *data )
    irqflags_t flags = cpu_irq_save();
    
    reactor_notifications |= _handlers[handle].mask;
+   trace_event(trace_notify, handle);
    
    // If the queue is full - drop old data
    queue_push_ring(&_handlers[handle].queue, data);
@@ -247,12 +405,51 @@ void reactor_run(void)
 
       if ( reactor_notifications == 0 )
       {
-         debug_set(REACTOR_IDLE);
+         if ( _idle_task_busy )
+         {
+            // A step of the idle task, then back to check the notifications
+            sei();
+            _idle_task_busy = _idle_task();
+            continue;
+         }
 
-         // The AVR guarantees that sleep is executed before any pending interrupts
+#ifdef TRACE_DRAIN
+         // Send the trace, a byte at a time, then back to check the notifications
          sei();
-         sleep_cpu();
-         debug_clear(REACTOR_IDLE);
+
+         if ( trace_drain() )
+         {
+            continue;
+         }
+
+         cli();
+
+         // A notification may have come whilst the interrupts were on
+         if ( reactor_notifications )
+         {
+            continue;
+         }
+#endif
+
+         trace_event(trace_sleep, 0);
+
+#ifdef REACTOR_STANDBY
+         if ( _reactor_standby() )
+         {
+            sei();
+         }
+         else
+#endif
+         {
+            debug_set(REACTOR_IDLE);
+            _reactor_idle();
+            debug_clear(REACTOR_IDLE);
+         }
+
+         trace_event(trace_wake, 0);
+
+         // Give the idle task a go on every wake up
+         _idle_task_busy = (_idle_task != NULL);
       }
       else
       {
@@ -296,7 +493,9 @@ void reactor_run(void)
                sei();
 
                // Call the handler
+               trace_event(trace_dispatch_start, _handle_lookup[i]);
                item->handler(data);
+               trace_event(trace_dispatch_end, _handle_lookup[i]);
                
                // Apply round-robin strategy
                break;
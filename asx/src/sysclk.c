@@ -68,3 +68,13 @@ void sysclk_init(void)
       }
    }
 }
+
+/**
+ * Clock the RTC from the internal 32.768kHz oscillator.
+ * The oscillator runs in standby, so the RTC keeps the time whilst the
+ *  main clock is stopped.
+ */
+void sysclk_enable_rtc(void)
+{
+   RTC.CLKSEL = RTC_CLKSEL_INT32K_gc;
+}
@@ -19,13 +19,29 @@
 #include "timer.h"
 #include "alert.h"
 #include "reactor.h"
+#include "trace.h"
 #include "board.h"
 
+#ifdef REACTOR_STANDBY
+#include "sysclk.h"
+#endif
+
 
 /************************************************************************/
 /* Local macros                                                         */
 /************************************************************************/
 
+/** The TCB counts at 10MHz (CLK_PER/2) when the clock is at full speed */
+#define TIMER_TICKS_PER_MS 10000
+#define TIMER_TICKS_PER_US 10
+
+/** The tick is 2^TIMER_TICK_SHIFT longer once the main clock is scaled */
+#ifdef CLOCK_SCALE
+#  define TIMER_TICK_SHIFT _timer_tick_shift
+#else
+#  define TIMER_TICK_SHIFT 0
+#endif
+
 /************************************************************************/
 /* Local types                                                          */
 /************************************************************************/
@@ -104,6 +120,22 @@ static timer_instance_t _timer_current_instance = TIMER_INVALID_INSTANCE;
 /** The API Handle for the reactor */
 static reactor_handle_t _timer_reactor_handle = 0;
 
+#ifdef CLOCK_SCALE
+/** Shift of the main clock prescaler */
+static uint8_t _timer_tick_shift = 0;
+
+/** Full speed ticks of the current ms not counted by the scaled tick */
+static uint8_t _timer_tick_phase = 0;
+#endif
+
+#ifdef REACTOR_STANDBY
+/** RTC count when the standby started */
+static uint16_t _timer_rtc_start;
+
+/** Time into the current ms (us), carried over the standby */
+static uint16_t _timer_standby_us;
+#endif
+
 /************************************************************************/
 /* Private helpers                                                      */
 /************************************************************************/
@@ -128,6 +160,18 @@ static inline int32_t _timer_distance_of(timer_count_t from, timer_count_t to)
 	return retval;
 }
 
+/** @return The time (us) of the given ticks of the TCB */
+static inline uint16_t _timer_ticks_to_us(uint16_t ticks)
+{
+	return (uint16_t)(ticks << TIMER_TICK_SHIFT) / TIMER_TICKS_PER_US;
+}
+
+/** @return The ticks of the TCB for the given time (us) within a ms */
+static inline uint16_t _timer_us_to_ticks(uint16_t us)
+{
+	return (us * TIMER_TICKS_PER_US) >> TIMER_TICK_SHIFT;
+}
+
 /************************************************************************/
 /* Local API                                                            */
 /************************************************************************/
@@ -158,6 +202,35 @@ timer_count_t timer_get_count(void)
 	return retval;
 }
 
+/**
+ * Get a free running count of microseconds.
+ * The count wraps around every 65ms, so only short durations (like a bus
+ *  transaction) can be measured. Can be called from an interrupt.
+ * @return The current count in microseconds
+ */
+uint16_t timer_get_us(void)
+{
+	uint16_t ms, ticks;
+
+	uint8_t flag = cpu_irq_save();
+	ms = (uint16_t)_timer_free_running_ms_counter;
+#ifndef _WIN32
+	ticks = TIMER_TCB.CNT;
+
+	// The counter wrapped, but the interrupt is not served yet
+	if ( TIMER_TCB.INTFLAGS & TCB_CAPT_bm )
+	{
+		++ms;
+		ticks = TIMER_TCB.CNT;
+	}
+#else
+	ticks = 0;
+#endif
+	cpu_irq_restore(flag);
+
+	return ms * 1000 + _timer_ticks_to_us(ticks);
+}
+
 /**
  * Ready the timer
  * Configure the timer and enable the interrupt.
@@ -172,13 +245,21 @@ void timer_init(void)
 #ifndef _WIN32
 	// Use the Timer type B 1 to create a 1ms interrupt for the reactor
 	TIMER_TCB.CNT = 0;												 // Reset the timer
-	TIMER_TCB.CCMP = 10000;										 // 1ms timer
+	TIMER_TCB.CCMP = TIMER_TICKS_PER_MS;						 // 1ms timer
 	TIMER_TCB.DBGCTRL = 0;											 // Stop the timer on a break point
 	TIMER_TCB.CTRLA = TCB_CLKSEL_DIV2_gc | TCB_ENABLE_bm; // 10Mhz
 	TIMER_TCB.CTRLB = TCB_CNTMODE_INT_gc;						 // Periodic interrupt mode
 	TIMER_TCB.INTCTRL = TCB_CAPT_bm;							 // Turn on 'capture' interrupt
 #endif
 
+#ifdef REACTOR_STANDBY
+	// The RTC free runs at 1024Hz from the 32kHz oscillator, also in standby
+	sysclk_enable_rtc();
+	while ( RTC.STATUS ) {}
+	RTC.PER = 0xFFFF;
+	RTC.CTRLA = RTC_PRESCALER_DIV32_gc | RTC_RUNSTDBY_bm | RTC_RTCEN_bm;
+#endif
+
    // Reset the internal
    for ( i=0; i<TIMER_MAX_CALLBACK; ++i )
    {
@@ -293,6 +374,7 @@ timer_instance_t timer_arm(
 	};
 
 	_timer_future_sorted_list[insertPoint] = next;
+	trace_event(trace_timer_arm, reactor);
 
 	// Move next available slot
 	_timer_slot_avail = _timer_right_of(_timer_slot_avail);
@@ -318,6 +400,120 @@ ISR(TIMER_TCB_INT_VECTOR)
 	reactor_notify(_timer_reactor_handle, NULL);
 }
 
+#ifdef REACTOR_STANDBY
+/**
+ * Time until the next timer expires.
+ * To call with the interrupts disabled, before timer_suspend.
+ * @return The time (ms), 0 if a timer is due, or TIMER_IDLE_FOREVER if none is armed
+ */
+timer_count_t timer_idle_for(void)
+{
+	int32_t distance;
+
+	if ( _timer_slot_active == _timer_slot_avail )
+	{
+		return TIMER_IDLE_FOREVER;
+	}
+
+	distance = _timer_distance_of(
+		_timer_free_running_ms_counter, _timer_future_sorted_list[_timer_slot_active].count);
+
+	return distance > 0 ? (timer_count_t)distance : 0;
+}
+
+/**
+ * Stop the 1ms tick, and let the RTC keep the time for a standby.
+ * The RTC compare wakes the CPU after the given time. To call with the
+ *  interrupts disabled, followed by timer_resume once awake.
+ * @param count Longest standby (ms)
+ * @return false if a tick is pending, and the CPU must not sleep
+ */
+bool timer_suspend(timer_count_t count)
+{
+	if ( TIMER_TCB.INTFLAGS & TCB_CAPT_bm )
+	{
+		return false;
+	}
+
+	// The time into the current ms is carried over
+	_timer_standby_us = _timer_ticks_to_us(TIMER_TCB.CNT);
+	TIMER_TCB.CTRLA &= ~TCB_ENABLE_bm;
+
+	// 1024 RTC counts per second. Wake up a little early rather than late
+	_timer_rtc_start = RTC.CNT;
+
+	while ( RTC.STATUS & RTC_CMPBUSY_bm ) {}
+	RTC.CMP = _timer_rtc_start + (uint16_t)((count * 1024UL) / 1000);
+	RTC.INTFLAGS = RTC_CMP_bm;
+	RTC.INTCTRL = RTC_CMP_bm;
+
+	return true;
+}
+
+/**
+ * Add the time spent in standby, as counted by the RTC, and restart the
+ *  1ms tick in phase. To call with the interrupts disabled.
+ * @return The time spent in standby (ms)
+ */
+timer_count_t timer_resume(void)
+{
+	uint16_t counts = RTC.CNT - _timer_rtc_start;
+
+	// 1000000/1024 us per count is 15625/16
+	uint32_t us = _timer_standby_us + ((uint32_t)counts * 15625) / 16;
+	timer_count_t ms = us / 1000;
+
+	RTC.INTCTRL = 0;
+
+	_timer_free_running_ms_counter += ms;
+	TIMER_TCB.CNT = _timer_us_to_ticks(us % 1000);
+	TIMER_TCB.CTRLA |= TCB_ENABLE_bm;
+
+	if ( ms != 0 )
+	{
+		reactor_notify(_timer_reactor_handle, NULL);
+	}
+
+	return ms;
+}
+
+/** Wakes the CPU from standby. The time is accounted by timer_resume */
+ISR(RTC_CNT_vect)
+{
+	RTC.INTFLAGS = RTC_CMP_bm;
+}
+#endif
+
+#ifdef CLOCK_SCALE
+/**
+ * Follow a change of the main clock prescaler.
+ * The TCB counts slower or faster, so the period of 1ms and the count into
+ *  the current ms are converted to the new tick. The ms counter neither
+ *  gains nor loses time, but for the few cycles of the change. The part of
+ *  a tick lost by the conversion is carried over to the next change.
+ * To call with the interrupts disabled, right after the prescaler changed.
+ * @param shift The main clock is now divided by 2^shift
+ */
+void timer_rescale(uint8_t shift)
+{
+	uint16_t ticks = (TIMER_TCB.CNT << _timer_tick_shift) + _timer_tick_phase;
+	uint16_t period = TIMER_TICKS_PER_MS >> shift;
+	uint16_t count = ticks >> shift;
+
+	// Past the compare, the ms would be missed
+	if ( count >= period )
+	{
+		count = period - 1;
+	}
+
+	TIMER_TCB.CCMP = period;
+	TIMER_TCB.CNT = count;
+
+	_timer_tick_phase = ticks & ((1 << shift) - 1);
+	_timer_tick_shift = shift;
+}
+#endif
+
 /**
  * Allow processing timer events in a reactor pattern.
  * This is called every ms and should be swift, but no race condition should
@@ -336,6 +532,7 @@ void timer_dispatch(void *arg)
 		if (timeNow >= pFuture->count)
 		{
 			// Notify the reactor
+			trace_event(trace_timer_fire, pFuture->reactor);
 			reactor_notify(pFuture->reactor, pFuture->arg);
 
 			// Is it a repeating instance
@@ -388,6 +585,8 @@ bool timer_cancel(timer_instance_t to_cancel)
 
 		if (pFuture->instance == to_cancel)
 		{
+			trace_event(trace_timer_cancel, pFuture->reactor);
+
 			// Now shift left all items to reclaim the space
 			for ( i = pointer; i != _timer_slot_avail; )
 			{
@@ -0,0 +1,278 @@
+/**
+ * @addtogroup service
+ * @{
+ * @addtogroup trace
+ * @{
+ *****************************************************************************
+ * Implementation of the trace.
+ * The time of a record is composed of the ms counter and the us within the
+ *  ms (timer_get_us), read with the interrupts off so both agree. It wraps
+ *  after 71 minutes.
+ * The stream is bit-banged, as the only USART is taken. A byte is sent with
+ *  the interrupts off, so the bits keep their timing.
+ *****************************************************************************
+ * @file
+ * Implementation of the trace API
+ * @author gax
+ * @internal
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef _POSIX
+#include <stdio.h>
+#endif
+
+#include "utils/interrupt.h"
+
+#include "ioport.h"
+#include "timer.h"
+#include "trace.h"
+
+#if defined(TRACE_DRAIN) && defined(CLOCK_SCALE)
+#include "clock_scale.h"
+#endif
+
+/************************************************************************/
+/* Defines                                                              */
+/************************************************************************/
+
+/**
+ * @def TRACE_SIZE
+ * Number of records held. Must be a power of 2.
+ */
+#ifndef TRACE_SIZE
+#  ifdef _POSIX
+#     define TRACE_SIZE 65536
+#  else
+#     define TRACE_SIZE 16
+#  endif
+#endif
+
+#if (TRACE_SIZE & (TRACE_SIZE - 1)) != 0
+#  error "TRACE_SIZE must be a power of 2"
+#endif
+
+/**
+ * @def TRACE_BAUD
+ * Rate of the stream on TRACE_PIN
+ */
+#ifndef TRACE_BAUD
+#  define TRACE_BAUD 500000UL
+#endif
+
+/**
+ * @def TRACE_LOOP_CYCLES
+ * Cycles taken by the loop which sends each bit, less the delay
+ */
+#ifndef TRACE_LOOP_CYCLES
+#  define TRACE_LOOP_CYCLES 7
+#endif
+
+/** Cycles to wait for each bit */
+#define TRACE_BIT_CYCLES (F_CPU / TRACE_BAUD - TRACE_LOOP_CYCLES)
+
+/************************************************************************/
+/* Local variables                                                      */
+/************************************************************************/
+
+/** The ring buffer */
+static trace_record_t _trace_buffer[TRACE_SIZE];
+
+/** Oldest record held, and number of records held */
+static size_t _trace_tail = 0;
+static size_t _trace_count = 0;
+
+/** Records dropped as the buffer was full */
+static uint8_t _trace_lost = 0;
+
+#ifdef TRACE_DRAIN
+/** The record being sent, and the next byte to send (0 for the sync) */
+static trace_record_t _trace_sending;
+static uint8_t _trace_sent = sizeof(trace_record_t) + 1;
+#endif
+
+/************************************************************************/
+/* Local functions                                                      */
+/************************************************************************/
+
+/** @return The time now (us) */
+static inline uint32_t _trace_now(void)
+{
+   uint32_t ms = (uint32_t)timer_get_count();
+   uint16_t us = timer_get_us();
+
+   // timer_get_us may be 1ms ahead if the tick is pending, hence not %
+   return ms * 1000 + (uint16_t)(us - (uint16_t)ms * 1000);
+}
+
+/**
+ * Take the oldest record, or a trace_lost record if any was dropped
+ * To call with the interrupts off
+ * @return false if the buffer is empty
+ */
+static bool _trace_pop(trace_record_t *record)
+{
+   if ( _trace_count == 0 )
+   {
+      return false;
+   }
+
+   *record = _trace_buffer[_trace_tail];
+
+   if ( _trace_lost )
+   {
+      record->event = trace_lost;
+      record->id = _trace_lost;
+      _trace_lost = 0;
+   }
+   else
+   {
+      _trace_tail = (_trace_tail + 1) & (TRACE_SIZE - 1);
+      --_trace_count;
+   }
+
+   return true;
+}
+
+#ifdef TRACE_DRAIN
+/** Send a byte on TRACE_PIN, 8N1 */
+static void _trace_send_byte(uint8_t byte)
+{
+   // Start bit, the data from the LSB, stop bit
+   uint16_t frame = ((uint16_t)byte << 1) | 0x200;
+
+   irqflags_t flags = cpu_irq_save();
+
+   for ( uint8_t i=0; i<10; ++i )
+   {
+      ioport_set_pin_level(TRACE_PIN, frame & 1);
+      frame >>= 1;
+      __builtin_avr_delay_cycles(TRACE_BIT_CYCLES);
+   }
+
+   cpu_irq_restore(flags);
+}
+#endif
+
+/************************************************************************/
+/* Public API                                                           */
+/************************************************************************/
+
+void trace_init(void)
+{
+#ifdef TRACE_DRAIN
+   ioport_set_pin_level(TRACE_PIN, true);
+   ioport_set_pin_dir(TRACE_PIN, IOPORT_DIR_OUTPUT);
+#endif
+}
+
+void trace_record(trace_event_t event, uint8_t id)
+{
+   irqflags_t flags = cpu_irq_save();
+
+   size_t head = (_trace_tail + _trace_count) & (TRACE_SIZE - 1);
+
+   if ( _trace_count == TRACE_SIZE )
+   {
+      // Drop the oldest
+      _trace_tail = (_trace_tail + 1) & (TRACE_SIZE - 1);
+
+      if ( _trace_lost < UINT8_MAX )
+      {
+         ++_trace_lost;
+      }
+   }
+   else
+   {
+      ++_trace_count;
+   }
+
+   _trace_buffer[head].event = event;
+   _trace_buffer[head].id = id;
+   _trace_buffer[head].us = _trace_now();
+
+   cpu_irq_restore(flags);
+}
+
+#ifdef TRACE_DRAIN
+bool trace_drain(void)
+{
+   uint8_t byte;
+
+   if ( _trace_sent > sizeof(trace_record_t) )
+   {
+      irqflags_t flags = cpu_irq_save();
+      bool any = _trace_pop(&_trace_sending);
+      cpu_irq_restore(flags);
+
+      if ( ! any )
+      {
+         return false;
+      }
+
+      _trace_sent = 0;
+   }
+
+   if ( _trace_sent == 0 )
+   {
+      byte = TRACE_SYNC;
+   }
+   else
+   {
+      byte = ((const uint8_t *)&_trace_sending)[_trace_sent - 1];
+   }
+
+   ++_trace_sent;
+
+#ifdef CLOCK_SCALE
+   // The bit timing assumes the full speed
+   clock_scale_hold();
+   _trace_send_byte(byte);
+   clock_scale_release();
+#else
+   _trace_send_byte(byte);
+#endif
+
+   return true;
+}
+#endif
+
+#ifdef _POSIX
+bool trace_posix_dump(const char *path)
+{
+   FILE *file = fopen(path, "wb");
+   trace_record_t record;
+
+   if ( file == NULL )
+   {
+      return false;
+   }
+
+   // The records are kept, so each dump has all of them
+   size_t tail = _trace_tail, count = _trace_count;
+   uint8_t lost = _trace_lost;
+
+   while ( _trace_pop(&record) )
+   {
+      fputc(TRACE_SYNC, file);
+      fputc(record.event, file);
+      fputc(record.id, file);
+
+      for ( int i=0; i<4; ++i )
+      {
+         fputc((record.us >> (8 * i)) & 0xFF, file);
+      }
+   }
+
+   _trace_tail = tail;
+   _trace_count = count;
+   _trace_lost = lost;
+
+   return fclose(file) == 0;
+}
+#endif
+
+/** @} */
+/** @} */
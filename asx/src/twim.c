@@ -38,10 +38,52 @@
 
 #include "sysclk.h"
 #include "twim.h"
+#include "twi_timing.h"
 
 #include "ioport.h"
 #include "conf_board.h"
 
+#ifdef CLOCK_SCALE
+#include "clock_scale.h"
+#endif
+
+#include <util/delay.h>
+
+/** Pin of the clock line (default location of TWI0) */
+#ifndef TWIM_SCL_PIN
+#define TWIM_SCL_PIN IOPORT_CREATE_PIN(PORTB, 0)
+#endif
+
+/** Pin of the data line (default location of TWI0) */
+#ifndef TWIM_SDA_PIN
+#define TWIM_SDA_PIN IOPORT_CREATE_PIN(PORTB, 1)
+#endif
+
+/** Clocks required for a slave to complete the byte it is sending, and its ack */
+#define TWIM_RECOVERY_CLOCKS 9
+
+/** Half period of the recovery clock (100kHz) */
+#define TWIM_RECOVERY_HALF_PERIOD_US 5
+
+/** Clock of the TWI (CLK_PER) */
+#ifdef CLOCK_SCALE
+#define TWIM_CLK_PER clock_scale_get_hz()
+#else
+#define TWIM_CLK_PER F_CPU
+#endif
+
+/** Number of packages which can wait for the transfer in progress */
+#ifndef TWIM_QUEUE_SIZE
+#define TWIM_QUEUE_SIZE 2
+#endif
+
+/** Package waiting for the bus */
+typedef struct
+{
+	const twi_package_t * pkg;      // Bus message descriptor
+	bool                  read;     // Bus transfer direction
+} twim_queued_t;
+
 
 /** Master Transfer Descriptor */
 static struct
@@ -53,9 +95,45 @@ static struct
 	bool            read;           // Bus transfer direction
 	bool            locked;         // Bus busy or unavailable
 	volatile status_code_t status;  // Transfer status
+	twim_queued_t   queue[TWIM_QUEUE_SIZE]; // Packages to chain
+	uint8_t         queue_head;     // Next package to transfer
+	volatile uint8_t queue_count;   // Number of packages in the queue
 } transfer;
 
 
+/**
+ * \internal
+ *
+ * \brief Take the bus until twim_unlock.
+ *
+ * The clock is kept at full speed for the whole transfer, and its baud
+ *  rate cannot change on the way.
+ */
+static inline void twim_lock(void)
+{
+	transfer.locked = true;
+
+#ifdef CLOCK_SCALE
+	clock_scale_hold();
+#endif
+}
+
+/**
+ * \internal
+ *
+ * \brief Give the bus back.
+ */
+static inline void twim_unlock(void)
+{
+#ifdef CLOCK_SCALE
+	if (transfer.locked) {
+		clock_scale_release();
+	}
+#endif
+
+	transfer.locked = false;
+}
+
 /**
  * \internal
  *
@@ -75,7 +153,7 @@ static inline status_code_t twim_acquire(bool no_wait)
 
 	irqflags_t const flags = cpu_irq_save ();
 
-	transfer.locked = true;
+	twim_lock();
 	transfer.status = OPERATION_IN_PROGRESS;
 
 	cpu_irq_restore (flags);
@@ -91,36 +169,17 @@ static inline status_code_t twim_acquire(bool no_wait)
  *@return             uint8_t value for the MBAUD register
  *@retval             the desired baud value
  */
-#define TWI_BAUD(freq, t_rise) ((F_CPU / freq) / 2) - (5 + (((F_CPU / 1000000) * t_rise) / 2000))
 uint8_t twim_calc_baud(uint32_t frequency)
 {
-  int16_t baud;
-
-  #if (F_CPU == 20000000) || (F_CPU == 10000000)
-    if (frequency >= 600000) {          // assuming 1.5kOhm
-      baud = TWI_BAUD(frequency, 250);
-    } else if (frequency >= 400000) {   // assuming 2.2kOhm
-      baud = TWI_BAUD(frequency, 350);
-    } else {                            // assuming 4.7kOhm
-      baud = TWI_BAUD(frequency, 600);  // 300kHz will be off at 10MHz. Trade-off between size and accuracy
-    }
-  #else
-    if (frequency >= 600000) {          // assuming 1.5kOhm
-      baud = TWI_BAUD(frequency, 250);
-    } else if (frequency >= 400000) {   // assuming 2.2kOhm
-      baud = TWI_BAUD(frequency, 400);
-    } else {                            // assuming 4.7kOhm
-      baud = TWI_BAUD(frequency, 600);
-    }
-  #endif
-
-  #if (F_CPU >= 20000000)
-    const uint8_t baudlimit = 2;
-  #elif (F_CPU == 16000000) || (F_CPU == 8000000) || (F_CPU == 4000000)
-    const uint8_t baudlimit = 1;
-  #else
-    const uint8_t baudlimit = 0;
-  #endif
+  const uint32_t f_per = TWIM_CLK_PER;
+  int16_t baud = twi_timing_baud(f_per, frequency, twi_timing_rise_time(frequency));
+  uint8_t baudlimit = 0;
+
+  if (f_per >= 20000000) {
+    baudlimit = 2;
+  } else if ((f_per == 16000000) || (f_per == 8000000) || (f_per == 4000000)) {
+    baudlimit = 1;
+  }
 
   if (baud < baudlimit) {
     return baudlimit;
@@ -143,9 +202,9 @@ uint8_t twim_calc_baud(uint32_t frequency)
  * \return  status_code_t
  *      - STATUS_OK if the transfer completes
  *      - ERR_BUSY to indicate an unavailable bus
- *      - ERR_IO_ERROR to indicate a bus transaction error
+ *      - ERR_IO_ERROR to indicate a NACK from the slave
  *      - ERR_NO_MEMORY to indicate buffer errors
- *      - ERR_PROTOCOL to indicate an unexpected bus state
+ *      - ERR_PROTOCOL to indicate a bus error or an unexpected bus state
  */
 status_code_t twim_release(void)
 {
@@ -173,11 +232,100 @@ status_code_t twim_release(void)
 		status = ERR_TIMEOUT;
    }      
 
-	transfer.locked = false;
+	twim_unlock();
 
 	return status;
 }
 
+/**
+ * \internal
+ *
+ * \brief Start the transfer of a package.
+ *
+ * Writing the address issues a START, or a repeated START if the bus is
+ *  already owned by a chained transfer.
+ */
+static inline void twim_start(TWI_t *twi, const twi_package_t *package, bool read)
+{
+	transfer.bus         = (TWI_t *) twi;
+	transfer.pkg         = (twi_package_t *) package;
+	transfer.addr_count  = 0;
+	transfer.data_count  = 0;
+	transfer.read        = read;
+	transfer.status      = OPERATION_IN_PROGRESS;
+
+	uint8_t const chip = (package->chip) << 1;
+
+	if (package->addr_length || (false == read)) {
+		transfer.bus->MADDR = chip;
+	} else if (read) {
+		transfer.bus->MADDR = chip | 0x01;
+	}
+}
+
+/**
+ * \internal
+ *
+ * \brief Complete the transfer of the current package.
+ *
+ * If the transfer succeeded and a package is queued, it starts at once with
+ *  a repeated START and the bus is kept. Else, the bus is released with the
+ *  given command and the queued packages are flushed.
+ * The callbacks are called in the order the packages were queued, once the
+ *  bus is released, so they may queue a new transfer.
+ *
+ * \param status  Status of the transfer
+ * \param mctrlb  Command which ends the transfer. 0 to leave the bus as is
+ */
+static inline void twim_complete(status_code_t status, uint8_t mctrlb)
+{
+	twi_package_t * const pkg = transfer.pkg;
+	twim_queued_t flushed[TWIM_QUEUE_SIZE];
+	uint8_t       flush_count = 0;
+
+	if ((STATUS_OK == status) && transfer.queue_count) {
+
+		twim_queued_t const next = transfer.queue[transfer.queue_head];
+
+		transfer.queue_head = (transfer.queue_head + 1) % TWIM_QUEUE_SIZE;
+		--transfer.queue_count;
+
+		// Only keep the acknowledge action, the address issues the repeated START
+		transfer.bus->MCTRLB = mctrlb & TWI_ACKACT_bm;
+		twim_start(transfer.bus, next.pkg, next.read);
+
+	} else {
+
+		if (mctrlb) {
+			transfer.bus->MCTRLB = mctrlb;
+		}
+
+		transfer.status = status;
+
+		// Detach the queue, as the callbacks may fill it again
+		while (transfer.queue_count) {
+			flushed[flush_count++] = transfer.queue[transfer.queue_head];
+			transfer.queue_head = (transfer.queue_head + 1) % TWIM_QUEUE_SIZE;
+			--transfer.queue_count;
+		}
+
+		// The chain is over
+		if (pkg->no_wait) {
+			twim_unlock();
+		}
+	}
+
+	if (pkg->complete_cb) {
+		pkg->complete_cb(status);
+	}
+
+	for (uint8_t i = 0; i < flush_count; ++i) {
+		if (flushed[i].pkg->complete_cb) {
+			flushed[i].pkg->complete_cb(ERR_FLUSHED);
+		}
+	}
+}
+
 /**
  * \internal
  *
@@ -211,14 +359,8 @@ static inline void twim_write_handler(void)
 	}
    else
    {
-		// Send STOP condition to complete the transaction
-		bus->MCTRLB = TWI_MCMD_STOP_gc;
-		transfer.status = STATUS_OK;
-      
-      // Notify the callback
-      if (pkg->complete_cb) {
-         pkg->complete_cb(STATUS_OK);
-      }     
+		// Send STOP condition to complete the transaction, or chain the next
+		twim_complete(STATUS_OK, TWI_MCMD_STOP_gc);
 	}
 }
 
@@ -249,26 +391,14 @@ static inline void twim_read_handler(void)
 
 		} else {
 
-			bus->MCTRLB = TWI_ACKACT_bm | TWI_MCMD_STOP_gc;
-			transfer.status = STATUS_OK;
-         
-         if (pkg->complete_cb) {
-            pkg->complete_cb(STATUS_OK);
-         }
-         
+			twim_complete(STATUS_OK, TWI_ACKACT_bm | TWI_MCMD_STOP_gc);
 		}
 
 	} else {
 
 		/* Issue STOP and buffer overflow condition. */
 
-		bus->MCTRLB = TWI_MCMD_STOP_gc;
-		transfer.status = ERR_NO_MEMORY;
-      
-      if (pkg->complete_cb) {
-         pkg->complete_cb(ERR_NO_MEMORY);
-      }
-      
+		twim_complete(ERR_NO_MEMORY, TWI_MCMD_STOP_gc);
 	}
 }
 
@@ -282,26 +412,20 @@ static inline void twim_read_handler(void)
 static inline void twim_interrupt_handler(void)
 {
 	uint8_t const master_status = transfer.bus->MSTATUS;
-	twi_package_t * const pkg = transfer.pkg;
 
 	if (master_status & TWI_ARBLOST_bm) {
 
 		transfer.bus->MSTATUS = master_status | TWI_ARBLOST_bm;
-		transfer.bus->MCTRLB  = TWI_MCMD_STOP_gc;
-		transfer.status = ERR_BUSY;
-      
-      if (pkg->complete_cb) {
-         pkg->complete_cb(ERR_BUSY);
-      }
-	} else if ((master_status & TWI_BUSERR_bm) ||
-		(master_status & TWI_RXACK_bm)) {
-
-		transfer.bus->MCTRLB = TWI_MCMD_STOP_gc;
-		transfer.status = ERR_IO_ERROR;
-
-      if (pkg->complete_cb) {
-         pkg->complete_cb(ERR_IO_ERROR);
-      }
+		twim_complete(ERR_BUSY, TWI_MCMD_STOP_gc);
+
+	} else if (master_status & TWI_BUSERR_bm) {
+
+		twim_complete(ERR_PROTOCOL, TWI_MCMD_STOP_gc);
+
+	} else if (master_status & TWI_RXACK_bm) {
+
+		twim_complete(ERR_IO_ERROR, TWI_MCMD_STOP_gc);
+
 	} else if (master_status & TWI_WIF_bm) {
 
 		twim_write_handler();
@@ -312,11 +436,7 @@ static inline void twim_interrupt_handler(void)
 
 	} else {
 
-		transfer.status = ERR_PROTOCOL;
-
-      if (pkg->complete_cb) {
-         pkg->complete_cb(ERR_PROTOCOL);
-      }
+		twim_complete(ERR_PROTOCOL, 0);
 	}
 }
 
@@ -329,15 +449,41 @@ static inline void twim_interrupt_handler(void)
  * \retval STATUS_OK        Transaction is successful
  * \retval ERR_INVALID_ARG  Invalid arguments in \c opt.
  */
+#ifdef CLOCK_SCALE
+/**
+ * \internal
+ *
+ * \brief Set the baud rate for the new clock.
+ *
+ * The clock never changes during a transfer, so the bus is idle, or taken
+ *  but not started yet.
+ */
+static void twim_follow_clock(void)
+{
+	TWI0.MBAUD = twim_calc_baud(TWI_SPEED);
+}
+#endif
+
 status_code_t twi_master_init(TWI_t *twi)
 {
    twi->MCTRLB |= TWI_FLUSH_bm;
+
+#if TWI_SPEED > TWI_FM_MAX_FREQUENCY
+   // Fast mode plus. The slave must also enable it
+   twi->CTRLA |= TWI_FMPEN_bm;
+#endif
+
 	twi->MBAUD   = twim_calc_baud(TWI_SPEED);
 	twi->MCTRLA  = TWI_RIEN_bm | TWI_WIEN_bm | TWI_ENABLE_bm;
 	twi->MSTATUS = TWI_BUSSTATE_IDLE_gc;
 
-	transfer.locked    = false;
+#ifdef CLOCK_SCALE
+	clock_scale_set_hook(twim_follow_clock);
+#endif
+
+	twim_unlock();
 	transfer.status    = STATUS_OK;
+	transfer.queue_count = 0;
 
 	return STATUS_OK;
 }
@@ -355,9 +501,9 @@ status_code_t twi_master_init(TWI_t *twi)
  * \return  status_code_t
  *      - STATUS_OK if the transfer completes
  *      - ERR_BUSY to indicate an unavailable bus
- *      - ERR_IO_ERROR to indicate a bus transaction error
+ *      - ERR_IO_ERROR to indicate a NACK from the slave
  *      - ERR_NO_MEMORY to indicate buffer errors
- *      - ERR_PROTOCOL to indicate an unexpected bus state
+ *      - ERR_PROTOCOL to indicate a bus error or an unexpected bus state
  *      - ERR_INVALID_ARG to indicate invalid arguments.
  */
 status_code_t twi_master_transfer(TWI_t *twi,
@@ -372,19 +518,7 @@ status_code_t twi_master_transfer(TWI_t *twi,
 	status_code_t status = twim_acquire(package->no_wait);
 
 	if (STATUS_OK == status) {
-		transfer.bus         = (TWI_t *) twi;
-		transfer.pkg         = (twi_package_t *) package;
-		transfer.addr_count  = 0;
-		transfer.data_count  = 0;
-		transfer.read        = read;
-
-		uint8_t const chip = (package->chip) << 1;
-
-		if (package->addr_length || (false == read)) {
-			transfer.bus->MADDR = chip;
-		} else if (read) {
-			transfer.bus->MADDR = chip | 0x01;
-		}
+		twim_start(twi, package, read);
 
       if ( ! package->no_wait )
 		   status = twim_release();
@@ -393,6 +527,131 @@ status_code_t twi_master_transfer(TWI_t *twi,
 	return status;
 }
 
+/**
+ * \brief Queue a TWI master write or read transfer.
+ *
+ * The transfer starts at once if the bus is free. Else, it is chained from
+ *  the interrupt which ends the transfer in progress, with a repeated START,
+ *  so no other master can take the bus in between and the CPU is not involved.
+ * The package must be no_wait and left untouched until its callback is called.
+ *  If a transfer fails, the queued packages are flushed and their callback is
+ *  called with ERR_FLUSHED.
+ *
+ * \param twi       Base address of the TWI (i.e. &TWI_t).
+ * \param package   Package information and data
+ *                  (see \ref twi_package_t)
+ * \param read      Selects the transfer direction
+ *
+ * \return  status_code_t
+ *      - STATUS_OK if the transfer is started or queued
+ *      - ERR_BUSY if the queue is full or the bus is used by another master
+ *      - ERR_INVALID_ARG to indicate invalid arguments.
+ */
+status_code_t twi_master_queue(TWI_t *twi,
+		const twi_package_t *package, bool read)
+{
+	status_code_t status = ERR_BUSY;
+
+	if ((twi == NULL) || (package == NULL) || (! package->no_wait)) {
+		return ERR_INVALID_ARG;
+	}
+
+	irqflags_t const flags = cpu_irq_save ();
+
+	if (transfer.locked) {
+
+		if (transfer.queue_count < TWIM_QUEUE_SIZE) {
+
+			twim_queued_t * const slot = &transfer.queue[
+				(transfer.queue_head + transfer.queue_count) % TWIM_QUEUE_SIZE];
+
+			slot->pkg  = package;
+			slot->read = read;
+			++transfer.queue_count;
+
+			status = STATUS_OK;
+		}
+
+	} else if (twim_idle(twi)) {
+
+		twim_lock();
+		twim_start(twi, package, read);
+
+		status = STATUS_OK;
+	}
+
+	cpu_irq_restore (flags);
+
+	return status;
+}
+
+/**
+ * \brief Recover a stuck bus
+ *
+ * A slave which was reset or lost a clock in the middle of a read may hold
+ *  SDA low, waiting for clocks to send the rest of its byte. The master sees
+ *  the bus as busy forever.
+ * The TWI is disabled and the lines are driven as open-drain by the port:
+ *  SCL is clocked until SDA is released (9 clocks at most), then a STOP is
+ *  issued. The TWI is re-initialized, which aborts any on-going transfer
+ *  and forces the bus state to idle.
+ * This takes about 100us and can be called from a reactor handler.
+ *
+ * \param twi       Base address of the TWI (i.e. &TWI_t).
+ * \return STATUS_OK if the bus is released, ERR_IO_ERROR if a line is still held low
+ */
+status_code_t twim_recover_bus(TWI_t *twi)
+{
+	uint8_t i;
+	status_code_t status = STATUS_OK;
+
+#ifdef CLOCK_SCALE
+	// The delays are counted at full speed
+	clock_scale_hold();
+#endif
+
+	// Give the pins to the port. The lines are pulled-up when an input,
+	//  and driven low when an output
+	twi->MCTRLA &= ~TWI_ENABLE_bm;
+
+	ioport_set_pin_level(TWIM_SCL_PIN, false);
+	ioport_set_pin_level(TWIM_SDA_PIN, false);
+	ioport_set_pin_dir(TWIM_SCL_PIN, IOPORT_DIR_INPUT);
+	ioport_set_pin_dir(TWIM_SDA_PIN, IOPORT_DIR_INPUT);
+
+	// Clock the slave until it lets go of SDA
+	for ( i=0; i<TWIM_RECOVERY_CLOCKS && ! ioport_get_pin_level(TWIM_SDA_PIN); ++i )
+	{
+		ioport_set_pin_dir(TWIM_SCL_PIN, IOPORT_DIR_OUTPUT);
+		_delay_us(TWIM_RECOVERY_HALF_PERIOD_US);
+		ioport_set_pin_dir(TWIM_SCL_PIN, IOPORT_DIR_INPUT);
+		_delay_us(TWIM_RECOVERY_HALF_PERIOD_US);
+	}
+
+	// STOP condition - SDA goes high whilst SCL is high
+	ioport_set_pin_dir(TWIM_SCL_PIN, IOPORT_DIR_OUTPUT);
+	ioport_set_pin_dir(TWIM_SDA_PIN, IOPORT_DIR_OUTPUT);
+	_delay_us(TWIM_RECOVERY_HALF_PERIOD_US);
+	ioport_set_pin_dir(TWIM_SCL_PIN, IOPORT_DIR_INPUT);
+	_delay_us(TWIM_RECOVERY_HALF_PERIOD_US);
+	ioport_set_pin_dir(TWIM_SDA_PIN, IOPORT_DIR_INPUT);
+	_delay_us(TWIM_RECOVERY_HALF_PERIOD_US);
+
+	if ( ! ioport_get_pin_level(TWIM_SCL_PIN) || ! ioport_get_pin_level(TWIM_SDA_PIN) )
+	{
+		status = ERR_IO_ERROR;
+	}
+
+	// Give the pins back to the TWI
+	twi_master_init(twi);
+
+#ifdef CLOCK_SCALE
+	clock_scale_release();
+#endif
+
+	return status;
+}
+
 // Interrupt handler
 ISR(TWI0_TWIM_vect)
 {
@@ -105,6 +105,11 @@ void TWI_SlaveInitializeDriver(TWI_Slave_t *twi,
 void TWI_SlaveInitializeModule(TWI_Slave_t *twi,
                                uint8_t address)
 {
+#ifdef TWI_FMPLUS
+	// Fast mode plus (1MHz). The master must also enable it
+	twi->interface->CTRLA |= TWI_FMPEN_bm;
+#endif
+
 	twi->interface->SCTRLA =      TWI_DIEN_bm |
 	                              TWI_APIEN_bm |
 	                              TWI_ENABLE_bm;
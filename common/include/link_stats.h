@@ -0,0 +1,165 @@
+#ifndef LINK_STATS_H_
+#define LINK_STATS_H_
+/*
+ * link_stats.h
+ * Telemetry of the i2c link, kept by the controller (master) and the hub (slave).
+ * Errors are counted by kind, and a log2 histogram records the timing of the
+ *  good transactions: the round-trip in us on the master, and the time
+ *  between frames in ms on the slave.
+ * Errors point to EMI (NACK, bus errors, CRC), whilst a spread histogram
+ *  with no errors points to a starved CPU.
+ * Both sides use the same layout, so the hub statistics can be read over the
+ *  link with opcodes_cmd_query, one item at a time.
+ */
+#include <stdint.h>
+
+#ifdef _POSIX
+#include <stdio.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * List of the counters as X(name, arg)
+ */
+#define LINK_STATS_COUNTER_LIST(X, arg) \
+   X(ok,        arg) /* Transactions or frames completed */ \
+   X(nack,      arg) /* Address or data not acknowledged by the slave */ \
+   X(collision, arg) /* Arbitration lost (master) or transmit collision (slave) */ \
+   X(bus_error, arg) /* Illegal start or stop on the bus */ \
+   X(timeout,   arg) /* Bus stuck (master) or no command for too long (slave) */ \
+   X(bad_crc,   arg) /* Reply (master) or frame (slave) failing its CRC */ \
+   X(bad_frame, arg) /* Unknown opcode, wrong size or overflow */ \
+   X(flushed,   arg) /* Queued transactions dropped after an error */ \
+   X(stale,     arg) /* Command older than the last one accepted by the hub */ \
+   X(recovery,  arg) /* Recoveries of a stuck bus */
+
+#define LINK_STATS_X_ENUM(name, arg) link_stats_##name,
+#define LINK_STATS_X_NAME(name, arg) #name,
+
+/** Number of bins of the histogram. Bin n counts values from 2^n to 2^(n+1)-1 */
+#define LINK_STATS_BINS 16
+
+/**
+ * Counters
+ */
+typedef enum {
+   LINK_STATS_COUNTER_LIST(LINK_STATS_X_ENUM, ~)
+   LINK_STATS_COUNTERS
+} link_stats_counter_t;
+
+/** Number of 16-bit items to read the whole statistics (counters then bins) */
+#define LINK_STATS_ITEMS (LINK_STATS_COUNTERS + LINK_STATS_BINS)
+
+/**
+ * Statistics of one side of the link. All values saturate at 0xFFFF
+ */
+typedef struct {
+   uint16_t counters[LINK_STATS_COUNTERS];
+   uint16_t histogram[LINK_STATS_BINS];
+} link_stats_t;
+
+/** Increment a value without wrapping around */
+static inline void link_stats_increment(uint16_t *value)
+{
+   if ( *value != UINT16_MAX )
+   {
+      ++*value;
+   }
+}
+
+/** Count an event */
+static inline void link_stats_count(link_stats_t *stats, link_stats_counter_t counter)
+{
+   link_stats_increment(&stats->counters[counter]);
+}
+
+/**
+ * @return The bin of a value, which is the position of its highest bit set (0 for 0)
+ */
+static inline uint8_t link_stats_bin(uint16_t value)
+{
+   uint8_t bin = 0;
+
+   while ( value >>= 1 )
+   {
+      ++bin;
+   }
+
+   return bin;
+}
+
+/** Add a value to the histogram */
+static inline void link_stats_record(link_stats_t *stats, uint16_t value)
+{
+   link_stats_increment(&stats->histogram[link_stats_bin(value)]);
+}
+
+/**
+ * Read one item, as carried by the payload of opcodes_cmd_query
+ * @param item The counter (0 to LINK_STATS_COUNTERS-1) or the bin of the
+ *  histogram (LINK_STATS_COUNTERS to LINK_STATS_ITEMS-1)
+ * @return The value, or 0 if the item does not exist
+ */
+static inline uint16_t link_stats_get_item(const link_stats_t *stats, uint8_t item)
+{
+   if ( item < LINK_STATS_COUNTERS )
+   {
+      return stats->counters[item];
+   }
+   else if ( item < LINK_STATS_ITEMS )
+   {
+      return stats->histogram[item - LINK_STATS_COUNTERS];
+   }
+
+   return 0;
+}
+
+/** Store one item, as read over the link */
+static inline void link_stats_set_item(link_stats_t *stats, uint8_t item, uint16_t value)
+{
+   if ( item < LINK_STATS_COUNTERS )
+   {
+      stats->counters[item] = value;
+   }
+   else if ( item < LINK_STATS_ITEMS )
+   {
+      stats->histogram[item - LINK_STATS_COUNTERS] = value;
+   }
+}
+
+#ifdef _POSIX
+/**
+ * Print the statistics from the simulator or the host tests
+ * @param name Name of the side of the link
+ * @param unit Unit of the histogram (us or ms)
+ */
+static inline void link_stats_dump(const char *name, const char *unit, const link_stats_t *stats)
+{
+   static const char *names[] = { LINK_STATS_COUNTER_LIST(LINK_STATS_X_NAME, ~) };
+   uint8_t i;
+
+   printf("%s link\n", name);
+
+   for ( i=0; i<LINK_STATS_COUNTERS; ++i )
+   {
+      printf("  %-10s %u\n", names[i], stats->counters[i]);
+   }
+
+   for ( i=0; i<LINK_STATS_BINS; ++i )
+   {
+      if ( stats->histogram[i] )
+      {
+         printf("  %5lu%s+ %u\n", 1ul << i, unit, stats->histogram[i]);
+      }
+   }
+}
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LINK_STATS_H_ */
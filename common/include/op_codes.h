@@ -8,28 +8,88 @@
  * Created: 06/05/2024 10:32:34
  *  Author: micro
  */ 
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "crc.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 /**
- * Command values
+ * List of the commands as X(name, value, payload length, arg)
  * Each command is selected such that there are a even mix of 1 and 0s whilst
- *  using the highest hamming distance
+ *  using the highest hamming distance. All values are codewords of weight 4
+ *  of the extended Hamming (8,4) code, so any 2 commands differ by 4 bits at
+ *  least, and differ by 4 bits from a bus stuck low (0x00) or high (0xFF).
+ * To add a command, add a line. The validity table and the checks follow.
+ */
+#define OPCODES_CMD_LIST(X, arg) \
+   X(idle,             0b01001011, 0, arg) /* 4B */ \
+   X(push_door,        0b00101101, 0, arg) /* 2D */ \
+   X(pull_door,        0b00011110, 0, arg) /* 1E */ \
+   X(blast_toolsetter, 0b01111000, 0, arg) /* 78 */ \
+   X(blast_spindle,    0b10000111, 0, arg) /* 87 */ \
+   X(unclamp_chuck,    0b10110100, 0, arg) /* B4 */ \
+   X(valves,           0b11010010, 1, arg) /* D2 */ \
+   X(query,            0b11100001, 1, arg) /* E1 */ \
+   X(pulse,            0b01100110, 4, arg) /* 66 */
+
+/** Minimum number of bits which differ between 2 commands */
+#define OPCODES_MIN_HAMMING_DISTANCE 4
+
+#define OPCODES_X_ENUM(name, value, payload, arg) opcodes_cmd_##name = value,
+#define OPCODES_X_VALUE(name, value, payload, arg) value,
+#define OPCODES_X_PAYLOAD(name, value, payload, arg) case value: return payload;
+#define OPCODES_X_VALID_BIT(name, value, payload, index) \
+   | ((((value) >> 3) == (index)) ? (1 << ((value) & 7)) : 0)
+
+/** Byte of the validity bitmap holding the opcodes index*8 to index*8+7 */
+#define OPCODES_VALID_BYTE(index) (uint8_t)(0 OPCODES_CMD_LIST(OPCODES_X_VALID_BIT, index))
+
+/**
+ * Command values
  */
 typedef enum {
    opcodes_cmd_error            = 0,
-   opcodes_cmd_idle             = 0b01001111, // 4f
-   opcodes_cmd_push_door        = 0b01110001, // 71
-   opcodes_cmd_pull_door        = 0b00001010, // 09
-   opcodes_cmd_blast_toolsetter = 0b01111010, // 75
-   opcodes_cmd_blast_spindle    = 0b01001000, // 48
-   opcodes_cmd_unclamp_chuck    = 0b10000110, // 86
-   opcodes_cmd_reserved0        = 0b11001001, // C9
-   opcodes_cmd_reserved1        = 0b10110000, // B0
+   OPCODES_CMD_LIST(OPCODES_X_ENUM, ~)
 } opcodes_cmd_t;
 
+/**
+ * Valves of the hub as carried by the payload of opcodes_cmd_valves
+ * The bits are in order of priority. If more valves are requested than the
+ *  compressor can feed, the hub keeps the lowest bits.
+ */
+typedef enum {
+   opcodes_valve_chuck            = 1<<0,
+   opcodes_valve_blast_spindle    = 1<<1,
+   opcodes_valve_blast_toolsetter = 1<<2,
+   opcodes_valve_pull_door        = 1<<3,
+   opcodes_valve_push_door        = 1<<4,
+} opcodes_valve_t;
+
+/** All valid bits of the valves bitmask */
+#define OPCODES_VALVES_MASK 0x1F
+
+/**
+ * Payload of opcodes_cmd_pulse - a sequence run by the hub on its own
+ * The valves are pulsed on for on * OPCODES_PULSE_UNIT_MS, then off for
+ *  off * OPCODES_PULSE_UNIT_MS, count times. They stay off after that.
+ * The sequence starts when the command is accepted, and the heartbeat which
+ *  repeats the command does not restart it. Another command stops it.
+ */
+typedef enum {
+   opcodes_pulse_valves, ///< Bitmask of opcodes_valve_t
+   opcodes_pulse_on,     ///< Time on (OPCODES_PULSE_UNIT_MS). 0 is not valid
+   opcodes_pulse_off,    ///< Time off between pulses (OPCODES_PULSE_UNIT_MS)
+   opcodes_pulse_count,  ///< Number of pulses. 0 is not valid
+   opcodes_pulse_payload
+} opcodes_pulse_t;
+
+/** Unit of the times of opcodes_cmd_pulse */
+#define OPCODES_PULSE_UNIT_MS 10
+
 /**
  * Possible types of reply
  */
@@ -40,25 +100,78 @@ typedef enum {
 } opcodes_reply_t;
 
 
-/** Mask applied to the input to indicate the input is ON */
-#define OPCODE_INPUT_IS_ON_MASK 0xA5
-#define OPCODE_INPUT_IS_OFF_MASK 0x5A
+/**
+ * Frames
+ * A command is written as [opcode][sequence][payload...][crc]
+ * The reply is read back as [status][ack][payload...][crc]
+ * The CRC of the reply is seeded with the CRC of the command, so a reply
+ *  only validates against the command it answers.
+ *
+ * The sequence number changes with each new command, and is repeated by the
+ *  heartbeat. The hub rejects a command older than the last one it accepted,
+ *  and replies with the sequence number of that command as the ack. So the
+ *  controller knows whether its command is the one executed.
+ * The sequence number 0 is only used by the first command after a reset of
+ *  the controller. The hub accepts its first command after a reset whatever
+ *  its sequence number. After that, 0 is older or newer like any other, so
+ *  the first command of a controller which restarted may be rejected. The
+ *  controller then follows on from the ack.
+ */
+
+/** Largest payload carried by a frame */
+#define OPCODES_MAX_PAYLOAD 4
+
+/** Largest frame (opcode or status, sequence or ack, payload and CRC) */
+#define OPCODES_FRAME_MAX_SIZE (OPCODES_MAX_PAYLOAD + 3)
+
+/** Size of the reply to a command (status, ack and CRC) */
+#define OPCODES_REPLY_SIZE 3
+
+/**
+ * Size of the reply to opcodes_cmd_query (status, ack, 16-bit value and CRC)
+ * The payload of the query selects the item (see link_stats.h), and the
+ *  value is returned LSB first.
+ */
+#define OPCODES_QUERY_REPLY_SIZE 5
+
+/** Sequence number of the first command after a reset */
+#define OPCODES_SEQ_RESET 0
+
+/**
+ * Heartbeat negotiation
+ * A query of an item with this bit set proposes a heartbeat period to the
+ *  hub, in units of OPCODES_HEARTBEAT_UNIT_MS in the lower bits. The hub
+ *  returns the period it accepts in ms, and both sides watch the link with it.
+ * Until then, both sides use OPCODES_HEARTBEAT_DEFAULT_MS.
+ */
+#define OPCODES_QUERY_HEARTBEAT 0x80
+#define OPCODES_HEARTBEAT_UNIT_MS 10
+#define OPCODES_HEARTBEAT_DEFAULT_MS 500
+
+/** @return The query item which proposes the given heartbeat period */
+#define OPCODES_QUERY_HEARTBEAT_ITEM(ms) \
+   (OPCODES_QUERY_HEARTBEAT | (((ms) / OPCODES_HEARTBEAT_UNIT_MS) & 0x7F))
 
 /** 
+ * Check an opcode in constant time using a bitmap of all 256 values.
+ * The bitmap (32 bytes) is built by the compiler from OPCODES_CMD_LIST
+ *  and is kept in flash.
  * @return The opcode if the opcode is a valid command or opcodes_cmd_error (0)
  */
 static inline opcodes_cmd_t opcodes_check_cmd_valid( uint8_t value )
 {
-   if ( 
-      value == opcodes_cmd_idle || 
-      value == opcodes_cmd_push_door ||
-      value == opcodes_cmd_pull_door ||
-      value == opcodes_cmd_blast_toolsetter ||
-      value == opcodes_cmd_blast_spindle ||
-      value == opcodes_cmd_unclamp_chuck ||
-      value == opcodes_cmd_reserved0 ||
-      value == opcodes_cmd_reserved1
-      )
+   static const uint8_t valid_bitmap[32] = {
+      OPCODES_VALID_BYTE(0),  OPCODES_VALID_BYTE(1),  OPCODES_VALID_BYTE(2),  OPCODES_VALID_BYTE(3),
+      OPCODES_VALID_BYTE(4),  OPCODES_VALID_BYTE(5),  OPCODES_VALID_BYTE(6),  OPCODES_VALID_BYTE(7),
+      OPCODES_VALID_BYTE(8),  OPCODES_VALID_BYTE(9),  OPCODES_VALID_BYTE(10), OPCODES_VALID_BYTE(11),
+      OPCODES_VALID_BYTE(12), OPCODES_VALID_BYTE(13), OPCODES_VALID_BYTE(14), OPCODES_VALID_BYTE(15),
+      OPCODES_VALID_BYTE(16), OPCODES_VALID_BYTE(17), OPCODES_VALID_BYTE(18), OPCODES_VALID_BYTE(19),
+      OPCODES_VALID_BYTE(20), OPCODES_VALID_BYTE(21), OPCODES_VALID_BYTE(22), OPCODES_VALID_BYTE(23),
+      OPCODES_VALID_BYTE(24), OPCODES_VALID_BYTE(25), OPCODES_VALID_BYTE(26), OPCODES_VALID_BYTE(27),
+      OPCODES_VALID_BYTE(28), OPCODES_VALID_BYTE(29), OPCODES_VALID_BYTE(30), OPCODES_VALID_BYTE(31),
+   };
+
+   if ( valid_bitmap[value >> 3] & (1 << (value & 7)) )
    {
       return (opcodes_cmd_t)value;
    }
@@ -67,44 +180,194 @@ static inline opcodes_cmd_t opcodes_check_cmd_valid( uint8_t value )
 }
 
 /**
- * Extract the value
- * @return A reply with the value. The value may indicate a communication error
+ * @return The number of payload bytes following the given opcode
  */
-static inline opcodes_reply_t opcodes_decode_reply(opcodes_cmd_t cmd, uint8_t value_read)
+static inline uint8_t opcodes_payload_length(opcodes_cmd_t cmd)
 {
-   uint8_t value_writen = (uint8_t)cmd;
-   
-   if ( (value_writen ^ OPCODE_INPUT_IS_ON_MASK) == value_read )
+   switch ( cmd )
    {
-      return opcodes_reply_on;
+   OPCODES_CMD_LIST(OPCODES_X_PAYLOAD, ~)
+   default:
+      break;
    }
-   else if ( (value_writen ^ OPCODE_INPUT_IS_OFF_MASK) == value_read )
+
+   return 0;
+}
+
+/**
+ * @return The size of the whole frame for the given opcode
+ */
+static inline uint8_t opcodes_frame_size(opcodes_cmd_t cmd)
+{
+   return opcodes_payload_length(cmd) + 3;
+}
+
+/**
+ * @return The sequence number of the next new command. 0 is skipped
+ */
+static inline uint8_t opcodes_seq_next(uint8_t seq)
+{
+   return (seq == UINT8_MAX) ? 1 : seq + 1;
+}
+
+/**
+ * Compare 2 sequence numbers which roll over
+ * @return true if seq comes before last (within half the range)
+ */
+static inline bool opcodes_seq_is_older(uint8_t seq, uint8_t last)
+{
+   return (int8_t)(uint8_t)(seq - last) < 0;
+}
+
+/**
+ * Build a command frame
+ * @param frame Storage for the frame. Must hold opcodes_frame_size(cmd) bytes
+ * @param cmd The command to send
+ * @param seq The sequence number of the command
+ * @param payload The payload which size is given by the opcode. Can be NULL if none
+ * @return The size of the frame
+ */
+static inline uint8_t opcodes_encode_frame(uint8_t *frame, opcodes_cmd_t cmd, uint8_t seq, const uint8_t *payload)
+{
+   uint8_t size = opcodes_frame_size(cmd);
+   uint8_t i;
+
+   frame[0] = (uint8_t)cmd;
+   frame[1] = seq;
+
+   for ( i=2; i<size-1; ++i )
    {
-      return opcodes_reply_off;
+      frame[i] = payload[i-2];
    }
-   
-   return opcodes_reply_error;
+
+   frame[size-1] = crc8(frame, size-1, CRC8_INIT);
+
+   return size;
 }
 
-/** Create the reply */
-static inline uint8_t opcodes_encode_reply(opcodes_reply_t reply, opcodes_cmd_t cmd_received)
+/**
+ * Check the integrity of a received command frame
+ * @param frame The frame as received
+ * @param size Number of bytes received
+ * @return true if the CRC matches
+ */
+static inline bool opcodes_check_frame(const uint8_t *frame, uint8_t size)
 {
-   switch (reply)
+   return crc8(frame, size-1, CRC8_INIT) == frame[size-1];
+}
+
+/**
+ * @return The CRC of a frame which is also the seed of the CRC of its reply
+ */
+static inline uint8_t opcodes_frame_crc(const uint8_t *frame, uint8_t size)
+{
+   return frame[size-1];
+}
+
+/**
+ * Create the reply
+ * @param reply Storage for the reply. Must hold length + 3 bytes
+ * @param status The status to return
+ * @param ack The sequence number of the last command accepted
+ * @param payload Extra data to return. Can be NULL if length is 0
+ * @param length Number of bytes of payload
+ * @param cmd_crc The CRC of the command frame being answered
+ * @return The size of the reply
+ */
+static inline uint8_t opcodes_encode_reply(
+   uint8_t *reply, opcodes_reply_t status, uint8_t ack, const uint8_t *payload, uint8_t length, uint8_t cmd_crc)
+{
+   uint8_t i;
+
+   reply[0] = (uint8_t)status;
+   reply[1] = ack;
+
+   for ( i=0; i<length; ++i )
+   {
+      reply[i+2] = payload[i];
+   }
+
+   reply[length+2] = crc8(reply, length+2, cmd_crc);
+
+   return length + 3;
+}
+
+/**
+ * Extract the value
+ * @param reply The reply as read
+ * @param size The size of the reply (including the status, ack and CRC)
+ * @param cmd_crc The CRC of the command frame which was sent
+ * @param ack Receives the sequence number of the last command accepted. Can be NULL
+ * @return A reply with the value. The value may indicate a communication error
+ */
+static inline opcodes_reply_t opcodes_decode_reply(const uint8_t *reply, uint8_t size, uint8_t cmd_crc, uint8_t *ack)
+{
+   if ( crc8(reply, size-1, cmd_crc) != reply[size-1] )
+   {
+      return opcodes_reply_error;
+   }
+
+   if ( ack )
+   {
+      *ack = reply[1];
+   }
+
+   switch ( reply[0] )
    {
    case opcodes_reply_off:
-      return cmd_received ^ OPCODE_INPUT_IS_OFF_MASK;
+      return opcodes_reply_off;
    case opcodes_reply_on:
-      return cmd_received ^ OPCODE_INPUT_IS_ON_MASK;
+      return opcodes_reply_on;
    default:
       break;
    }
 
-   return (uint8_t)opcodes_cmd_error;
+   return opcodes_reply_error;
 }
 
 
 #ifdef __cplusplus
 }
+
+/**
+ * Static check of the commands - done by any C++ unit including this file.
+ * All values must be different from one another, from 0 (error) and
+ *  0xFF (bus stuck) by OPCODES_MIN_HAMMING_DISTANCE bits at least.
+ */
+namespace opcodes_check
+{
+   constexpr uint8_t values[] = { 0x00, 0xFF, OPCODES_CMD_LIST(OPCODES_X_VALUE, ~) };
+
+   constexpr uint8_t min_distance()
+   {
+      uint8_t min = 8;
+
+      for (uint8_t i=0; i<sizeof(values); ++i)
+      {
+         for (uint8_t j=i+1; j<sizeof(values); ++j)
+         {
+            uint8_t distance = __builtin_popcount(values[i] ^ values[j]);
+
+            if ( distance < min )
+            {
+               min = distance;
+            }
+         }
+      }
+
+      return min;
+   }
+
+   static_assert(
+      min_distance() >= OPCODES_MIN_HAMMING_DISTANCE,
+      "Two opcodes are too close - use another value"
+   );
+
+   static_assert(
+      opcodes_pulse_payload <= OPCODES_MAX_PAYLOAD,
+      "The payload of the pulse does not fit a frame"
+   );
+}
 #endif
 
 #endif /* OP_CODES_H_ */
\ No newline at end of file
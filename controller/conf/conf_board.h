@@ -13,6 +13,8 @@
 // Share the trace pin
 #define ALERT_OUTPUT_PIN LED_FAULT
 
+// The trace (make TRACE=1) stays in RAM, as TRACE_INFO is the UPDI pin
+
 
 /************************************************************************/
 /* Functional I/Os                                                      */
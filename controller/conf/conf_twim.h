@@ -9,8 +9,16 @@
 #ifndef CONF_TWIM_H_
 #define CONF_TWIM_H_
 
+// Fast mode plus profile (make TWI_FMPLUS=1). The hub must use the same profile
+#ifdef TWI_FMPLUS
+#define TWI_SPEED 1000000
+#else
 #define TWI_SPEED 100000
+#endif
 #define TWI_SLAVE_ADDR 0x54
 
+// A whole frame is sent as the address segment (OPCODES_FRAME_MAX_SIZE)
+#define TWI_ADDR_MAX_LENGTH 7
+
 
 #endif /* CONF_TWIM_H_ */
\ No newline at end of file
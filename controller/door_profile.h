@@ -0,0 +1,162 @@
+#ifndef DOOR_PROFILE_H_
+#define DOOR_PROFILE_H_
+/*
+ * door_profile.h
+ *
+ * Travel times of the door, learned from the sensors, and the timeouts
+ *  derived from them.
+ * A move has 2 phases:
+ *  - release: from the valve turning on until the door leaves its sensor
+ *  - travel: from leaving one sensor until reaching the other
+ * Each phase keeps an exponentially weighted moving average of the times
+ *  measured, per direction. Its timeout allows for a door twice as slow as
+ *  usual plus a margin, so a slow cylinder on a cold morning still makes it,
+ *  whilst a broken sensor is detected in a few seconds.
+ * Until a phase is measured, its timeout is the default given.
+ * The functions are pure, so they are tested on the host.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Weight of a new measurement in the average, as a power of 2 (1/4) */
+#ifndef DOOR_PROFILE_EWMA_SHIFT
+#define DOOR_PROFILE_EWMA_SHIFT 2
+#endif
+
+/** Time added to twice the average to make a timeout (ms) */
+#ifndef DOOR_PROFILE_MARGIN_MS
+#define DOOR_PROFILE_MARGIN_MS 500
+#endif
+
+/** Shortest timeout of a phase (ms) */
+#ifndef DOOR_PROFILE_MIN_TIMEOUT_MS
+#define DOOR_PROFILE_MIN_TIMEOUT_MS 1000
+#endif
+
+/** Longest timeout of a phase (ms) */
+#ifndef DOOR_PROFILE_MAX_TIMEOUT_MS
+#define DOOR_PROFILE_MAX_TIMEOUT_MS 15000
+#endif
+
+/** A change of an average by more than 1/2^N is worth saving */
+#define DOOR_PROFILE_DRIFT_SHIFT 3
+
+typedef enum
+{
+   door_profile_opening,
+   door_profile_closing,
+   door_profile_directions
+} door_profile_direction_t;
+
+typedef enum
+{
+   door_profile_release,
+   door_profile_travel,
+   door_profile_phases
+} door_profile_phase_t;
+
+typedef struct
+{
+   /** Average time of each phase (ms). 0 until measured */
+   uint16_t average[door_profile_directions][door_profile_phases];
+} door_profile_t;
+
+/**
+ * Add a measurement to the average of a phase
+ * The first measurement is taken as is.
+ * @param elapsed Duration of the phase (ms)
+ */
+static inline void door_profile_record(
+   door_profile_t *profile,
+   door_profile_direction_t direction,
+   door_profile_phase_t phase,
+   uint32_t elapsed)
+{
+   uint16_t *average = &profile->average[direction][phase];
+   int32_t sample;
+
+   // 0 means not measured
+   if ( elapsed == 0 )
+   {
+      elapsed = 1;
+   }
+   else if ( elapsed > UINT16_MAX )
+   {
+      elapsed = UINT16_MAX;
+   }
+
+   if ( *average == 0 )
+   {
+      *average = (uint16_t)elapsed;
+   }
+   else
+   {
+      sample = (int32_t)elapsed - *average;
+      *average = (uint16_t)(*average + sample / (1 << DOOR_PROFILE_EWMA_SHIFT));
+   }
+}
+
+/**
+ * @param average Average of the phase (ms), or 0 if not measured
+ * @param fallback Timeout to use until the phase is measured (ms)
+ * @return The timeout of the phase (ms)
+ */
+static inline uint16_t door_profile_timeout(uint16_t average, uint16_t fallback)
+{
+   uint32_t timeout;
+
+   if ( average == 0 )
+   {
+      return fallback;
+   }
+
+   timeout = 2 * (uint32_t)average + DOOR_PROFILE_MARGIN_MS;
+
+   if ( timeout < DOOR_PROFILE_MIN_TIMEOUT_MS )
+   {
+      timeout = DOOR_PROFILE_MIN_TIMEOUT_MS;
+   }
+   else if ( timeout > DOOR_PROFILE_MAX_TIMEOUT_MS )
+   {
+      timeout = DOOR_PROFILE_MAX_TIMEOUT_MS;
+   }
+
+   return (uint16_t)timeout;
+}
+
+/**
+ * Check if the profile moved away from a saved copy, so the copy is only
+ *  written when it matters (the EEPROM wears out).
+ * @return true if an average changed by more than 1/2^DOOR_PROFILE_DRIFT_SHIFT
+ */
+static inline bool door_profile_drifted(const door_profile_t *saved, const door_profile_t *profile)
+{
+   uint8_t d, p;
+
+   for ( d=0; d<door_profile_directions; ++d )
+   {
+      for ( p=0; p<door_profile_phases; ++p )
+      {
+         uint16_t was = saved->average[d][p];
+         uint16_t now = profile->average[d][p];
+         uint16_t delta = (now > was) ? now - was : was - now;
+
+         if ( delta > (was >> DOOR_PROFILE_DRIFT_SHIFT) )
+         {
+            return true;
+         }
+      }
+   }
+
+   return false;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DOOR_PROFILE_H_ */
@@ -6,81 +6,310 @@
  */
 #include <avr/io.h>
 
+#include "timer.h"
 #include "i2c.h"
 
+/**
+ * Number of transactions which can be in flight.
+ * With 2, the next command is built and queued while the previous one is on
+ *  the bus, and the driver chains it with a repeated start.
+ */
+#define I2C_TRANSACTIONS 2
+
+#if TWI_ADDR_MAX_LENGTH < OPCODES_FRAME_MAX_SIZE
+#  error "The address segment of the TWI packages must hold a whole frame"
+#endif
+
+/** Marks a transaction which carries a command rather than a query */
+#define I2C_NO_QUERY 0xFF
+
+/** A command and the buffer of its reply */
+typedef struct
+{
+   twi_package_t package;
+   // Buffer to receive the reply
+   uint8_t reply[OPCODES_QUERY_REPLY_SIZE];
+   // CRC of the frame transmitted which seeds the CRC of the reply
+   uint8_t crc;
+   // Sequence number sent
+   uint8_t seq;
+   // Item queried, or I2C_NO_QUERY
+   uint8_t query;
+   // Time the transaction was queued
+   uint16_t start_us;
+} i2c_transaction_t;
+
 // Reactor handle
 reactor_handle_t i2c_reactor_handle;
 reactor_handle_t on_error, on_data_received;
 
-// Buffer to receive data
-static uint8_t buffer; // Single byte to receive
+// Statistics of the link, and the copy of the statistics of the hub
+link_stats_t i2c_link_stats;
+link_stats_t i2c_hub_link_stats;
+
+// Transactions are used in turn, and complete in the order they are queued
+static i2c_transaction_t _transactions[I2C_TRANSACTIONS];
+
+// Next transaction to fill
+static uint8_t _next;
+
+// Oldest transaction in flight
+static uint8_t _oldest;
+
+// Number of transactions in flight
+static volatile uint8_t _in_flight;
+
+// Sequence number of the current command
+static volatile uint8_t _seq = OPCODES_SEQ_RESET;
 
-// What was transmitted last
-static opcodes_cmd_t last_sent;
+// Heartbeat period accepted by the hub (ms)
+static volatile uint16_t _heartbeat_period = OPCODES_HEARTBEAT_DEFAULT_MS;
+
+// Last command sent and its payload, to tell a new command from a heartbeat
+static opcodes_cmd_t _last_cmd = opcodes_cmd_error;
+static uint8_t _last_payload[OPCODES_MAX_PAYLOAD];
 
 
 /**
- * Reactor handle for when some data should be ready from the i2c
+ * @return The sequence number of the command, which changes with the command
+ */
+static uint8_t _i2c_seq(opcodes_cmd_t code, const uint8_t *payload)
+{
+   uint8_t length = opcodes_payload_length(code);
+   bool changed = (code != _last_cmd);
+   uint8_t i;
+
+   for ( i=0; i<length; ++i )
+   {
+      changed = changed || (payload[i] != _last_payload[i]);
+      _last_payload[i] = payload[i];
+   }
+
+   if ( changed )
+   {
+      // The first command after a reset keeps OPCODES_SEQ_RESET
+      if ( _last_cmd != opcodes_cmd_error )
+      {
+         _seq = opcodes_seq_next(_seq);
+      }
+
+      _last_cmd = code;
+   }
+
+   return _seq;
+}
+
+
+/**
+ * Account for the outcome of a transaction in the statistics
+ */
+static inline void _i2c_count(status_code_t status)
+{
+   link_stats_counter_t counter;
+
+   switch ( status )
+   {
+   case STATUS_OK:
+      counter = link_stats_ok;
+      break;
+   case ERR_IO_ERROR:
+      counter = link_stats_nack;
+      break;
+   case ERR_BUSY:
+      counter = link_stats_collision;
+      break;
+   case ERR_PROTOCOL:
+      counter = link_stats_bus_error;
+      break;
+   case ERR_BAD_DATA:
+      counter = link_stats_bad_crc;
+      break;
+   case ERR_FLUSHED:
+      counter = link_stats_flushed;
+      break;
+   default:
+      counter = link_stats_bad_frame;
+      break;
+   }
+
+   link_stats_count(&i2c_link_stats, counter);
+}
+
+/**
+ * Called from the interrupt once the oldest transaction is complete
  */
 static inline void _i2c_on_complete(status_code_t status)
 {
-   twim_release();
-   
+   i2c_transaction_t *transaction = &_transactions[_oldest];
+
+   _oldest = (_oldest + 1) % I2C_TRANSACTIONS;
+   --_in_flight;
+
    if ( status == STATUS_OK )
    {
       // Check no transmit error
-      opcodes_reply_t reply = opcodes_decode_reply(last_sent, buffer);
+      uint8_t ack;
+      opcodes_reply_t decoded = opcodes_decode_reply(
+         transaction->reply, transaction->package.length, transaction->crc, &ack);
 
-      if ( reply == opcodes_reply_error )
+      if ( decoded == opcodes_reply_error )
       {
          status = ERR_BAD_DATA;
-         reactor_notify(on_error, (void *)status);
       }
       else
       {
-         uint16_t value = (reply == opcodes_reply_on) ? 1 : 0;
+         link_stats_record(&i2c_link_stats, timer_get_us() - transaction->start_us);
+
+         if ( transaction->query != I2C_NO_QUERY )
+         {
+            uint16_t item = transaction->reply[2] | (uint16_t)transaction->reply[3] << 8;
 
-         reactor_notify(on_data_received, (void*)value);
+            if ( transaction->query & OPCODES_QUERY_HEARTBEAT )
+            {
+               _heartbeat_period = item;
+            }
+            else
+            {
+               link_stats_set_item(&i2c_hub_link_stats, transaction->query, item);
+            }
+         }
+         else
+         {
+            uint16_t value = (decoded == opcodes_reply_on) ? I2C_READ_PRESSURE : 0;
+
+            // The hub executes a newer command. Follow on from it
+            if ( ack != transaction->seq )
+            {
+               _seq = opcodes_seq_next(ack);
+               value |= I2C_READ_STALE;
+               link_stats_count(&i2c_link_stats, link_stats_stale);
+            }
+
+            reactor_notify(on_data_received, (void *)(uintptr_t)value);
+         }
       }
    }
-   else
+
+   _i2c_count(status);
+
+   if ( status != STATUS_OK )
    {
       reactor_notify(on_error, (void *)status);
    }
 }
 
+/**
+ * Fill the next transaction and queue it
+ * @param code The command to send
+ * @param payload The payload of the command. Can be NULL if none
+ * @param query The item queried, or I2C_NO_QUERY
+ */
+static status_code_t _i2c_queue(opcodes_cmd_t code, const uint8_t *payload, uint8_t query)
+{
+   if ( _in_flight == I2C_TRANSACTIONS )
+   {
+      return ERR_BUSY;
+   }
+
+   i2c_transaction_t *transaction = &_transactions[_next];
+   twi_package_t *package = &transaction->package;
+
+   package->chip = TWI_SLAVE_ADDR;
+   // A query is not a command, so it carries the current sequence number
+   transaction->seq = (query == I2C_NO_QUERY) ? _i2c_seq(code, payload) : _seq;
+
+   // The frame is sent as the address of the package
+   package->addr_length = opcodes_encode_frame(package->addr, code, transaction->seq, payload);
+   package->buffer = transaction->reply;
+   package->length = (query == I2C_NO_QUERY) ? OPCODES_REPLY_SIZE : OPCODES_QUERY_REPLY_SIZE;
+   package->no_wait = true; // Let the reactor take care
+   package->complete_cb = _i2c_on_complete;
+
+   // The reply is only valid if it matches this frame
+   transaction->crc = opcodes_frame_crc(package->addr, package->addr_length);
+   transaction->query = query;
+   transaction->start_us = timer_get_us();
+
+   // Account for the transaction first, as it could complete at once
+   irqflags_t flags = cpu_irq_save();
+   ++_in_flight;
+   cpu_irq_restore(flags);
+
+   // Send the read request as a repeated start to the receiver
+   status_code_t status = twi_master_queue(&TWI0, package, true);
+
+   if ( status == STATUS_OK )
+   {
+      _next = (_next + 1) % I2C_TRANSACTIONS;
+   }
+   else
+   {
+      flags = cpu_irq_save();
+      --_in_flight;
+      cpu_irq_restore(flags);
+
+      // The reactor will have some data to process once the send is over
+      // If an error is return, report it. A busy bus is left to the caller
+      if ( status != ERR_BUSY )
+      {
+         reactor_notify(on_error, (void *)status);
+      }
+   }
+
+   return status;
+}
+
 void i2c_init(reactor_handle_t data_received, reactor_handle_t error_detected)
 {
    // Store the handles
    on_error = error_detected;
    on_data_received = data_received;
 
+   _next = _oldest = _in_flight = 0;
+
    // Initialize the ASF TWI
    twi_master_init(&TWI0);
 	twi_master_enable(&TWI0);
 }
 
-void i2c_master_send(opcodes_cmd_t code)
+status_code_t i2c_master_send(opcodes_cmd_t code, const uint8_t *payload)
 {
-   static twi_package_t package;
-
-   last_sent = code;
+   return _i2c_queue(code, payload, I2C_NO_QUERY);
+}
 
-   package.chip = TWI_SLAVE_ADDR;
-   package.addr[0] = code;
-   package.addr_length = 1;
-   package.buffer = &buffer;
-   package.length = 1;
-   package.no_wait = true; // Let the reactor take care
-   package.complete_cb = _i2c_on_complete;
+status_code_t i2c_master_query(uint8_t item)
+{
+   return _i2c_queue(opcodes_cmd_query, &item, item);
+}
 
-   // Send the read request as a repeated start to the receiver
-   status_code_t status = twi_master_read(&TWI0, &package);
-   
-   // The reactor will have some data to process once the send is over
-   // If an error is return, report it
-   if ( status != STATUS_OK )
+status_code_t i2c_master_propose_heartbeat(uint16_t period)
+{
+   // The highest proposal would read as I2C_NO_QUERY
+   if ( period > I2C_HEARTBEAT_MAX )
    {
-      reactor_notify(on_error, (void *)status);
+      period = I2C_HEARTBEAT_MAX;
    }
+
+   return i2c_master_query(OPCODES_QUERY_HEARTBEAT_ITEM(period));
+}
+
+uint16_t i2c_heartbeat_period(void)
+{
+   irqflags_t flags = cpu_irq_save();
+   uint16_t period = _heartbeat_period;
+   cpu_irq_restore(flags);
+
+   return period;
+}
+
+status_code_t i2c_recover(void)
+{
+   // Transactions in flight are lost with the bus
+   irqflags_t flags = cpu_irq_save();
+   _next = _oldest = _in_flight = 0;
+   cpu_irq_restore(flags);
+
+   link_stats_count(&i2c_link_stats, link_stats_recovery);
+
+   return twim_recover_bus(&TWI0);
 }
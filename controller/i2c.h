@@ -10,13 +10,40 @@
 #include "twim.h"
 #include "reactor.h"
 #include "op_codes.h"
+#include "link_stats.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/** Bits of the value passed to the data received handler */
+#define I2C_READ_PRESSURE 1 ///< The pressure input of the hub is on
+#define I2C_READ_STALE    2 ///< The hub executes a newer command. Send again
+
+/** Longest heartbeat period the controller can propose (ms) */
+#define I2C_HEARTBEAT_MAX 1260
+
+/** Statistics of the link as seen by the controller */
+extern link_stats_t i2c_link_stats;
+
+/** Copy of the statistics of the hub, refreshed one item at a time by i2c_master_query */
+extern link_stats_t i2c_hub_link_stats;
+
 void i2c_init(reactor_handle_t data_received, reactor_handle_t error_detected);
-void i2c_master_send(opcodes_cmd_t code);
+/** Queue a command. ERR_BUSY if the previous ones are still on the bus */
+status_code_t i2c_master_send(opcodes_cmd_t code, const uint8_t *payload);
+
+/** Queue the read of an item of the statistics of the hub */
+status_code_t i2c_master_query(uint8_t item);
+
+/** Queue a proposal of heartbeat period (ms). The hub replies with the period it accepts */
+status_code_t i2c_master_propose_heartbeat(uint16_t period);
+
+/** @return The heartbeat period accepted by the hub (ms), or the default until then */
+uint16_t i2c_heartbeat_period(void);
+
+/** Free a stuck bus, dropping the commands in flight. Call from the reactor */
+status_code_t i2c_recover(void);
 
 /** Check the status of the peripheral */
 static inline bool i2c_is_busy(void)
@@ -10,12 +10,16 @@
 #include "cpp.h"
 #include "sysclk.h"
 #include "ioport.h"
+#include "io_pin.hpp"
 #include "reactor.h"
 #include "timer.h"
 #include "digital_input.h"
 #include "digital_output.h"
 #include "piezzo.h"
 #include "alert.h"
+#include "flash_crc.h"
+#include "clock_scale.h"
+#include "sm_logger.hpp"
 #include "board.h"
 
 #include "op_codes.h"
@@ -25,30 +29,83 @@
 /* Forward declarations and event Handlers                              */
 /************************************************************************/
 static void on_input_change(void *arg);
+static void set_output_status(ioport_pin_t pin, bool state);
 static void on_beep_input(void *arg);
 static void on_sounder(void *arg);
 static void on_send_i2c_command(void *arg);
 static void on_i2c_error(void *);
 static void on_i2c_read(void *);
+static void on_i2c_recover(void *);
 static void on_comms_grace_over(void *);
 static void on_door_sensor_change(void *);
 static void on_door_cmd(void *);
 static void on_cmd_timeout(void *);
+static void on_chuck_timeout(void *);
+static void on_link_lost(void *);
 
 namespace
 {
    /** Number of errors which trigger a shutdown */
    constexpr auto COMMS_TOO_MANY_ERRORS = 100;
 
+   /** Number of consecutive errors which trigger a recovery of the bus */
+   constexpr auto COMMS_ERRORS_BEFORE_RECOVERY = 3;
+
    /** Duration of the filter (or no re-trigger period) for digital inputs */
    constexpr auto DI_FILT4 = TIMER_MILLISECONDS(40);
 
    /** Time in seconds when communications faults are tolerated */
    constexpr auto COMMS_GRACE_PERIOD = TIMER_SECONDS(5);
 
-   /** Time between i2c send */
-   constexpr auto I2C_DELAY_BETWEEN_TRANSMIT = TIMER_MILLISECONDS(100);
+   /**
+    * Time between i2c send when the command does not change (heartbeat), in ms.
+    * This is proposed to the hub, which replies with the period it accepts.
+    * Until then, both sides use OPCODES_HEARTBEAT_DEFAULT_MS.
+    */
+   constexpr uint16_t I2C_HEARTBEAT_PROPOSED = 250;
+
+   /** Number of heartbeat periods without a good read before the link is lost */
+   constexpr auto COMMS_LINK_LOSS_HEARTBEATS = 3;
+
+   /** Time to wait before trying again when the i2c has two frames in flight */
+   constexpr auto I2C_BUSY_RETRY_DELAY = TIMER_MILLISECONDS(1);
+
+   /** Number of busy retries before the i2c is considered faulty */
+   constexpr auto I2C_MAX_BUSY_RETRIES = 5;
+
+   /** Time between reads of the hub whilst waiting on it to confirm the chuck pressure */
+   constexpr auto CHUCK_POLL_PERIOD = TIMER_MILLISECONDS(20);
+
+   /** Number of transitions of the door kept for the diagnosis of the faults */
+   constexpr uint8_t DOOR_SM_LOG_SIZE = 16;
    
+   /**
+    * If true, all active pneumatic inputs are sent at once as a bitmask of
+    *  valves, and the hub enforces the compressor budget.
+    * Else, only the input of highest priority is sent.
+    */
+#ifdef MULTI_VALVES
+   constexpr bool multi_valves = true;
+#else
+   constexpr bool multi_valves = false;
+#endif
+
+   /**
+    * If true, an air blast is sent as a pulse sequence which the hub runs on
+    *  its own, rather than held on by the heartbeat (make BLAST_PULSES=1).
+    * Only when a single valve is sent at once.
+    */
+#ifdef BLAST_PULSES
+   constexpr bool blast_pulses = true;
+#else
+   constexpr bool blast_pulses = false;
+#endif
+
+   /** Pulse sequence of the air blasts: 200ms on, 100ms off, 5 times */
+   constexpr uint8_t BLAST_PULSE_ON    = 200 / OPCODES_PULSE_UNIT_MS;
+   constexpr uint8_t BLAST_PULSE_OFF   = 100 / OPCODES_PULSE_UNIT_MS;
+   constexpr uint8_t BLAST_PULSE_COUNT = 5;
+
    /** Arcade tune */
    constexpr auto arcade_tune = "C,3 R C E G E G E D R D F A2~A3 B G E B G E B G E C' R B, C'~C1";
 
@@ -59,6 +116,7 @@ namespace
    {
       ioport_pin_t pin;     ///< Input pin
       opcodes_cmd_t opcode; ///< Matching opcode
+      uint8_t valve;        ///< Matching valve in the bitmask of valves
       bool state;           ///< Last seen state of this output
    } output_status_t;
 
@@ -70,25 +128,31 @@ namespace
    reactor_handle_t react_i2c_read =         reactor_register(on_i2c_read,           reactor_prio_high,      1);
    reactor_handle_t react_sounder =          reactor_register(on_sounder,            reactor_prio_medium,    1);
    reactor_handle_t react_i2c_error =        reactor_register(on_i2c_error,          reactor_prio_medium,    1);
+   reactor_handle_t react_i2c_recover =      reactor_register(on_i2c_recover,        reactor_prio_medium,    1);
    reactor_handle_t react_input_change =     reactor_register(on_input_change,       reactor_prio_medium,    1);
    reactor_handle_t react_door_sensor =      reactor_register(on_door_sensor_change, reactor_prio_medium,    1);
    reactor_handle_t react_door_cmd =         reactor_register(on_door_cmd,           reactor_prio_medium,    1);
    reactor_handle_t react_cmd_timeout =      reactor_register(on_cmd_timeout,        reactor_prio_low,       1);
+   reactor_handle_t react_chuck_timeout =    reactor_register(on_chuck_timeout,      reactor_prio_low,       1);
    reactor_handle_t react_comms_grace_over = reactor_register(on_comms_grace_over,   reactor_prio_low,       1);
+   reactor_handle_t react_link_lost =        reactor_register(on_link_lost,          reactor_prio_low,       1);
 
    /** Command to send via i2c */
    opcodes_cmd_t current_command = opcodes_cmd_idle;
 
+   /** Valves to turn on, sent with the commands opcodes_cmd_valves and opcodes_cmd_pulse */
+   uint8_t current_valves = 0;
+
    /**
     * Keep track of all the outputs ordered by priority.
     * Only 1 pneumatic valve is activated at once to preserve the compressor
     */
    output_status_t output_statuses[] = {
-       {IN_CHUCK_OPEN,        opcodes_cmd_unclamp_chuck,    false},
-       {IN_SPINDLE_AIR_BLAST, opcodes_cmd_blast_spindle,    false},
-       {IN_TOOLSET_AIR_BLAST, opcodes_cmd_blast_toolsetter, false},
-       {IN_DOOR_UP,           opcodes_cmd_pull_door,        false}, // Fake input
-       {IN_DOOR_DOWN,         opcodes_cmd_push_door,        false}, // Fake input
+       {IN_CHUCK_OPEN,        opcodes_cmd_unclamp_chuck,    opcodes_valve_chuck,            false},
+       {IN_SPINDLE_AIR_BLAST, opcodes_cmd_blast_spindle,    opcodes_valve_blast_spindle,    false},
+       {IN_TOOLSET_AIR_BLAST, opcodes_cmd_blast_toolsetter, opcodes_valve_blast_toolsetter, false},
+       {IN_DOOR_UP,           opcodes_cmd_pull_door,        opcodes_valve_pull_door,        false}, // Fake input
+       {IN_DOOR_DOWN,         opcodes_cmd_push_door,        opcodes_valve_push_door,        false}, // Fake input
    };
 
    /** Count the number of transmit errors */
@@ -97,12 +161,34 @@ namespace
    /** If true, communications error are not fatal */
    bool comms_in_error_grace_period_active = true;
 
-   /** Flag set to end sending following too many errors */
-   bool stop_transmit = false;
+   /** Count the errors since the last good read, or the last recovery */
+   uint8_t comms_consecutive_errors = 0;
+
+   /** Flag set following too many errors, until the communication is restored */
+   bool comms_failed = false;
 
-   /** Timer used to transmit over the i2c */
+   /** Timer used to transmit over the i2c. Only one is ever armed */
    timer_instance_t transmit_timer = TIMER_INVALID_INSTANCE;
 
+   /** A transmit right away is queued in the reactor */
+   bool transmit_pending = false;
+
+   /** Timer which detects the loss of the link. Re-armed on every good read */
+   timer_instance_t link_timer = TIMER_INVALID_INSTANCE;
+
+   /** Number of consecutive attempts to transmit whilst the i2c was busy */
+   uint8_t busy_retries = 0;
+
+   /** Argument of the transmit handler when called by the heartbeat timer */
+   void * const heartbeat = reinterpret_cast<void *>(1);
+
+   /**
+    * Next item of the statistics of the hub to read.
+    * The item after the last one is the proposal of the heartbeat period,
+    *  which comes first, so the period is negotiated on the first heartbeat.
+    */
+   uint8_t hub_stats_item = LINK_STATS_ITEMS;
+
    /*
     * Outputs                                                              
     */
@@ -120,59 +206,196 @@ namespace
  */
 #include "state_machine.hpp"
 
+/** Last transitions of the door. Watch from the debugger */
+sm_logger<DOOR_SM_LOG_SIZE> door_sm_log;
+
 /** Create the state machine */
-boost::sml::sm<door_sm> door_sm;
+boost::sml::sm<door_sm, boost::sml::logger<decltype(door_sm_log)>, door_sm_dispatch> door_sm{door_sm_log};
+
+/** The chuck, sequenced with the pressure confirmed by the hub */
+boost::sml::sm<chuck_sm> chuck_sm;
 
 
 /************************************************************************/
 /* Local functions                                                      */
 /************************************************************************/
 
+/** @return The heartbeat period negotiated with the hub as a timer count */
+static timer_count_t heartbeat_period(void)
+{
+   return TIMER_MILLISECONDS(i2c_heartbeat_period());
+}
+
+/** (Re)start the detection of the loss of the link */
+static void arm_link_timer(void)
+{
+   if ( link_timer != TIMER_INVALID_INSTANCE )
+   {
+      timer_cancel(link_timer);
+   }
+
+   link_timer = timer_arm(
+      react_link_lost,
+      timer_get_count_from_now(heartbeat_period() * COMMS_LINK_LOSS_HEARTBEATS),
+      0, 0
+   );
+}
+
+/**
+ * Go into failsafe mode until the communication is restored.
+ * Sound the alert once.
+ */
+static void enter_failsafe(void)
+{
+   if ( ! comms_failed )
+   {
+      // Turn off the pressure input as a fail safe
+      digitial_output_set(chuck_released_oc, false);
+         
+      // Light the communication error LED
+      digitial_output_set(led_fault, true);
+
+      // Sound the beeper to signal an error
+      piezzo_start_tone(PIEZZO_FREQ_TO_PWM(2000), TIMER_SECONDS(5));
+
+      // Keep the failsafe until the communication is restored
+      comms_failed = true;
+   }
+}
+
 /** Now lack of connection and transmit errors are accounted for */
 static void on_comms_grace_over(void *)
 {
    comms_in_error_grace_period_active = false;
+
+   // The hub may never have answered
+   arm_link_timer();
+}
+
+/**
+ * No good read for COMMS_LINK_LOSS_HEARTBEATS heartbeat periods.
+ * The hub has turned all valves off by now, so go into failsafe mode.
+ * This clears on the next good read, like the failsafe on errors.
+ */
+static void on_link_lost(void *)
+{
+   link_timer = TIMER_INVALID_INSTANCE;
+
+   if ( comms_in_error_grace_period_active )
+   {
+      return;
+   }
+
+   link_stats_count(&i2c_link_stats, link_stats_timeout);
+   enter_failsafe();
+}
+
+/** Cancel the transmit timer, if armed */
+static void cancel_transmit(void)
+{
+   if ( transmit_timer != TIMER_INVALID_INSTANCE )
+   {
+      timer_cancel(transmit_timer);
+      transmit_timer = TIMER_INVALID_INSTANCE;
+   }
 }
 
-/** Send an i2c command to the hub */
+/**
+ * Arm the transmit timer
+ * The previous one is cancelled first, so a run of the handler which was
+ *  already queued cannot leave a second chain of heartbeats behind.
+ */
+static void arm_transmit(timer_count_t delay, void *arg)
+{
+   cancel_transmit();
+   transmit_timer = timer_arm(react_i2c_command, timer_get_count_from_now(delay), 0, arg);
+}
+
+/**
+ * Send an i2c command to the hub
+ * Called right away when the command changes, else by the heartbeat timer.
+ * The next heartbeat is always re-armed from the last transmit, so a
+ *  change resets the heartbeat period.
+ * Each heartbeat also reads an item of the statistics of the hub, so the
+ *  copy in i2c_hub_link_stats is refreshed in the background, or proposes
+ *  the heartbeat period once per round.
+ */
 static void on_send_i2c_command(void *arg)
 {
-   // If the error count is too high - stop sending
-   if ( ! stop_transmit )
-   {   
-      // Send an i2c command
-      // The i2c should never be busy since we delay the transmit by 5 times a single transmit
-      if ( i2c_is_busy() )
+   // A heartbeat which fired before a transmit right away was queued.
+   // The latter follows, and re-arms the heartbeat
+   if ( arg == heartbeat && transmit_pending )
+   {
+      return;
+   }
+
+   transmit_pending = false;
+
+   // A command is queued behind the frame on the wire, and chained by the driver.
+   // Both slots are only taken if the bus is slow or stuck, so retry shortly.
+   const uint8_t payload[OPCODES_MAX_PAYLOAD] = {
+      current_valves, BLAST_PULSE_ON, BLAST_PULSE_OFF, BLAST_PULSE_COUNT
+   };
+
+   if ( i2c_master_send(current_command, payload) == ERR_BUSY )
+   {
+      if ( ++busy_retries > I2C_MAX_BUSY_RETRIES )
       {
-	     // Count an error
+         // The bus is stuck. Count an error and fall back to the heartbeat
+         busy_retries = 0;
+         link_stats_count(&i2c_link_stats, link_stats_timeout);
          on_i2c_error(0);
+
+         arm_transmit(heartbeat_period(), heartbeat);
       }
       else
       {
-         i2c_master_send(current_command);
+         arm_transmit(I2C_BUSY_RETRY_DELAY, arg);
+      }
+
+      return;
+   }
+
+   busy_retries = 0;
+
+   if ( arg == heartbeat )
+   {
+      status_code_t status = (hub_stats_item == LINK_STATS_ITEMS)
+         ? i2c_master_propose_heartbeat(I2C_HEARTBEAT_PROPOSED)
+         : i2c_master_query(hub_stats_item);
+
+      if ( status == STATUS_OK )
+      {
+         hub_stats_item = (hub_stats_item + 1) % (LINK_STATS_ITEMS + 1);
       }
-      
-      transmit_timer = timer_arm(
-         react_i2c_command, timer_get_count_from_now(I2C_DELAY_BETWEEN_TRANSMIT), 0, 0);
    }
-}   
+
+   if ( chuck::confirming )
+   {
+      // Read the pressure often until the hub confirms it. No statistics meanwhile
+      arm_transmit(CHUCK_POLL_PERIOD, 0);
+   }
+   else
+   {
+      arm_transmit(heartbeat_period(), heartbeat);
+   }
+}
 
 /** 
- * (Re)Start periodic transmit to the hub
- * Re-initiate the periodic transmit.
- * Cancel any on-going wait, and transmit right away.
+ * Transmit to the hub right away
+ * Cancel any on-going wait (heartbeat or retry), and let the reactor send
+ *  the current command as soon as possible.
+ * A transmit already queued is not queued again.
  */
 static void trigger_next_transmit(void)
 {
-   if (transmit_timer != TIMER_INVALID_INSTANCE)
+   cancel_transmit();
+
+   if ( ! transmit_pending )
    {
-      timer_cancel(transmit_timer);
+      transmit_pending = true;
+      reactor_notify(react_i2c_command, 0);
    }
-
-   // Start transmit in 1ms (at least). A whole frame take 300us.
-   // This way, there cannot be a collision with the on-going frame
-   transmit_timer = timer_arm(
-      react_i2c_command, timer_get_count_from_now(TIMER_MILLISECONDS(1)), 0, 0);
 }
 
 /** Check the pneumatic inputs, and let the hub know */
@@ -180,23 +403,39 @@ static void refresh_opcode(void)
 {
    // If we get to the end of the iteration and none are on, state is idle
    opcodes_cmd_t new_cmd = opcodes_cmd_idle;
+   uint8_t new_valves = 0;
 
    // Update with the highest priority
    for (uint8_t i = 0; i < COUNTOF(output_statuses); ++i)
    {
       if (output_statuses[i].state)
       {
-         new_cmd = output_statuses[i].opcode;
-         break;
+         if ( ! multi_valves )
+         {
+            new_cmd = output_statuses[i].opcode;
+
+            if ( blast_pulses &&
+               (new_cmd == opcodes_cmd_blast_spindle || new_cmd == opcodes_cmd_blast_toolsetter) )
+            {
+               new_cmd = opcodes_cmd_pulse;
+               new_valves = output_statuses[i].valve;
+            }
+
+            break;
+         }
+
+         new_valves |= output_statuses[i].valve;
+         new_cmd = opcodes_cmd_valves;
       }
    }
 
    // Has the state changes (very unlikely it has not)
-   if (current_command != new_cmd)
+   if (current_command != new_cmd || current_valves != new_valves)
    {
       current_command = new_cmd;
+      current_valves = new_valves;
 
-      // Cancel the TWI timer to transmit here and now
+      // Transmit here and now - do not wait for the heartbeat
       trigger_next_transmit();
    }
 }
@@ -207,6 +446,15 @@ static void on_cmd_timeout(void *arg)
    door_sm.process_event(event_timeout{});
 }
 
+/** Called when the hub did not confirm the pressure of the chuck in time */
+static void on_chuck_timeout(void *arg)
+{
+   if ( chuck::timeout_is_current(arg) )
+   {
+      chuck_sm.process_event(event_chuck_timeout{});
+   }
+}
+
 /**
  * Called with the input changes (high to low or low to high)
  * Pass to the state machine to handle the request
@@ -234,7 +482,7 @@ static void on_door_sensor_change(void *arg)
    if ( pin_and_value.pin == IN_DOOR_DOWN )
    {
       // For the down sensor, forward to the OC output
-      ioport_set_pin_level(OC_DOOR_CLOSED, pin_and_value.value);
+      io_pin<OC_DOOR_CLOSED>::set(pin_and_value.value);
 
       if ( pin_and_value.value )      
       {
@@ -297,30 +545,46 @@ static void on_input_change(void *arg)
    // Grab the pin that changed
    pin_and_value_t pav {.as_arg = arg};
 
+   // The chuck is sequenced by its state machine
+   if (pav.pin == IN_CHUCK_OPEN)
+   {
+      if (pav.value)
+      {
+         chuck_sm.process_event(event_unclamp{});
+      }
+      else
+      {
+         chuck_sm.process_event(event_clamp{});
+      }
+
+      return;
+   }
+
+   set_output_status(pav.pin, pav.value);
+}
+
+/** Set the state of a pneumatic output, and let the hub know */
+static void set_output_status(ioport_pin_t pin, bool state)
+{
    // Iterate
    for (uint8_t i = 0; i < COUNTOF(output_statuses); ++i)
    {
-      if (output_statuses[i].pin == pav.pin)
+      if (output_statuses[i].pin == pin)
       {
-         output_statuses[i].state = pav.value;
+         output_statuses[i].state = state;
          refresh_opcode();
          break;
       }
    }
-   
-   // Drive the chuck LED
-   if (pav.pin == IN_CHUCK_OPEN)
-   {
-      digitial_output_set(led_chuck, pav.value);
-   }
 }
 
 
 /**
  * Called on error detected on the i2c
  * The slave should be up at the same time as the master.
- * The system will stop if the slave fails to answer or if too
- *  many consecutive errors are detected.
+ * After a few consecutive errors, the bus is recovered, in case the hub
+ *  holds it.
+ * The system goes into failsafe if too many errors are detected.
  * The comms_error_count is incremented by 2 on error, and goes down by 1 if
  *  a good communication is detected.
  * Sound the alert, and go into failsafe mode.
@@ -332,23 +596,22 @@ static void on_i2c_error(void *arg)
    {
 #ifdef NDEBUG
       // Increment errors at the twice the rate of good packets
-      comms_error_count += 2;
+      if ( comms_error_count < COMMS_TOO_MANY_ERRORS )
+      {
+         comms_error_count += 2;
+      }
 #endif
    }      
 
-   if ( comms_error_count >= COMMS_TOO_MANY_ERRORS )
+   if ( ++comms_consecutive_errors >= COMMS_ERRORS_BEFORE_RECOVERY )
    {
-      // Turn off the pressure input as a fail safe
-      digitial_output_set(chuck_released_oc, false);
-         
-      // Light the communication error LED
-      digitial_output_set(led_fault, true);
-
-      // In release, turn of communication and sound the beeper to signal an error
-      piezzo_start_tone(PIEZZO_FREQ_TO_PWM(2000), TIMER_SECONDS(5));
+      comms_consecutive_errors = 0;
+      reactor_notify(react_i2c_recover, 0);
+   }
 
-      // Flag end of transmit
-      stop_transmit = true;
+   if ( comms_error_count >= COMMS_TOO_MANY_ERRORS )
+   {
+      enter_failsafe();
    }
    else
    {
@@ -357,13 +620,41 @@ static void on_i2c_error(void *arg)
    }
 }
 
+/**
+ * Free the bus after repeated errors
+ * Clock out the hub if it holds the data line, and restart the TWI.
+ * This takes about 100us - then transmit again at once.
+ */
+static void on_i2c_recover(void *arg)
+{
+   if ( i2c_recover() != STATUS_OK )
+   {
+      // A line is still held low. Count an error and try again later
+      on_i2c_error(0);
+   }
+
+   trigger_next_transmit();
+}
+
 /**
  * Handle a successful read from the i2c slave
  * The returned value was also checked for errors
  */
 static void on_i2c_read(void *arg)
 {
-   bool status = (bool)arg;
+   uintptr_t value = (uintptr_t)arg;
+   bool status = value & I2C_READ_PRESSURE;
+
+   comms_consecutive_errors = 0;
+
+   // The hub answers - push back the detection of the loss of the link
+   arm_link_timer();
+
+   // The command was rejected as older than the one the hub executes
+   if ( value & I2C_READ_STALE )
+   {
+      trigger_next_transmit();
+   }
 
    // Decrement the error count
    // We need 2 good Transmit for one Receive
@@ -372,8 +663,31 @@ static void on_i2c_read(void *arg)
       --comms_error_count;
    }
 
-   // Re-inject the pressure back to Masso
-   digitial_output_set( chuck_released_oc, status );
+   if ( comms_failed )
+   {
+      // Stay in failsafe until all errors are cleared
+      if ( comms_error_count > 0 )
+      {
+         return;
+      }
+
+      comms_failed = false;
+      digitial_output_set(led_fault, false);
+
+      // Report the chuck released again, if it still is
+      using namespace boost::sml;
+      digitial_output_set(chuck_released_oc, chuck_sm.is("released"_s));
+   }
+
+   // Let the chuck know of the pressure. Masso is told once it is confirmed
+   if ( status )
+   {
+      chuck_sm.process_event(event_pressure_on{});
+   }
+   else
+   {
+      chuck_sm.process_event(event_pressure_off{});
+   }
 }
 
 
@@ -400,10 +714,13 @@ int main(void)
    digitial_output_start(led_door_opening, 1000, "++-", false);
    digitial_output_start(led_door_closing, 1000, "++-", false);
 
+   // Restore the travel times of the door learned before the reset
+   valve::load_profile();
+
    // Register for i2c events
    i2c_init(react_i2c_read, react_i2c_error);
 
-   // Start sending to the i2c periodically
+   // Send the idle command, then keep the hub informed with the heartbeat
    trigger_next_transmit();
    
    // Start a timer to tolerate communications error for the first N seconds
@@ -413,6 +730,16 @@ int main(void)
 	  0, 0
    );
 
+#ifdef FLASH_CRC
+   // Check the flash against its CRC in the idle time
+   flash_crc_init();
+#endif
+
+#ifdef CLOCK_SCALE
+   // Slow the clock down when there is little to do
+   clock_scale_init();
+#endif
+
 #ifdef NDEBUG
    // Play some arcade tune from memory
    piezzo_play(190, arcade_tune);
@@ -3,31 +3,125 @@
 
 #include <boost/sml.hpp>
 
+#include "door_profile.h"
+
+#ifdef DOOR_PROFILE_EEPROM
+#  include <avr/eeprom.h>
+#  include "crc.h"
+#endif
+
 namespace sml = boost::sml;
 
-// Create those simple events
-struct event_open {};
-struct event_close {};
-struct event_door_is_up {};
-struct event_door_is_down {};
-struct event_door_moving_up {};
-struct event_door_moving_down {};
-struct event_timeout {};
+/**
+ * Dispatch policy of the door state machine (make DOOR_SM_DISPATCH=switch_stm)
+ * One of jump_table (the SML default), branch_stm, switch_stm or fold_expr.
+ * See test/sm_dispatch for the cost of each, and 'make dispatch_sizes'.
+ */
+#ifndef DOOR_SM_DISPATCH
+#define DOOR_SM_DISPATCH jump_table
+#endif
+
+using door_sm_dispatch = sml::dispatch<sml::back::policies::DOOR_SM_DISPATCH>;
+
+// Create those simple events. The names are for the logger
+struct event_open             { static auto c_str() { return "open"; } };
+struct event_close            { static auto c_str() { return "close"; } };
+struct event_door_is_up       { static auto c_str() { return "is_up"; } };
+struct event_door_is_down     { static auto c_str() { return "is_down"; } };
+struct event_door_moving_up   { static auto c_str() { return "moving_up"; } };
+struct event_door_moving_down { static auto c_str() { return "moving_down"; } };
+struct event_timeout          { static auto c_str() { return "timeout"; } };
+struct event_unclamp          { static auto c_str() { return "unclamp"; } };
+struct event_clamp            { static auto c_str() { return "clamp"; } };
+struct event_pressure_on      { static auto c_str() { return "pressure_on"; } };
+struct event_pressure_off     { static auto c_str() { return "pressure_off"; } };
+struct event_chuck_timeout    { static auto c_str() { return "chuck_timeout"; } };
 
 
 namespace valve
 {
-   // Constants
+   // Constants - timeouts until the door travel times are learned
    constexpr auto moving_timeout = TIMER_SECONDS(3);
    constexpr auto complete_timeout = TIMER_SECONDS(8);
 
    // Locals
    timer_instance_t timer = TIMER_INVALID_INSTANCE;
+
+   // Learned travel times
+   door_profile_t profile = {};
+
+   // Direction and phase of the current move, and when the phase started
+   door_profile_direction_t direction = door_profile_opening;
+   door_profile_phase_t phase = door_profile_release;
+   timer_count_t phase_start = 0;
+
+#ifdef DOOR_PROFILE_EEPROM
+   // Copy of the profile in EEPROM, guarded by a CRC
+   struct stored_profile_t
+   {
+      door_profile_t profile;
+      uint8_t crc;
+   };
+
+   EEMEM stored_profile_t stored_profile;
+
+   // Profile as last written, to only write on a drift
+   door_profile_t saved_profile = {};
+
+   /** Restore the profile learned before the reset, if valid */
+   auto load_profile = [] {
+      stored_profile_t stored;
+
+      eeprom_read_block(&stored, &stored_profile, sizeof(stored));
+
+      if ( crc8((const uint8_t *)&stored.profile, sizeof(stored.profile), CRC8_INIT) == stored.crc )
+      {
+         profile = saved_profile = stored.profile;
+      }
+   };
+
+   /** Write the profile if it drifted. Only the changed bytes are written */
+   auto save_profile = [] {
+      if ( door_profile_drifted(&saved_profile, &profile) )
+      {
+         stored_profile_t stored = { profile, crc8((const uint8_t *)&profile, sizeof(profile), CRC8_INIT) };
+
+         eeprom_update_block(&stored, &stored_profile, sizeof(stored));
+         saved_profile = profile;
+      }
+   };
+#else
+   auto load_profile = [] {};
+   auto save_profile = [] {};
+#endif
    
    // Helpers as lambdas
    auto arm_timer = [](timer_count_t c) {
       timer = timer_arm(react_cmd_timeout, timer_get_count_from_now(c), 0, 0);
    };
+
+   /** Time a phase of the move, with a timeout learned for it */
+   auto start_phase = [](door_profile_phase_t p, timer_count_t fallback) {
+      phase = p;
+      phase_start = timer_get_count();
+      arm_timer(door_profile_timeout(profile.average[direction][p], fallback));
+   };
+
+   /** Learn the time of the phase completed */
+   auto end_phase = [] {
+      door_profile_record(&profile, direction, phase, timer_time_lapsed_since(phase_start));
+   };
+
+   /** The door reached the other sensor. Only learn from a full travel */
+   auto arrived = [] {
+      timer_cancel(timer);
+
+      if ( phase == door_profile_travel )
+      {
+         end_phase();
+         save_profile();
+      }
+   };
    
    /************************************************************************/
    /* Transition lambdas                                                   */
@@ -36,13 +130,14 @@ namespace valve
    auto push_on  = [] { 
       on_input_change( pin_and_value_as_arg(IN_DOOR_UP, true) );
       digitial_output_start(led_door_opening, TIMER_SECONDS(1), "+1-", true);
-      arm_timer(moving_timeout);
+      direction = door_profile_opening;
+      start_phase(door_profile_release, moving_timeout);
    };
    
    auto push_off = [] { 
       on_input_change( pin_and_value_as_arg(IN_DOOR_UP, false) );
       digitial_output_set(led_door_opening, false);
-      timer_cancel(timer);
+      arrived();
    };
 
    auto push_timeout = [] {
@@ -53,13 +148,14 @@ namespace valve
    auto pull_on = [] {
       on_input_change( pin_and_value_as_arg(IN_DOOR_DOWN, true) );
       digitial_output_start(led_door_closing, TIMER_SECONDS(1), "+1-", true);
-      arm_timer(moving_timeout);
+      direction = door_profile_closing;
+      start_phase(door_profile_release, moving_timeout);
    };
    
    auto pull_off = [] {
       on_input_change( pin_and_value_as_arg(IN_DOOR_DOWN, false) );
       digitial_output_set(led_door_closing, false);
-      timer_cancel(timer);
+      arrived();
    };
 
    auto pull_timeout = [] {
@@ -67,9 +163,102 @@ namespace valve
       digitial_output_start(led_door_closing, TIMER_SECONDS(1), "+4-", true);
    };
    
+   /** The door leaves its sensor. A bounce of the sensor once travelling is ignored */
    auto door_moving = [] {
+      if ( phase == door_profile_release )
+      {
+         timer_cancel(timer);
+         end_phase();
+         start_phase(door_profile_travel, complete_timeout);
+      }
+   };
+};
+
+
+namespace chuck
+{
+   // Constants - time for the hub to confirm the pressure
+   constexpr auto unclamp_timeout = TIMER_SECONDS(2);
+   constexpr auto clamp_timeout = TIMER_SECONDS(2);
+
+   // Locals
+   timer_instance_t timer = TIMER_INVALID_INSTANCE;
+
+   /** True whilst waiting on the hub to confirm. The hub is polled faster */
+   bool confirming = false;
+
+   /** Number of the current wait, given to its timeout */
+   uint8_t wait_number = 0;
+
+   // Helpers as lambdas
+   auto wait_confirm = [](timer_count_t c) {
       timer_cancel(timer);
-      arm_timer(complete_timeout);
+      ++wait_number;
+      timer = timer_arm(
+         react_chuck_timeout, timer_get_count_from_now(c), 0, (void *)(uintptr_t)wait_number);
+      confirming = true;
+   };
+
+   /**
+    * A timeout which fired before its timer was cancelled is still delivered
+    * @return true if the timeout is the one of the current wait
+    */
+   auto timeout_is_current = [](void *arg) {
+      return confirming && (uintptr_t)arg == wait_number;
+   };
+
+   auto confirmed = [] {
+      timer_cancel(timer);
+      confirming = false;
+   };
+
+   /************************************************************************/
+   /* Transition lambdas                                                   */
+   /************************************************************************/
+
+   auto valve_on = [] {
+      set_output_status(IN_CHUCK_OPEN, true);
+      digitial_output_start(led_chuck, TIMER_SECONDS(1), "+1-", true);
+      wait_confirm(unclamp_timeout);
+   };
+
+   auto valve_off = [] {
+      set_output_status(IN_CHUCK_OPEN, false);
+      digitial_output_set(chuck_released_oc, false);
+      digitial_output_start(led_chuck, TIMER_SECONDS(1), "+1-", true);
+      wait_confirm(clamp_timeout);
+   };
+
+   // Tell Masso as soon as the hub confirms
+   auto released = [] {
+      confirmed();
+      digitial_output_set(chuck_released_oc, true);
+      digitial_output_set(led_chuck, true);
+   };
+
+   // The pressure dropped with the valve on. Wait for it to come back
+   auto pressure_lost = [] {
+      digitial_output_set(chuck_released_oc, false);
+      digitial_output_start(led_chuck, TIMER_SECONDS(1), "+1-", true);
+      wait_confirm(unclamp_timeout);
+   };
+
+   auto clamped = [] {
+      confirmed();
+      digitial_output_set(led_chuck, false);
+   };
+
+   // No pressure - release the valve rather than leave it on unconfirmed
+   auto unclamp_failed = [] {
+      confirming = false;
+      set_output_status(IN_CHUCK_OPEN, false);
+      digitial_output_start(led_chuck, TIMER_SECONDS(1), "+4-", true);
+   };
+
+   // The pressure stays - the chuck could be stuck open
+   auto clamp_failed = [] {
+      confirming = false;
+      digitial_output_start(led_chuck, TIMER_SECONDS(1), "+4-", true);
    };
 };
 
@@ -98,4 +287,29 @@ struct door_sm
    }
 };
 
+/**
+ * The chuck is released once the hub confirms the pressure, and clamped
+ *  once the pressure is gone. The pressure events are sent on every read
+ *  of the hub, so the ones which do not change anything are ignored.
+ */
+struct chuck_sm
+{
+   auto operator()() const noexcept
+   {
+      using namespace sml;
+
+      return make_transition_table(
+         *"clamped"_s    + event<event_unclamp>       / chuck::valve_on       = "unclamping"_s,
+          "unclamping"_s + event<event_pressure_on>   / chuck::released       = "released"_s,
+          "unclamping"_s + event<event_clamp>         / chuck::valve_off      = "clamping"_s,
+          "unclamping"_s + event<event_chuck_timeout> / chuck::unclamp_failed = "clamped"_s,
+          "released"_s   + event<event_pressure_off>  / chuck::pressure_lost  = "unclamping"_s,
+          "released"_s   + event<event_clamp>         / chuck::valve_off      = "clamping"_s,
+          "clamping"_s   + event<event_pressure_off>  / chuck::clamped        = "clamped"_s,
+          "clamping"_s   + event<event_unclamp>       / chuck::valve_on       = "unclamping"_s,
+          "clamping"_s   + event<event_chuck_timeout> / chuck::clamp_failed   = "clamped"_s
+      );
+   }
+};
+
 #endif  // state_machine_h_included
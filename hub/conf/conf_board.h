@@ -18,6 +18,9 @@
 // Share the trace pin
 #define ALERT_OUTPUT_PIN TRACE_ERR
 
+// Stream of the trace (make TRACE=1, see make/trace.py)
+#define TRACE_PIN TRACE_INFO
+
 /************************************************************************/
 /* Functional I/Os                                                      */
 /************************************************************************/
@@ -8,6 +8,7 @@
 #include "protocol.h"
 #include "twis.h"
 #include "pressure_mon.h"
+#include "i2c_slave.h"
 #include "conf_twi.h"
 
 
@@ -17,29 +18,248 @@ TWI_Slave_t slave;
 /** Reactor handler to call when data is received */
 reactor_handle_t _react_i2c_handler = REACTOR_NULL_HANDLE;
 
+/** Last command accepted. Its sequence number is the ack of all replies */
+static uint8_t _last_frame[OPCODES_FRAME_MAX_SIZE];
+
+/** Size of the last command accepted, or 0 until a command is accepted */
+static uint8_t _last_size = 0;
+
+/**
+ * Replies to the last command accepted, for each status.
+ * The heartbeat repeats the last command, so its reply is only a copy.
+ */
+static uint8_t _last_replies[opcodes_reply_error][OPCODES_REPLY_SIZE];
+
+/** Status returned in the replies */
+static volatile opcodes_reply_t _status = opcodes_reply_off;
+
+/** Time of the last command received, to record the time between commands */
+static timer_count_t _last_command_time;
+
+/** Statistics of the link as seen by the hub */
+link_stats_t i2c_slave_link_stats;
+
+
+/**
+ * Accept a new command, and prepare the replies to its heartbeats
+ */
+static inline void _accept(const uint8_t *frame, uint8_t size)
+{
+   uint8_t crc = opcodes_frame_crc(frame, size);
+   uint8_t i;
+
+   for ( i=0; i<size; ++i )
+   {
+      _last_frame[i] = frame[i];
+   }
+
+   _last_size = size;
+
+   opcodes_encode_reply(_last_replies[opcodes_reply_off], opcodes_reply_off, frame[1], NULL, 0, crc);
+   opcodes_encode_reply(_last_replies[opcodes_reply_on], opcodes_reply_on, frame[1], NULL, 0, crc);
+}
+
+/**
+ * @return true if the frame repeats the last command accepted
+ */
+static inline bool _is_repeat(const uint8_t *frame, uint8_t size)
+{
+   uint8_t i;
+
+   if ( size != _last_size )
+   {
+      return false;
+   }
+
+   for ( i=0; i<size; ++i )
+   {
+      if ( frame[i] != _last_frame[i] )
+      {
+         return false;
+      }
+   }
+
+   return true;
+}
 
 /**
  * Called from within the interrupt of the twi to handle the data 
  * Note: The reactor is not used to avoid any delay
+ * The reply is only made available once a complete frame with a valid CRC
+ *  has been received. Until then, a read gets an error.
+ * Commands are accepted in order. A command older than the last one accepted
+ *  (i.e. a late retransmission) is rejected, and the reply acks the command
+ *  in force. Only accepted commands are passed to the protocol, which applies
+ *  them at once.
+ * The heartbeat repeats the last command, so its reply is only a compare and
+ *  a copy.
  */
 static void slave_process(void) 
 {
-   uint8_t received = slave.receivedData[0];
+   const uint8_t *frame = (const uint8_t *)slave.receivedData;
+   uint8_t index = slave.bytesReceived;
+   opcodes_cmd_t received = opcodes_check_cmd_valid(frame[0]);
+   uint8_t size = opcodes_frame_size(received);
+   uint8_t ack = _last_size ? _last_frame[1] : OPCODES_SEQ_RESET;
+   uint8_t seq = frame[1];
+   uint8_t crc;
+   const uint8_t *reply;
+
+   // A new frame invalidates the previous reply
+   if ( index == 0 )
+   {
+      slave.sendData[0] = opcodes_reply_error;
+
+      if ( received == opcodes_cmd_error )
+      {
+         link_stats_count(&i2c_slave_link_stats, link_stats_bad_frame);
+      }
+   }
    
-   // Ready the data to send (slave write for a master read)
-   slave.sendData[0] = opcodes_encode_reply(
-      pressure_mon_reply(),
-      received
-   );
+   if ( received == opcodes_cmd_error || index + 1 != size )
+   {
+      return;
+   }
+
+   if ( ! _is_repeat(frame, size) )
+   {
+      if ( ! opcodes_check_frame(frame, size) )
+      {
+         link_stats_count(&i2c_slave_link_stats, link_stats_bad_crc);
+         return;
+      }
+
+      crc = opcodes_frame_crc(frame, size);
+
+      // A query returns an item of the statistics, or negotiates the heartbeat
+      if ( received == opcodes_cmd_query )
+      {
+         uint16_t item;
+
+         if ( frame[2] & OPCODES_QUERY_HEARTBEAT )
+         {
+            item = protocol_negotiate_heartbeat(
+               (uint16_t)(frame[2] & ~OPCODES_QUERY_HEARTBEAT) * OPCODES_HEARTBEAT_UNIT_MS
+            );
+         }
+         else
+         {
+            item = link_stats_get_item(&i2c_slave_link_stats, frame[2]);
+         }
+
+         uint8_t value[2] = { (uint8_t)item, (uint8_t)(item >> 8) };
+
+         opcodes_encode_reply((uint8_t *)slave.sendData, _status, ack, value, 2, crc);
+         link_stats_count(&i2c_slave_link_stats, link_stats_ok);
+
+         return;
+      }
+
+      // The first command after a reset of the hub is always accepted.
+      // OPCODES_SEQ_RESET is not, as a late copy of the first command after a
+      //  reset of the controller would undo the ones which followed. Once
+      //  the controller resets, its first command may be rejected, and it
+      //  follows on from the ack of the reply.
+      if ( _last_size && opcodes_seq_is_older(seq, ack) )
+      {
+         opcodes_encode_reply((uint8_t *)slave.sendData, _status, ack, NULL, 0, crc);
+         link_stats_count(&i2c_slave_link_stats, link_stats_stale);
+
+         return;
+      }
+
+      _accept(frame, size);
+   }
+
+   reply = _last_replies[_status];
+
+   slave.sendData[0] = reply[0];
+   slave.sendData[1] = reply[1];
+   slave.sendData[2] = reply[2];
+
+   link_stats_count(&i2c_slave_link_stats, link_stats_ok);
+
+   timer_count_t now = timer_get_count();
+   timer_count_t elapsed = now - _last_command_time;
+
+   _last_command_time = now;
+   link_stats_record(&i2c_slave_link_stats, (elapsed > UINT16_MAX) ? UINT16_MAX : (uint16_t)elapsed);
+   
+   // Pass the opcode, and the first byte of payload if any
+   uint16_t arg = received;
+
+   if ( size > 3 )
+   {
+      arg |= (uint16_t)frame[2] << 8;
+   }
    
-   reactor_notify(_react_i2c_handler, (void *)(uint16_t)received);
+   reactor_notify(_react_i2c_handler, (void *)(uintptr_t)arg);
+}
+
+
+/**
+ * Count an event detected outside of the interrupt (i.e. a timeout)
+ */
+void i2c_slave_count(link_stats_counter_t counter)
+{
+   irqflags_t flags = cpu_irq_save();
+   link_stats_count(&i2c_slave_link_stats, counter);
+   cpu_irq_restore(flags);
+}
+
+/**
+ * Copy the last command accepted, for the commands with a payload larger than
+ *  the byte passed to the protocol.
+ * By the time the reactor asks, a newer command may have been accepted. The
+ *  caller checks the opcode, and the newer command is notified anyway.
+ * @param frame Receives the frame. OPCODES_FRAME_MAX_SIZE bytes
+ * @return The size of the frame, or 0 if no command was accepted yet
+ */
+uint8_t i2c_slave_get_command(uint8_t *frame)
+{
+   irqflags_t flags = cpu_irq_save();
+   uint8_t size = _last_size;
+   uint8_t i;
+
+   for ( i=0; i<size; ++i )
+   {
+      frame[i] = _last_frame[i];
+   }
+
+   cpu_irq_restore(flags);
+
+   return size;
 }
 
+/**
+ * Set the status returned in the replies
+ * Called by the reactor when the pressure changes. The ISR uses the new
+ *  status at once.
+ */
+void i2c_slave_set_status(opcodes_reply_t status)
+{
+   _status = status;
+}
+
+#ifdef REACTOR_STANDBY
+/**
+ * Check for the reactor before a standby. The TWI slave wakes the CPU up on
+ *  the address match, but a transaction on-going needs the main clock.
+ * @return true if no transaction is on-going
+ */
+bool i2c_slave_is_idle(void)
+{
+   return slave.status == TWIS_STATUS_READY;
+}
+#endif
 
 void i2c_slave_init(reactor_handle_t react_i2c_handler)
 {
    // Store the reactor handler
    _react_i2c_handler = react_i2c_handler;
+
+   i2c_slave_set_status(pressure_mon_reply());
+   _last_command_time = timer_get_count();
    
    TWI_SlaveInitializeDriver(&slave, &TWI0, slave_process);
    TWI_SlaveInitializeModule(&slave, TWI_SLAVE_ADDR);
@@ -48,4 +268,23 @@ void i2c_slave_init(reactor_handle_t react_i2c_handler)
 ISR(TWI0_TWIS_vect)
 {
    TWI_SlaveInterruptHandler(&slave);
+
+   // Account for the transactions which ended badly, once
+   switch ( slave.result )
+   {
+   case TWIS_RESULT_BUS_ERROR:
+      link_stats_count(&i2c_slave_link_stats, link_stats_bus_error);
+      break;
+   case TWIS_RESULT_TRANSMIT_COLLISION:
+      link_stats_count(&i2c_slave_link_stats, link_stats_collision);
+      break;
+   case TWIS_RESULT_BUFFER_OVERFLOW:
+   case TWIS_RESULT_FAIL:
+      link_stats_count(&i2c_slave_link_stats, link_stats_bad_frame);
+      break;
+   default:
+      return;
+   }
+
+   slave.result = TWIS_RESULT_UNKNOWN;
 }
@@ -14,10 +14,29 @@ extern "C" {
 #endif
 
 #include "reactor.h"
+#include "op_codes.h"
+#include "link_stats.h"
+
+/** Statistics of the link as seen by the hub. Read over the link with opcodes_cmd_query */
+extern link_stats_t i2c_slave_link_stats;
 
 /** @brief Initialise the i2c slave device */
 void i2c_slave_init(reactor_handle_t);
 
+/** @brief Set the status returned in the replies */
+void i2c_slave_set_status(opcodes_reply_t status);
+
+/** @brief Count an event of the link from the reactor */
+void i2c_slave_count(link_stats_counter_t counter);
+
+#ifdef REACTOR_STANDBY
+/** @brief No transaction on-going - the CPU can go into standby */
+bool i2c_slave_is_idle(void);
+#endif
+
+/** @brief Copy the last command accepted (whole frame). Returns its size, 0 if none */
+uint8_t i2c_slave_get_command(uint8_t *frame);
+
 #ifdef __cplusplus
 }
 #endif
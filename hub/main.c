@@ -6,15 +6,22 @@
  */ 
 
 #include "board.h"
+#include "flash_crc.h"
 #include "pressure_mon.h"
 #include "protocol.h"
 #include "i2c_slave.h"
+#include "trace.h"
 
 int main(void)
 {
    // Initialize the board hardware (clocks, IOs, buses etc.)
    board_init();
 
+#ifdef TRACE
+   // The trace is drained from the start
+   trace_init();
+#endif
+
    // Sample of 1 input (need digital input)
    pressure_mon_init();
    
@@ -30,6 +37,16 @@ int main(void)
       )
    );
    
+#ifdef FLASH_CRC
+   // Check the flash against its CRC in the idle time
+   flash_crc_init();
+#endif
+
+#ifdef REACTOR_STANDBY
+   // Standby between the events, unless the controller is talking
+   reactor_set_standby_check(i2c_slave_is_idle);
+#endif
+
    // Off we go!
    reactor_run();
 }
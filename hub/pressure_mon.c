@@ -6,20 +6,33 @@
  */ 
 #include "digital_input.h"
 #include "conf_board.h"
+#include "conf_prio.h"
 
 #include "pressure_mon.h"
+#include "i2c_slave.h"
 
 
 /** Pointer to the input */
 digital_input_handle_t _di;
 
 
+/**
+ * Called by the reactor when the filtered pressure changes
+ * Pass it to the i2c slave, so the value is in the next reply.
+ */
+static void _on_pressure_change(void *arg)
+{
+   pin_and_value_t pav = {.as_arg = arg};
+
+   i2c_slave_set_status(pav.value ? opcodes_reply_on : opcodes_reply_off);
+}
+
 /** Initialize the input as sampled over 50 ms */
 void pressure_mon_init(void)
 {
    _di = digital_input(
       IOPORT_PRESSURE_READOUT, // IOPort to sample
-      REACTOR_NULL_HANDLE,     // No reactor required
+      reactor_register(_on_pressure_change, PRESSURE_MON_PRIO, 1),
       IOPORT_SENSE_DISABLE,    // No sensing - sampling
       TIMER_MILLISECONDS(50)   // Sample over 50ms
    );
@@ -9,6 +9,7 @@
 #include "reactor.h"
 #include "timer.h"
 #include "protocol.h"
+#include "i2c_slave.h"
 #include "ioport.h"
 
 #include "conf_board.h"
@@ -17,118 +18,459 @@
 /************************************************************************/
 /* Constants and defines                                                */
 /************************************************************************/
-#define NO_NEW_COMMAND_GRACE_PERIOD TIMER_MILLISECONDS(1000)
-#define CHECK_COMMS_INTERVAL TIMER_SECONDS(1)
+/**
+ * Time the outgoing valves are off before the incoming valves are turned on
+ *  when swapping valves (i.e. door reversing). This lets the air exhaust and
+ *  limits the draw on the compressor.
+ * Turning valves on or off without a swap is always safe and immediate.
+ */
+#ifndef PROTOCOL_CHANGEOVER_DELAY
+#define PROTOCOL_CHANGEOVER_DELAY TIMER_MILLISECONDS(50)
+#endif
+
+/**
+ * Compressor budget: Maximum number of valves on at once.
+ * Only the command opcodes_cmd_valves can request more than one valve.
+ */
+#ifndef PROTOCOL_MAX_VALVES_ON
+#define PROTOCOL_MAX_VALVES_ON 2
+#endif
+
+/** Shortest heartbeat period the hub accepts (ms) */
+#ifndef PROTOCOL_HEARTBEAT_MIN
+#define PROTOCOL_HEARTBEAT_MIN 50
+#endif
+
+/** Longest heartbeat period the hub accepts (ms) */
+#ifndef PROTOCOL_HEARTBEAT_MAX
+#define PROTOCOL_HEARTBEAT_MAX 1000
+#endif
+
+/**
+ * Number of heartbeat periods without a command before the link is
+ *  considered lost, and all valves are turned off.
+ */
+#ifndef PROTOCOL_LINK_LOSS_HEARTBEATS
+#define PROTOCOL_LINK_LOSS_HEARTBEATS 3
+#endif
+
+/** Time after reset before checking the communication */
+#define PROTOCOL_CHECK_COMMS_START TIMER_SECONDS(5)
+
+/** Number of combinations of the valves - literal for MREPEAT */
+#define PROTOCOL_VALVE_COMBINATIONS 32
+
+/**
+ * Mask of the pin of a valve on the given port if the valve is in the
+ *  valves, else 0. A constant expression, for the table of the valves.
+ */
+#define PROTOCOL_PIN_MASK(valves, valve, pin, port) \
+   ((((valves) & (valve)) && ((pin) >> 3) == (port)) ? (1 << ((pin) & 0x07)) : 0)
+
+/** Level of the valve pins of the port, for a bitmask of opcodes_valve_t */
+#define PROTOCOL_PORT_OUT(valves, port) ( \
+   PROTOCOL_PIN_MASK(valves, opcodes_valve_chuck,            IOPORT_CHUCK_CLAMP,           port) | \
+   PROTOCOL_PIN_MASK(valves, opcodes_valve_blast_spindle,    IOPORT_SPINDLE_CLEAN,         port) | \
+   PROTOCOL_PIN_MASK(valves, opcodes_valve_blast_toolsetter, IOPORT_TOOL_SETTER_AIR_BLAST, port) | \
+   PROTOCOL_PIN_MASK(valves, opcodes_valve_pull_door,        IOPORT_DOOR_PULL,             port) | \
+   PROTOCOL_PIN_MASK(valves, opcodes_valve_push_door,        IOPORT_DOOR_PUSH,             port) )
+
+/** Entry of the table of the valves, for MREPEAT */
+#define PROTOCOL_VALVES_OUT(valves, unused) \
+   { PROTOCOL_PORT_OUT(valves, IOPORT_PORTA), PROTOCOL_PORT_OUT(valves, IOPORT_PORTB) },
+
+/**
+ * Arguments of the timer reactor. The hub has no reactor handler to spare,
+ *  so the changeover and the pulse sequences share one.
+ * A step of the pulse sequence is tagged, and carries the number of its
+ *  sequence in the low byte.
+ */
+#define PROTOCOL_TIMER_CHANGEOVER ((void *)0)
+#define PROTOCOL_TIMER_PULSE      0x100
+#define PROTOCOL_TIMER_PULSE_STEP(number) ((void *)(uintptr_t)(PROTOCOL_TIMER_PULSE | (number)))
 
 /************************************************************************/
 /* Local variables                                                      */
 /************************************************************************/
 
-/** The current command */
-static opcodes_cmd_t _current_cmd = opcodes_cmd_idle;
+/**
+ * Level of the valve pins of each port, for each bitmask of opcodes_valve_t.
+ * Computed at compile time (64 bytes of flash), so a change of valves costs
+ *  the same whatever the valves.
+ */
+static const ioport_port_mask_t _valve_outs[PROTOCOL_VALVE_COMBINATIONS][IOPORT_PORTB + 1] = {
+   MREPEAT(32, PROTOCOL_VALVES_OUT, ~)
+};
+
+/** The valves currently on (bitmask of opcodes_valve_t) */
+static uint8_t _current_valves = 0;
+
+/** The last valves requested by the controller */
+static uint8_t _requested_valves = 0;
+
+/** Instance of the changeover timer. We need to cancel this timer */
+timer_instance_t _changeover_timer_instance = TIMER_INVALID_INSTANCE;
+
+/** Instance of the timer of the pulse sequence, or invalid if none is running */
+static timer_instance_t _pulse_timer_instance = TIMER_INVALID_INSTANCE;
+
+/** Pulse sequence - valves, times on and off (OPCODES_PULSE_UNIT_MS) */
+static uint8_t _pulse_valves;
+static uint8_t _pulse_on;
+static uint8_t _pulse_off;
 
-/** If true, accept a new command */
-bool _ready_to_accept_new_command = true;
+/** Number of pulses left, including the current one */
+static uint8_t _pulse_remaining;
 
-/** Instance of the timer accepting command. We need to cancel this timer */
-timer_instance_t _ready_to_accept_timer_instance = TIMER_INVALID_INSTANCE;
+/** True during a pulse, false between pulses */
+static bool _pulse_level;
+
+/** True once a pulse command is started, until another command comes */
+static bool _pulse_started = false;
+
+/** Sequence number of the pulse command started, so its heartbeat does not restart it */
+static uint8_t _pulse_seq;
+
+/**
+ * Number of the pulse sequence, changed on each start and stop. A step
+ *  notified for a previous sequence is ignored
+ */
+static uint8_t _pulse_number = 0;
 
 /** Number of communications received since last check */
 volatile uint16_t _message_received_counter = 0;
 
+/** Heartbeat period negotiated with the controller (ms). Set from the i2c interrupt */
+static volatile uint16_t _heartbeat_period = OPCODES_HEARTBEAT_DEFAULT_MS;
+
+/** Number of consecutive heartbeat periods without a command */
+static uint8_t _missed_heartbeats = 0;
+
 /** Reactor for checking the communication */
 static reactor_handle_t _react_check_comms;
 
-/** Reactor for setting the _ready_to_accept_new_command */
-static reactor_handle_t _react_accept_comms;
+/** Reactor for the timers - applying the requested command after a changeover, and the pulses */
+static reactor_handle_t _react_timer;
 
 
 /************************************************************************/
 /* Local functions                                                      */
 /************************************************************************/
 
-/** 
- * Apply the given command without filter
- *
- * Make sure to turn off all unused, and on the one valve
- * This function is responsible for updating the variable _ready_to_accept_new_command
- *  which other functions can check.
- * A timer is armed to manage this variable to avoid fast switching of the valves.
- *
- * @param cmd The command to honor
+/**
+ * Convert a command into a bitmask of valves
+ * @param arg The opcode and its payload as passed by the i2c slave
+ * @return The valves to turn on, or 0xFF if the command is not valid
  */
-static void _protocol_process(opcodes_cmd_t cmd)
+static uint8_t _protocol_cmd_to_valves(uint16_t arg)
 {
-   // Turn off all valves
-   ioport_set_pin_level(IOPORT_TOOL_SETTER_AIR_BLAST, false);
-   ioport_set_pin_level(IOPORT_CHUCK_CLAMP, false);
-   ioport_set_pin_level(IOPORT_SPINDLE_CLEAN, false);
-   ioport_set_pin_level(IOPORT_DOOR_PUSH, false);
-   ioport_set_pin_level(IOPORT_DOOR_PULL, false);
+   uint8_t valves = arg >> 8;
 
-   // If the command is valid - store it
-   switch ( cmd )
+   switch ( (opcodes_cmd_t)(uint8_t)arg )
    {
    case opcodes_cmd_idle:
-      break;
+      return 0;
    case opcodes_cmd_push_door:
-      ioport_set_pin_level(IOPORT_DOOR_PUSH, true);break;
+      return opcodes_valve_push_door;
    case opcodes_cmd_pull_door:
-      ioport_set_pin_level(IOPORT_DOOR_PULL, true); break;
+      return opcodes_valve_pull_door;
    case opcodes_cmd_blast_toolsetter:
-      ioport_set_pin_level(IOPORT_TOOL_SETTER_AIR_BLAST, true); break;
+      return opcodes_valve_blast_toolsetter;
    case opcodes_cmd_unclamp_chuck:
-      ioport_set_pin_level(IOPORT_CHUCK_CLAMP, true); break;
+      return opcodes_valve_chuck;
    case opcodes_cmd_blast_spindle:
-      ioport_set_pin_level(IOPORT_SPINDLE_CLEAN, true); break;
+      return opcodes_valve_blast_spindle;
+   case opcodes_cmd_valves:
+   case opcodes_cmd_pulse:
+      // The door cannot be pushed and pulled at once
+      if ( 
+         (valves & ~OPCODES_VALVES_MASK) || 
+         ((valves & opcodes_valve_push_door) && (valves & opcodes_valve_pull_door))
+      )
+      {
+         break;
+      }
+
+      return valves;
    default:
       break;
    }
-   
-   // Do not allow a new command to be accounted for in the next T cycle
-   _ready_to_accept_new_command = false;
-   
-   // If a timer is already running, cancel it
-   if ( _ready_to_accept_timer_instance != TIMER_INVALID_INSTANCE )
+
+   return 0xFF;
+}
+
+/**
+ * Keep the valves of highest priority (lowest bits) within the compressor budget
+ */
+static uint8_t _protocol_apply_budget(uint8_t valves)
+{
+   uint8_t kept = 0;
+   uint8_t count = 0;
+   uint8_t bit;
+
+   for ( bit = 1; bit & OPCODES_VALVES_MASK; bit <<= 1 )
    {
-      timer_cancel(_ready_to_accept_timer_instance);
+      if ( (valves & bit) && count < PROTOCOL_MAX_VALVES_ON )
+      {
+         kept |= bit;
+         ++count;
+      }
+   }
+
+   return kept;
+}
+
+/** 
+ * Apply the given valves without filter
+ *
+ * Each port is written once, toggling the pins which change (OUTTGL), so
+ *  the valves of a port switch together without going through all off.
+ * The ports with valves turning off are written first, so the budget is
+ *  never exceeded.
+ *
+ * @param valves Bitmask of opcodes_valve_t to turn on. All others are turned off
+ */
+static void _protocol_process(uint8_t valves)
+{
+   const ioport_port_mask_t *from = _valve_outs[_current_valves];
+   const ioport_port_mask_t *to = _valve_outs[valves];
+   uint8_t written = 0;
+   uint8_t i;
+
+   for ( i=0; i<=IOPORT_PORTB; ++i )
+   {
+      if ( from[i] & ~to[i] )
+      {
+         ioport_toggle_port_level(i, from[i] ^ to[i]);
+         written |= 1<<i;
+      }
+   }
+
+   for ( i=0; i<=IOPORT_PORTB; ++i )
+   {
+      if ( (from[i] ^ to[i]) && ! (written & (1<<i)) )
+      {
+         ioport_toggle_port_level(i, from[i] ^ to[i]);
+      }
    }
    
-   // Start a new timer 
-   _ready_to_accept_timer_instance = timer_arm(
-      _react_accept_comms,
-      timer_get_count_from_now(NO_NEW_COMMAND_GRACE_PERIOD),
-      0, 0
+   _current_valves = valves;
+}
+
+/** Stop any pending changeover */
+static void _cancel_changeover(void)
+{
+   if ( _changeover_timer_instance != TIMER_INVALID_INSTANCE )
+   {
+      timer_cancel(_changeover_timer_instance);
+      _changeover_timer_instance = TIMER_INVALID_INSTANCE;
+   }
+}
+
+/**
+ * Request a new set of valves.
+ * A change is applied at once, unless it swaps valves. In this case, the
+ *  outgoing valves are turned off for the changeover delay first.
+ * @param valves Bitmask of opcodes_valve_t, within the budget
+ */
+static void _protocol_request(uint8_t valves)
+{
+   if ( _requested_valves != valves )
+   {
+      uint8_t outgoing = _current_valves & ~valves;
+      uint8_t incoming = valves & ~_current_valves;
+
+      _requested_valves = valves;
+
+      if ( _changeover_timer_instance != TIMER_INVALID_INSTANCE )
+      {
+         // Turning off is always safe. The on-going changeover applies the rest
+         _protocol_process(_current_valves & valves);
+      }
+      else if ( outgoing == 0 || incoming == 0 )
+      {
+         _protocol_process(valves);
+      }
+      else
+      {
+         _protocol_process(_current_valves & valves);
+
+         _changeover_timer_instance = timer_arm(
+            _react_timer,
+            timer_get_count_from_now(PROTOCOL_CHANGEOVER_DELAY),
+            0, PROTOCOL_TIMER_CHANGEOVER
+         );
+      }
+   }
+}
+
+/** Stop the pulse sequence, if any. The valves are left as they are */
+static void _cancel_pulse(void)
+{
+   if ( _pulse_timer_instance != TIMER_INVALID_INSTANCE )
+   {
+      timer_cancel(_pulse_timer_instance);
+      _pulse_timer_instance = TIMER_INVALID_INSTANCE;
+   }
+
+   _pulse_started = false;
+   ++_pulse_number;
+}
+
+/** Time the current step of the pulse sequence */
+static void _arm_pulse(uint8_t time)
+{
+   _pulse_timer_instance = timer_arm(
+      _react_timer,
+      timer_get_count_from_now(TIMER_MILLISECONDS((timer_count_t)time * OPCODES_PULSE_UNIT_MS)),
+      0, PROTOCOL_TIMER_PULSE_STEP(_pulse_number)
    );
 }
 
 /**
- * Called every second to check that commands are being received.
- * If no commands are received, turn off all valves.
+ * Start the pulse sequence of the command opcodes_cmd_pulse.
+ * The payload is read from the i2c slave, since only its first byte comes
+ *  with the notification. The heartbeat repeats the command with the same
+ *  sequence number, and is ignored.
+ */
+static void _start_pulse(void)
+{
+   uint8_t frame[OPCODES_FRAME_MAX_SIZE];
+   const uint8_t *payload = &frame[2];
+
+   // A newer command replaced it already. It is notified next
+   if ( 
+      i2c_slave_get_command(frame) != opcodes_frame_size(opcodes_cmd_pulse) ||
+      frame[0] != opcodes_cmd_pulse
+   )
+   {
+      return;
+   }
+
+   if ( _pulse_started && frame[1] == _pulse_seq )
+   {
+      return;
+   }
+
+   _cancel_pulse();
+
+   if ( payload[opcodes_pulse_on] == 0 || payload[opcodes_pulse_count] == 0 )
+   {
+      return;
+   }
+
+   _pulse_started = true;
+   _pulse_seq = frame[1];
+   ++_pulse_number;
+   _pulse_valves = _protocol_apply_budget(payload[opcodes_pulse_valves]);
+   _pulse_on = payload[opcodes_pulse_on];
+   _pulse_off = payload[opcodes_pulse_off];
+   _pulse_remaining = payload[opcodes_pulse_count];
+   _pulse_level = true;
+
+   _protocol_request(_pulse_valves);
+   _arm_pulse(_pulse_on);
+}
+
+/**
+ * Next step of the pulse sequence. The valves stay off after the last pulse
+ * @param number Number of the sequence the step was armed for
+ */
+static void _on_pulse_step(uint8_t number)
+{
+   // Stopped, or replaced by a new sequence, whilst the notification was pending
+   if ( number != _pulse_number )
+   {
+      return;
+   }
+
+   _pulse_timer_instance = TIMER_INVALID_INSTANCE;
+
+   if ( _pulse_level )
+   {
+      _pulse_level = false;
+      _protocol_request(0);
+
+      if ( --_pulse_remaining != 0 )
+      {
+         _arm_pulse(_pulse_off);
+      }
+   }
+   else
+   {
+      _pulse_level = true;
+      _protocol_request(_pulse_valves);
+      _arm_pulse(_pulse_on);
+   }
+}
+
+/**
+ * Called every heartbeat period to check that commands are being received.
+ * Once no commands are received for PROTOCOL_LINK_LOSS_HEARTBEATS periods,
+ *  the link is lost, and all valves are turned off.
+ * The check is re-armed each time, so a new heartbeat period applies at once.
  */
 static void _on_check_comms(void *arg)
 {
-   if ( _message_received_counter == 0 )
+   irqflags_t flags;
+   uint16_t period;
+
+   if ( _message_received_counter != 0 )
    {
+      _missed_heartbeats = 0;
+   }
+   else if ( ++_missed_heartbeats == PROTOCOL_LINK_LOSS_HEARTBEATS )
+   {
+      i2c_slave_count(link_stats_timeout);
+
       // Reset all valves
-      _protocol_process(opcodes_cmd_idle);
+      _cancel_pulse();
+      _cancel_changeover();
+      _protocol_process(0);
       
       // Assume the system is idle
-      _current_cmd = opcodes_cmd_idle;
+      _requested_valves = 0;
+   }
+   else if ( _missed_heartbeats > PROTOCOL_LINK_LOSS_HEARTBEATS )
+   {
+      // Already lost - do not wrap
+      _missed_heartbeats = PROTOCOL_LINK_LOSS_HEARTBEATS;
    }
    
    _message_received_counter = 0;
+
+   flags = cpu_irq_save();
+   period = _heartbeat_period;
+   cpu_irq_restore(flags);
+
+   timer_arm(_react_check_comms, timer_get_count_from_now(TIMER_MILLISECONDS(period)), 0, 0);
 }
 
 /**
- * Called by the timeout reactor to allow processing incoming commands again
+ * Called once the valves have been off for the changeover delay
+ * Apply the latest command requested.
+ * Also steps the pulse sequence, which shares the reactor handler.
  */
-static void _on_accept_command_again(void *arg)
+static void _on_timer(void *arg)
 {
-   _ready_to_accept_new_command = true;
-   
+   uintptr_t tag = (uintptr_t)arg;
+
+   if ( tag & PROTOCOL_TIMER_PULSE )
+   {
+      _on_pulse_step((uint8_t)tag);
+      return;
+   }
+
+   // Cancelled whilst the notification was pending
+   if ( _changeover_timer_instance == TIMER_INVALID_INSTANCE )
+   {
+      return;
+   }
+
    // Mark as unused
-   _ready_to_accept_timer_instance = TIMER_INVALID_INSTANCE;
+   _changeover_timer_instance = TIMER_INVALID_INSTANCE;
+
+   _protocol_process(_requested_valves);
 }
 
 /************************************************************************/
@@ -137,39 +479,80 @@ static void _on_accept_command_again(void *arg)
 
 /**
  * Handle a cmd received on the i2c.
- * These come in at 10 a seconds.
+ * These come on every change, and as a heartbeat in between.
+ * The i2c slave rejects the commands older than the last one accepted, so
+ *  the commands come in order, and each is applied as soon as it arrives.
+ * The argument holds the opcode in the low byte, and the payload (if any)
+ *  in the high byte.
  * Check validity, only handle change.
+ * A pulse command starts a sequence which runs on its own. Any other
+ *  command stops it.
  */
 void protocol_handle_traffic(void *arg)
 {
-   opcodes_cmd_t cmd = (opcodes_cmd_t)arg;
+   uint16_t cmd_and_payload = (uint16_t)(uintptr_t)arg;
+   uint8_t valves;
    
    // Make sure the value is valid
-   if ( opcodes_check_cmd_valid(cmd) )
+   if ( ! opcodes_check_cmd_valid((uint8_t)cmd_and_payload) )
    {
-      // The increase the counter, make sure we are receiving and the content is valid
-      ++_message_received_counter;
-      
-      if ( _current_cmd != cmd && _ready_to_accept_new_command )
-      {
-         _current_cmd = cmd;
-         
-         _protocol_process(cmd);
-      } 
+      return;
    }
+
+   valves = _protocol_cmd_to_valves(cmd_and_payload);
+
+   if ( valves == 0xFF )
+   {
+      return;
+   }
+
+   // The increase the counter, make sure we are receiving and the content is valid
+   ++_message_received_counter;
+
+   if ( (uint8_t)cmd_and_payload == opcodes_cmd_pulse )
+   {
+      _start_pulse();
+      return;
+   }
+
+   _cancel_pulse();
+   _protocol_request(_protocol_apply_budget(valves));
 }
 
 
+/**
+ * Negotiate the heartbeat period proposed by the controller.
+ * Called from the i2c slave interrupt. The period is clamped to the limits
+ *  of the hub, and takes effect on the next check of the communication.
+ * @param period Heartbeat period proposed (ms)
+ * @return The heartbeat period accepted (ms)
+ */
+uint16_t protocol_negotiate_heartbeat(uint16_t period)
+{
+   if ( period < PROTOCOL_HEARTBEAT_MIN )
+   {
+      period = PROTOCOL_HEARTBEAT_MIN;
+   }
+   else if ( period > PROTOCOL_HEARTBEAT_MAX )
+   {
+      period = PROTOCOL_HEARTBEAT_MAX;
+   }
+
+   _heartbeat_period = period;
+
+   return period;
+}
+
 void protocol_init(void)
 {
-   _react_accept_comms = reactor_register( _on_accept_command_again, PROTOCOL_CMD_PRIO, 1);
+   _react_timer = reactor_register( _on_timer, PROTOCOL_CMD_PRIO, 2);
    _react_check_comms = reactor_register( _on_check_comms, PROTOCOL_CMD_PRIO, 1);
 
-   // Kick start checking for the communication
+   // Kick start checking for the communication. It re-arms itself
    timer_arm(
       _react_check_comms, 
-      timer_get_count_from_now(TIMER_SECONDS(5)),
-      TIMER_SECONDS(2), // Repeat every 2 seconds
+      timer_get_count_from_now(PROTOCOL_CHECK_COMMS_START),
+      0,
       0
    );
 }
\ No newline at end of file
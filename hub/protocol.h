@@ -5,7 +5,8 @@
  *  Author: micro
  */ 
 
-// Protocol is 1 tx every 100ms or when a change occurs
+// Protocol is 1 tx when a change occurs, and a heartbeat in between.
+// The heartbeat period is negotiated by the controller (500ms by default)
 
 #ifndef PROTOCOL_H_
 #define PROTOCOL_H_
@@ -20,9 +21,12 @@ extern "C" {
 
 void protocol_init(void);
 
-/** @brief Reactor handler */
+/** @brief Reactor handler. The argument is the opcode | payload << 8 */
 void protocol_handle_traffic(void *);
 
+/** @brief Accept a heartbeat period (ms) within the limits. Returns the period accepted */
+uint16_t protocol_negotiate_heartbeat(uint16_t period);
+
 #ifdef __cplusplus
 }
 #endif
@@ -24,6 +24,10 @@ SREC_CAT ?= srec_cat
 BUILD_DIR       ?= $(build_type)
 
 # Work out the size of the flash using make functions only
+# Host builds (simulator, tests) have no flash, and may not set an ARCH
+ifeq ($(target)$(ARCH),sim)
+FLASH_END := 0
+else
 FLASH_END := \
 	$(if $(findstring attiny32,$(ARCH)),0x7FFE, \
 		$(if $(findstring attiny16,$(ARCH)),0x3FFE, \
@@ -31,6 +35,7 @@ FLASH_END := \
 				$(if $(findstring attiny4,$(ARCH)),0x0FFE, \
 					$(if $(findstring attiny2,$(ARCH)),0x07FE, \
 						$(error Unknown arch $(ARCH)))))))
+endif
 
 # Pre-processor flags for C, C++ and assembly
 CPPFLAGS        += $(foreach p, $(INCLUDE_DIRS), -I$(p)) -D$(if $(NDEBUG),NDEBUG,DEBUG)=1 -DCRC_AT=$(strip $(FLASH_END))
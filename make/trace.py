@@ -0,0 +1,203 @@
+#!/usr/bin/env python3
+"""
+Convert the trace of asx/src/trace.c to the Chrome trace format.
+The input is either the stream of TRACE_PIN, as captured by a serial
+ adapter at TRACE_BAUD (8N1), or the file written by trace_posix_dump.
+Load the output in chrome://tracing or https://ui.perfetto.dev.
+
+Each handler of the reactor has its own row, with a slice for each call
+ and an arrow from the notification which caused it. The timers, the I/Os
+ and the sleeps of the reactor have a row each.
+The latency from each notification to the call of its handler, and the
+ time spent in each handler, are given on the standard error.
+"""
+import sys
+import json
+import struct
+import argparse
+
+# As asx/include/trace.h
+SYNC = 0xA5
+RECORD = struct.Struct("<BBI")
+
+EVENTS = [
+   None,
+   "notify",
+   "dispatch_start",
+   "dispatch_end",
+   "timer_arm",
+   "timer_cancel",
+   "timer_fire",
+   "pin_edge",
+   "input_change",
+   "output_set",
+   "sleep",
+   "wake",
+   "lost",
+]
+
+# Rows other than the handlers
+TID_TIMERS = 1000
+TID_IO = 1001
+TID_SLEEP = 1002
+
+
+def parse(data):
+   """ Yield the records as (event, id, us), the time unwrapped """
+   i = 0
+   base = 0
+   last = None
+
+   while i + 1 + RECORD.size <= len(data):
+      # Resync on the next sync byte, as a capture can start anywhere
+      if data[i] != SYNC:
+         i += 1
+         continue
+
+      event, id, us = RECORD.unpack_from(data, i + 1)
+
+      if not 0 < event < len(EVENTS):
+         i += 1
+         continue
+
+      # The time wraps after 71 minutes. The records can be a little out of
+      #  order in the simulation, where a handler ends once its cost is spent
+      if last is not None and last - us > (1 << 31):
+         base += (1 << 32)
+
+      last = us
+
+      yield EVENTS[event], id, base + us
+
+      i += 1 + RECORD.size
+
+
+def pin_name(id):
+   """ Name of a pin (as TRACE_ID_OF_PIN) and its level """
+   pin = id & 0x7F
+   return f"P{chr(ord('A') + (pin >> 3))}{pin & 7}={id >> 7}"
+
+
+def percentile(values, percent):
+   values = sorted(values)
+   return values[(len(values) - 1) * percent // 100]
+
+
+class Converter:
+   def __init__(self, names):
+      self.names = names
+      self.events = []
+      self.pending = {}
+      self.started = {}
+      self.latencies = {}
+      self.durations = {}
+      self.flows = 0
+
+   def name(self, handle):
+      return self.names.get(handle, f"handler {handle}")
+
+   def add(self, ph, name, tid, us, **kwargs):
+      self.events.append(dict(ph=ph, name=name, pid=0, tid=tid, ts=us, **kwargs))
+
+   def instant(self, name, tid, us):
+      self.add("i", name, tid, us, s="t")
+
+   def record(self, event, id, us):
+      if event == "notify":
+         self.flows += 1
+         self.pending.setdefault(id, []).append((us, self.flows))
+         self.instant("notify", id, us)
+         self.add("s", "notify", id, us, id=self.flows, cat="notify")
+
+      elif event == "dispatch_start":
+         self.started[id] = us
+         self.add("B", self.name(id), id, us)
+
+         # The oldest notification is the one served
+         if self.pending.get(id):
+            at, flow = self.pending[id].pop(0)
+            self.latencies.setdefault(id, []).append(us - at)
+            self.add("f", "notify", id, us, id=flow, cat="notify", bp="e")
+
+      elif event == "dispatch_end":
+         if id in self.started:
+            self.durations.setdefault(id, []).append(us - self.started.pop(id))
+            self.add("E", self.name(id), id, us)
+
+      elif event.startswith("timer_"):
+         self.instant(f"{event[6:]} {self.name(id)}", TID_TIMERS, us)
+
+      elif event in ("pin_edge", "input_change", "output_set"):
+         self.instant(f"{event} {pin_name(id)}", TID_IO, us)
+
+      elif event == "sleep":
+         self.add("B", "sleep", TID_SLEEP, us)
+
+      elif event == "wake":
+         self.add("E", "sleep", TID_SLEEP, us)
+
+      elif event == "lost":
+         self.add("i", f"{id} lost", 0, us, s="g")
+
+   def threads(self):
+      handles = sorted({e["tid"] for e in self.events if e["tid"] < TID_TIMERS})
+      rows = [(h, self.name(h)) for h in handles]
+      rows += [(TID_TIMERS, "timers"), (TID_IO, "I/O"), (TID_SLEEP, "sleep")]
+
+      return [
+         dict(ph="M", name="thread_name", pid=0, tid=tid, args=dict(name=name))
+         for tid, name in rows
+      ]
+
+   def get_trace(self):
+      # Sorted, as the handlers of the simulation end ahead of time
+      events = sorted(self.events, key=lambda e: e["ts"])
+
+      return dict(traceEvents=self.threads() + events, displayTimeUnit="ns")
+
+   def report(self, out):
+      out.write(f"{'handler':<20} {'calls':>7} {'latency p50':>12} {'max':>8} {'run p50':>8} {'max':>8} us\n")
+
+      for handle in sorted(self.durations):
+         lat = self.latencies.get(handle, [0])
+         run = self.durations[handle]
+
+         out.write(
+            f"{self.name(handle):<20} {len(run):>7} "
+            f"{percentile(lat, 50):>12} {max(lat):>8} "
+            f"{percentile(run, 50):>8} {max(run):>8}\n")
+
+
+def parse_name(text):
+   handle, _, name = text.partition("=")
+   return int(handle), name
+
+
+if __name__ == "__main__":
+   parser = argparse.ArgumentParser(description="Convert a trace to the Chrome trace format")
+
+   parser.add_argument('trace', help='Captured stream, or file of trace_posix_dump')
+   parser.add_argument(
+      '-o', dest='output', help='Output file (default: the trace with .json)', type=str)
+   parser.add_argument(
+      '-n', dest='names', help='Name of a handler, as <handle>=<name>',
+      type=parse_name, action='append', default=[])
+   args = parser.parse_args()
+
+   try:
+      with open(args.trace, "rb") as file:
+         data = file.read()
+
+      converter = Converter(dict(args.names))
+
+      for event, id, us in parse(data):
+         converter.record(event, id, us)
+
+      with open(args.output or args.trace + ".json", "wt") as out:
+         json.dump(converter.get_trace(), out)
+
+      converter.report(sys.stderr)
+
+   except (OSError, ValueError) as e:
+      print(f"Failed: {e}")
+      sys.exit(1)
@@ -0,0 +1,142 @@
+/*
+ * Test of the clock scaling
+ * The reactor, the timer and the clock controller are stubs. Each window of
+ *  the load is run by the test, with the time asleep it gives.
+ * - A low load scales the clock down, and a high load scales it back up
+ * - A load in between keeps the clock as is
+ * - A hold brings the full speed back at once, and keeps it until released
+ * - The tick of the timer and the hook follow each change
+ */
+#include <assert.h>
+
+#include "clock_scale.h"
+#include "reactor.h"
+#include "timer.h"
+#include "sysclk.h"
+
+uint8_t cosim_sreg;
+CLKCTRL_t CLKCTRL;
+
+namespace
+{
+   /** As the defaults of clock_scale.c */
+   constexpr uint32_t window = TIMER_MILLISECONDS(50);
+   constexpr uint8_t shift = 2;
+
+   reactor_handler_t check = nullptr;
+   timer_count_t repeat = 0;
+
+   /** Time asleep so far (ms) */
+   reactor_sleep_stats_t asleep = {};
+
+   /** Changes seen by the timer and the hook */
+   int rescales = 0, hooks = 0;
+   uint8_t tick_shift = 0;
+
+   void on_change()
+   {
+      ++hooks;
+      assert( clock_scale_get_hz() == (uint32_t)F_CPU >> tick_shift );
+   }
+
+   /** Run a window with the given load (ms busy) */
+   void run_window(uint32_t busy)
+   {
+      asleep.idle += window - busy;
+      check(nullptr);
+   }
+
+   bool scaled()
+   {
+      return CLKCTRL.MCLKCTRLB == (SYSCLK_PSDIV_4) && tick_shift == shift && clock_scale_get_hz() == F_CPU / 4;
+   }
+
+   bool full_speed()
+   {
+      return CLKCTRL.MCLKCTRLB == (SYSCLK_PSDIV_1) && tick_shift == 0 && clock_scale_get_hz() == F_CPU;
+   }
+}
+
+extern "C"
+{
+   reactor_handle_t reactor_register(const reactor_handler_t handler, reactor_priorities_t, uint8_t)
+   {
+      check = handler;
+
+      return 0;
+   }
+
+   timer_count_t timer_get_count_from_now(timer_count_t count) { return count; }
+
+   timer_instance_t timer_arm(reactor_handle_t, timer_count_t, timer_count_t count, void *)
+   {
+      repeat = count;
+
+      return 0;
+   }
+
+   void timer_rescale(uint8_t to)
+   {
+      ++rescales;
+      tick_shift = to;
+   }
+
+   void reactor_get_sleep_stats(reactor_sleep_stats_t *stats) { *stats = asleep; }
+
+   void ccp_write_io(void *addr, uint8_t value) { *(uint8_t *)addr = value; }
+}
+
+int main()
+{
+   clock_scale_set_hook(on_change);
+   clock_scale_init();
+
+   assert( check != nullptr );
+   assert( repeat == window );
+   assert( full_speed() );
+
+   // Busy, then quiet
+   run_window(window);
+   assert( full_speed() && rescales == 0 );
+
+   run_window(2);
+   assert( scaled() );
+   assert( rescales == 1 && hooks == 1 );
+
+   // The same work takes 4 times longer, which is not enough to scale up
+   run_window(8);
+   run_window(25);
+   assert( scaled() && rescales == 1 );
+
+   // Past the threshold
+   run_window(40);
+   assert( full_speed() && rescales == 2 && hooks == 2 );
+
+   // A hold is served at once
+   run_window(0);
+   assert( scaled() );
+
+   clock_scale_hold();
+   assert( full_speed() && rescales == 4 );
+
+   clock_scale_hold();
+   clock_scale_release();
+   run_window(0);
+   assert( full_speed() );
+
+   // The windows go on whilst held, and the load is measured again once released
+   clock_scale_release();
+   assert( full_speed() );
+   run_window(0);
+   assert( scaled() );
+
+   // A hold at full speed changes nothing
+   run_window(50);
+   assert( full_speed() );
+   int before = rescales;
+   clock_scale_hold();
+   clock_scale_release();
+   assert( rescales == before );
+
+   return 0;
+}
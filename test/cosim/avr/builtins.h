@@ -0,0 +1 @@
+/* Host stand-in of <avr/builtins.h> for the co-simulation - nothing used */
@@ -0,0 +1,15 @@
+/*
+ * Host stand-in of <avr/interrupt.h> for the co-simulation
+ * The simulation calls the interrupt routines itself, between handlers.
+ */
+#ifndef COSIM_AVR_INTERRUPT_H_
+#define COSIM_AVR_INTERRUPT_H_
+
+#include <avr/io.h>
+
+#define ISR(vector) void vector(void)
+
+#define cli() ((void)0)
+#define sei() ((void)0)
+
+#endif /* COSIM_AVR_INTERRUPT_H_ */
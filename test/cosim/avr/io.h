@@ -0,0 +1,118 @@
+/*
+ * Host stand-in of <avr/io.h> for the co-simulation
+ * Only the registers and bits used by the code linked in the simulation.
+ * The registers are plain memory, defined by cosim.hpp. The bit values are
+ *  those of the tinyAVR 1-series and 2-series.
+ */
+#ifndef COSIM_AVR_IO_H_
+#define COSIM_AVR_IO_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef volatile uint8_t register8_t;
+
+typedef struct
+{
+   register8_t DIR, DIRSET, DIRCLR, DIRTGL;
+   register8_t OUT, OUTSET, OUTCLR, OUTTGL;
+   register8_t IN, INTFLAGS, PORTCTRL, PINCONFIG;
+   register8_t PINCTRLUPD, PINCTRLSET, PINCTRLCLR, reserved;
+   register8_t PIN0CTRL, PIN1CTRL, PIN2CTRL, PIN3CTRL;
+   register8_t PIN4CTRL, PIN5CTRL, PIN6CTRL, PIN7CTRL;
+} PORT_t;
+
+typedef struct
+{
+   register8_t DIR, OUT, IN, INTFLAGS;
+} VPORT_t;
+
+typedef struct
+{
+   register8_t CTRLA, DUALCTRL, DBGCTRL, MCTRLA, MCTRLB, MSTATUS, MBAUD, MADDR, MDATA;
+   register8_t SCTRLA, SCTRLB, SSTATUS, SADDR, SDATA, SADDRMASK;
+} TWI_t;
+
+/** The TWI of both boards. Each side only uses its own half (master or slave) */
+extern TWI_t TWI0;
+
+typedef struct
+{
+   register8_t MCLKCTRLA, MCLKCTRLB, MCLKLOCK, MCLKSTATUS;
+} CLKCTRL_t;
+
+/** The clock controller. Only written by the clock scaling */
+extern CLKCTRL_t CLKCTRL;
+
+/**
+ * The ports of both boards, laid out as ioport.h expects them (0x20 apart).
+ * The controller reads the IN registers, and the hub drives the OUT
+ *  registers, so the boards do not clash.
+ */
+extern uint8_t ioport_posix_ports[];
+#define PORTA (*(PORT_t *)&ioport_posix_ports[0x00])
+#define PORTB (*(PORT_t *)&ioport_posix_ports[0x20])
+#define PORTC (*(PORT_t *)&ioport_posix_ports[0x40])
+
+/** Status register. Only saved and restored */
+extern uint8_t cosim_sreg;
+#define SREG cosim_sreg
+
+#define CLKCTRL_CLKSEL_OSC20M_gc    0x00
+#define CLKCTRL_CLKSEL_OSCULP32K_gc 0x01
+#define CLKCTRL_CLKSEL_XOSC32K_gc   0x02
+#define CLKCTRL_CLKSEL_EXTCLK_gc    0x03
+#define CLKCTRL_PEN_bm              0x01
+#define CLKCTRL_PDIV_2X_gc          0x00
+#define CLKCTRL_PDIV_4X_gc          0x02
+#define CLKCTRL_PDIV_8X_gc          0x04
+#define CLKCTRL_PDIV_16X_gc         0x06
+#define CLKCTRL_PDIV_32X_gc         0x08
+#define CLKCTRL_PDIV_64X_gc         0x0A
+#define CLKCTRL_PDIV_6X_gc          0x10
+#define CLKCTRL_PDIV_10X_gc         0x12
+#define CLKCTRL_PDIV_12X_gc         0x14
+#define CLKCTRL_PDIV_24X_gc         0x16
+#define CLKCTRL_PDIV_48X_gc         0x18
+#define CLKCTRL_LOCK_bm             0x01
+
+#define PORT_ISC_gm                 0x07
+#define PORT_ISC_BOTHEDGES_gc       0x01
+#define PORT_ISC_INPUT_DISABLE_gc   0x04
+#define PORT_PULLUPEN_bm            0x08
+#define PORT_INVEN_bm               0x80
+
+#define TWI_FMPEN_bm                0x02
+
+#define TWI_ENABLE_bm               0x01
+#define TWI_SMEN_bm                 0x02
+#define TWI_PMEN_bm                 0x04
+#define TWI_PIEN_bm                 0x20
+#define TWI_APIEN_bm                0x40
+#define TWI_DIEN_bm                 0x80
+
+#define TWI_ACKACT_bm               0x04
+#define TWI_SCMD_NOACT_gc           0x00
+#define TWI_SCMD_COMPTRANS_gc       0x02
+#define TWI_SCMD_RESPONSE_gc        0x03
+
+#define TWI_AP_bm                   0x01
+#define TWI_DIR_bm                  0x02
+#define TWI_BUSERR_bm               0x04
+#define TWI_COLL_bm                 0x08
+#define TWI_RXACK_bm                0x10
+#define TWI_CLKHOLD_bm              0x20
+#define TWI_APIF_bm                 0x40
+#define TWI_DIF_bm                  0x80
+
+#define TWI_BUSSTATE_gm             0x03
+#define TWI_BUSSTATE_IDLE_gc        0x01
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* COSIM_AVR_IO_H_ */
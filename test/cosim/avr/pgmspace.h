@@ -0,0 +1,11 @@
+/* Host stand-in of <avr/pgmspace.h> for the co-simulation - flash is memory */
+#ifndef COSIM_AVR_PGMSPACE_H_
+#define COSIM_AVR_PGMSPACE_H_
+
+#define PROGMEM
+#define PGM_P const char *
+#define PSTR(s) (s)
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_word(p) (*(const uint16_t *)(p))
+
+#endif /* COSIM_AVR_PGMSPACE_H_ */
@@ -0,0 +1,831 @@
+/*
+ * Lockstep co-simulation of the controller and the hub
+ * Links the link layers of both firmwares in one process:
+ *  - controller/i2c.c, over a virtual TWI master
+ *  - hub/i2c_slave.c, asx/src/twis.c and hub/protocol.c, with the slave
+ *    interrupt driven from the TWI0 registers as the hardware would
+ * The transmit path of controller/main.cpp is modelled (send on change,
+ *  heartbeat, queries, recovery), as the rest of main.cpp needs the board.
+ *
+ * Both sides share a virtual clock (us). Each side has its own reactor,
+ *  which runs its handlers one at a time by priority, as asx/src/reactor.c,
+ *  and can be given a cost per handler. Interrupts (the bus) run between
+ *  handlers. Everything is deterministic for a given seed of the faults.
+ *
+ * The bus holds a transaction for the time given by twi_timing.h, plus any
+ *  clock stretch. Faults are injected per transaction: NACK of the address,
+ *  a bit flipped in the frame or in the reply, and clock stretching.
+ *
+ * The valves are read from the port registers of the hub after each of its
+ *  handlers and interrupts. The pressure follows the chuck valve.
+ *
+ * With TRACE, the reactors and the timers of both sides are recorded as
+ *  asx/src/reactor.c and asx/src/timer.c would, in one trace.
+ *
+ * Include once per program.
+ */
+#ifndef COSIM_HPP_
+#define COSIM_HPP_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include <deque>
+#include <vector>
+#include <random>
+#include <functional>
+
+#include "reactor.h"
+#include "timer.h"
+#include "ioport.h"
+#include "twim.h"
+#include "twis.h"
+#include "twi_timing.h"
+#include "op_codes.h"
+#include "link_stats.h"
+#include "trace.h"
+
+#include "i2c.h"
+#include "i2c_slave.h"
+#include "protocol.h"
+#include "pressure_mon.h"
+#include "alert.h"
+
+#include "conf_board.h"
+
+extern "C" void TWI0_TWIS_vect(void);
+extern "C" TWI_Slave_t slave;
+
+/*
+ * Registers
+ */
+extern "C"
+{
+   TWI_t TWI0;
+   uint8_t cosim_sreg;
+   uint8_t ioport_posix_ports[(IOPORT_PORTC + 1) * IOPORT_PORT_OFFSET];
+   uint8_t ioport_posix_vports[(IOPORT_PORTC + 1) * IOPORT_PORT_VOFFSET];
+}
+
+namespace cosim
+{
+   enum side_t { controller, hub, sides };
+
+   const char *const side_names[sides] = { "controller", "hub" };
+
+   /** Virtual time (us) */
+   uint64_t now = 0;
+
+   /** Side which registers handlers or runs */
+   side_t side = controller;
+
+   /** Time each side spends in a handler (us) */
+   uint32_t handler_us[sides] = {};
+
+   /** Number of handlers run by each side */
+   uint32_t handlers_run[sides] = {};
+
+   /************************************************************************/
+   /* Reactors                                                             */
+   /************************************************************************/
+
+   struct handler_t
+   {
+      reactor_handler_t handler;
+      side_t side;
+      uint8_t priority;
+      uint8_t queue_size;
+      std::deque<void *> pending;
+      bool own_cost;
+      uint32_t cost_us;
+   };
+
+   std::vector<handler_t> handlers;
+
+   /** A side is busy until then, running a handler */
+   uint64_t busy_until[sides] = {};
+
+   void settle_ports();
+
+   /** Run the handler of highest priority of the side, if any. @return true if run */
+   bool run_one(side_t s)
+   {
+      handler_t *best = nullptr;
+
+      for (auto &h : handlers)
+      {
+         if ( h.side == s && ! h.pending.empty() && (best == nullptr || h.priority > best->priority) )
+         {
+            best = &h;
+         }
+      }
+
+      if ( best == nullptr )
+      {
+         return false;
+      }
+
+      void *data = best->pending.front();
+      best->pending.pop_front();
+
+#ifdef TRACE
+      reactor_handle_t handle = reactor_handle_t(best - handlers.data());
+#endif
+
+      side = s;
+      busy_until[s] = now + (best->own_cost ? best->cost_us : handler_us[s]);
+      ++handlers_run[s];
+      trace_event(trace_dispatch_start, handle);
+      best->handler(data);
+
+#ifdef TRACE
+      // The handler runs at once, but ends once its cost is spent
+      uint64_t started = now;
+      now = busy_until[s];
+      trace_event(trace_dispatch_end, handle);
+      now = started;
+#endif
+
+      if ( s == hub )
+      {
+         settle_ports();
+      }
+
+      return true;
+   }
+
+   /** @return true if the side has a handler to run */
+   bool has_pending(side_t s)
+   {
+      for (auto &h : handlers)
+      {
+         if ( h.side == s && ! h.pending.empty() )
+         {
+            return true;
+         }
+      }
+
+      return false;
+   }
+
+   /** Give a handler its own cost (us), rather than the one of its side */
+   void handler_cost(reactor_handle_t handle, uint32_t us)
+   {
+      handlers.at(handle).own_cost = true;
+      handlers.at(handle).cost_us = us;
+   }
+
+   /************************************************************************/
+   /* Timers                                                               */
+   /************************************************************************/
+
+   struct armed_timer_t
+   {
+      timer_instance_t instance;
+      reactor_handle_t reactor;
+      timer_count_t expiry;
+      timer_count_t repeat;
+      void *arg;
+   };
+
+   std::vector<armed_timer_t> timers;
+
+   timer_instance_t next_instance = 0;
+
+   inline uint64_t ms_to_us(timer_count_t ms) { return (uint64_t)ms * 1000; }
+
+   /************************************************************************/
+   /* Faults                                                               */
+   /************************************************************************/
+
+   /** Odds of each fault per transaction (per thousand), and the longest stretch */
+   struct faults_t
+   {
+      uint16_t nack;
+      uint16_t frame_flip;
+      uint16_t reply_flip;
+      uint16_t stretch;
+      uint32_t stretch_max_us;
+   };
+
+   faults_t faults = {};
+
+   std::mt19937 rng(1);
+
+   bool odds(uint16_t per_thousand)
+   {
+      return per_thousand && (rng() % 1000) < per_thousand;
+   }
+
+   /** Flip a random bit of the buffer */
+   void flip(uint8_t *buffer, unsigned length)
+   {
+      unsigned bit = rng() % (length * 8);
+
+      buffer[bit / 8] ^= (0x80 >> (bit % 8));
+   }
+
+   /************************************************************************/
+   /* Bus                                                                  */
+   /************************************************************************/
+
+   /** Frequency of the bus, as set by the profile */
+   uint32_t f_scl = TWI_SPEED;
+
+   /** Transactions queued by the master, the first being on the bus */
+   std::deque<const twi_package_t *> bus_queue;
+
+   enum bus_phase_t { bus_idle, bus_writing, bus_reading };
+
+   bus_phase_t bus_phase = bus_idle;
+
+   /** End of the current phase of the transaction on the bus */
+   uint64_t bus_at = 0;
+
+   /** The slave did not acknowledge the current transaction */
+   bool bus_nack = false;
+
+   /** Number of transactions and faults */
+   uint32_t transactions = 0;
+   uint32_t injected[4] = {};
+
+   enum { fault_nack, fault_frame_flip, fault_reply_flip, fault_stretch };
+
+   /** Raise the slave interrupt with the given status */
+   uint8_t slave_interrupt(uint8_t status, uint8_t data = 0)
+   {
+      TWI0.SSTATUS = status;
+      TWI0.SDATA = data;
+      TWI0_TWIS_vect();
+
+      return TWI0.SDATA;
+   }
+
+   void bus_start()
+   {
+      const twi_package_t *package = bus_queue.front();
+      uint32_t ns = twi_timing_transaction_ns(f_scl, package->addr_length, 0);
+
+      ++transactions;
+      bus_nack = odds(faults.nack);
+      injected[fault_nack] += bus_nack;
+
+      // The address is not acknowledged after its 9 clocks
+      bus_at = now + (bus_nack ? (10 * 1000000ull) / f_scl : (ns + 999) / 1000);
+      bus_phase = bus_writing;
+   }
+
+   /** The frame is written. Hand it to the slave, byte by byte */
+   void bus_written()
+   {
+      const twi_package_t *package = bus_queue.front();
+
+      if ( bus_nack )
+      {
+         bus_queue.pop_front();
+         bus_phase = bus_idle;
+         side = controller;
+         package->complete_cb(ERR_IO_ERROR);
+
+         return;
+      }
+
+      uint8_t frame[TWI_ADDR_MAX_LENGTH];
+
+      for (int i=0; i<package->addr_length; ++i)
+      {
+         frame[i] = package->addr[i];
+      }
+
+      if ( odds(faults.frame_flip) )
+      {
+         ++injected[fault_frame_flip];
+         flip(frame, package->addr_length);
+      }
+
+      side = hub;
+      slave_interrupt(TWI_APIF_bm | TWI_AP_bm);
+
+      for (int i=0; i<package->addr_length; ++i)
+      {
+         slave_interrupt(TWI_DIF_bm, frame[i]);
+      }
+
+      settle_ports();
+
+      // Repeated start, then read the reply
+      uint32_t ns = twi_timing_transaction_ns(f_scl, 0, package->length) -
+         twi_timing_transaction_ns(f_scl, 0, 0);
+      uint64_t stretch = 0;
+
+      if ( faults.stretch_max_us && odds(faults.stretch) )
+      {
+         ++injected[fault_stretch];
+         stretch = 1 + rng() % faults.stretch_max_us;
+      }
+
+      bus_at = now + (ns + 999) / 1000 + stretch;
+      bus_phase = bus_reading;
+   }
+
+   /** The reply is read. Complete the transaction and start the next one */
+   void bus_read()
+   {
+      const twi_package_t *package = bus_queue.front();
+      uint8_t *reply = (uint8_t *)package->buffer;
+
+      side = hub;
+      slave_interrupt(TWI_APIF_bm | TWI_AP_bm | TWI_DIR_bm);
+
+      // The master acks all bytes but the last
+      for (unsigned i=0; i<package->length; ++i)
+      {
+         reply[i] = slave_interrupt(TWI_DIF_bm | TWI_DIR_bm);
+      }
+
+      slave_interrupt(TWI_DIF_bm | TWI_DIR_bm | TWI_RXACK_bm);
+
+      if ( odds(faults.reply_flip) )
+      {
+         ++injected[fault_reply_flip];
+         flip(reply, package->length);
+      }
+
+      bus_queue.pop_front();
+      bus_phase = bus_idle;
+      side = controller;
+      package->complete_cb(STATUS_OK);
+   }
+
+   /************************************************************************/
+   /* Valves of the hub                                                    */
+   /************************************************************************/
+
+   /** Pin of each valve, in the order of the bits of opcodes_valve_t */
+   const ioport_pin_t valve_pins[] = {
+      IOPORT_CHUCK_CLAMP,
+      IOPORT_SPINDLE_CLEAN,
+      IOPORT_TOOL_SETTER_AIR_BLAST,
+      IOPORT_DOOR_PULL,
+      IOPORT_DOOR_PUSH,
+   };
+
+   /** Valves on (bitmask of opcodes_valve_t), as driven on the pins */
+   uint8_t valves = 0;
+
+   /** Called on each change of the valves */
+   std::function<void(uint8_t)> on_valves;
+
+   /** Number of changes of the valves */
+   uint32_t valve_changes = 0;
+
+   PORT_t *port(uint8_t id)
+   {
+      return reinterpret_cast<PORT_t *>(&ioport_posix_ports[id * IOPORT_PORT_OFFSET]);
+   }
+
+   /** Apply the writes to the strobe registers, as the port logic would */
+   void settle_ports()
+   {
+      for (uint8_t id=IOPORT_PORTA; id<=IOPORT_PORTC; ++id)
+      {
+         PORT_t *p = port(id);
+
+         p->OUT = ((p->OUT & ~p->OUTCLR) | p->OUTSET) ^ p->OUTTGL;
+         p->DIR = ((p->DIR & ~p->DIRCLR) | p->DIRSET) ^ p->DIRTGL;
+         p->OUTSET = p->OUTCLR = p->OUTTGL = 0;
+         p->DIRSET = p->DIRCLR = p->DIRTGL = 0;
+      }
+
+      uint8_t driven = 0;
+
+      for (unsigned i=0; i<sizeof(valve_pins); ++i)
+      {
+         ioport_pin_t pin = valve_pins[i];
+
+         if ( port(ioport_pin_to_port_id(pin))->OUT & (1 << (pin & 7)) )
+         {
+            driven |= (1 << i);
+         }
+      }
+
+      if ( driven != valves )
+      {
+         bool pressure = driven & opcodes_valve_chuck;
+
+         if ( pressure != bool(valves & opcodes_valve_chuck) )
+         {
+            i2c_slave_set_status(pressure ? opcodes_reply_on : opcodes_reply_off);
+         }
+
+         valves = driven;
+         ++valve_changes;
+
+         if ( on_valves )
+         {
+            on_valves(valves);
+         }
+      }
+   }
+
+   /************************************************************************/
+   /* Controller - the transmit path of controller/main.cpp                */
+   /************************************************************************/
+
+   namespace ctrl
+   {
+      /** As in main.cpp */
+      constexpr uint16_t I2C_HEARTBEAT_PROPOSED = 250;
+      constexpr uint8_t COMMS_ERRORS_BEFORE_RECOVERY = 3;
+      constexpr timer_count_t I2C_BUSY_RETRY_DELAY = TIMER_MILLISECONDS(1);
+
+      reactor_handle_t react_send, react_read, react_error, react_recover;
+
+      opcodes_cmd_t command = opcodes_cmd_idle;
+      uint8_t payload[OPCODES_MAX_PAYLOAD] = {};
+
+      timer_instance_t transmit_timer = TIMER_INVALID_INSTANCE;
+      bool transmit_pending = false;
+      uint8_t hub_stats_item = LINK_STATS_ITEMS;
+      uint8_t consecutive_errors = 0;
+
+      /** Outcome of the reads and errors */
+      uint32_t reads = 0, errors = 0, recoveries = 0;
+
+      /** Last pressure read */
+      bool pressure = false;
+
+      /** Called with the pressure on each good read, as on_i2c_read */
+      std::function<void(bool)> on_pressure;
+
+      void * const heartbeat = reinterpret_cast<void *>(1);
+
+      timer_count_t heartbeat_period()
+      {
+         return TIMER_MILLISECONDS(i2c_heartbeat_period());
+      }
+
+      void cancel_transmit()
+      {
+         if ( transmit_timer != TIMER_INVALID_INSTANCE )
+         {
+            timer_cancel(transmit_timer);
+            transmit_timer = TIMER_INVALID_INSTANCE;
+         }
+      }
+
+      void arm_transmit(timer_count_t delay, void *arg)
+      {
+         cancel_transmit();
+         transmit_timer = timer_arm(react_send, timer_get_count_from_now(delay), 0, arg);
+      }
+
+      /** As trigger_next_transmit */
+      void trigger_transmit()
+      {
+         cancel_transmit();
+
+         if ( ! transmit_pending )
+         {
+            transmit_pending = true;
+            reactor_notify(react_send, 0);
+         }
+      }
+
+      void on_send(void *arg)
+      {
+         // A heartbeat queued ahead of a transmit right away
+         if ( arg == heartbeat && transmit_pending )
+         {
+            return;
+         }
+
+         transmit_pending = false;
+
+         if ( i2c_master_send(command, payload) == ERR_BUSY )
+         {
+            arm_transmit(I2C_BUSY_RETRY_DELAY, arg);
+            return;
+         }
+
+         if ( arg == heartbeat )
+         {
+            status_code_t status = (hub_stats_item == LINK_STATS_ITEMS)
+               ? i2c_master_propose_heartbeat(I2C_HEARTBEAT_PROPOSED)
+               : i2c_master_query(hub_stats_item);
+
+            if ( status == STATUS_OK )
+            {
+               hub_stats_item = (hub_stats_item + 1) % (LINK_STATS_ITEMS + 1);
+            }
+         }
+
+         arm_transmit(heartbeat_period(), heartbeat);
+      }
+
+      void on_read(void *arg)
+      {
+         uintptr_t value = reinterpret_cast<uintptr_t>(arg);
+
+         ++reads;
+         consecutive_errors = 0;
+         pressure = value & I2C_READ_PRESSURE;
+
+         if ( value & I2C_READ_STALE )
+         {
+            trigger_transmit();
+         }
+
+         if ( on_pressure )
+         {
+            on_pressure(pressure);
+         }
+      }
+
+      void on_error(void *)
+      {
+         ++errors;
+
+         if ( ++consecutive_errors >= COMMS_ERRORS_BEFORE_RECOVERY )
+         {
+            consecutive_errors = 0;
+            reactor_notify(react_recover, 0);
+         }
+      }
+
+      void on_recover(void *)
+      {
+         ++recoveries;
+         i2c_recover();
+      }
+
+      /** The inputs changed - send at once, as refresh_opcode does */
+      void request(opcodes_cmd_t cmd, const uint8_t *data, uint8_t length)
+      {
+         side_t previous = side;
+
+         side = controller;
+         command = cmd;
+         memcpy(payload, data, length);
+         trigger_transmit();
+         side = previous;
+      }
+
+      void request(opcodes_cmd_t cmd, uint8_t valves = 0)
+      {
+         request(cmd, &valves, 1);
+      }
+   }
+
+   /************************************************************************/
+   /* Scheduler                                                            */
+   /************************************************************************/
+
+   /** Power up both boards */
+   void start()
+   {
+      side = hub;
+      protocol_init();
+      i2c_slave_init(reactor_register(protocol_handle_traffic, reactor_prio_realtime, 1));
+
+      side = controller;
+      ctrl::react_send = reactor_register(ctrl::on_send, reactor_prio_high, 2);
+      ctrl::react_read = reactor_register(ctrl::on_read, reactor_prio_high, 1);
+      ctrl::react_error = reactor_register(ctrl::on_error, reactor_prio_medium, 1);
+      ctrl::react_recover = reactor_register(ctrl::on_recover, reactor_prio_medium, 1);
+      i2c_init(ctrl::react_read, ctrl::react_error);
+
+      // The first heartbeat proposes the period
+      ctrl::transmit_timer = timer_arm(
+         ctrl::react_send, timer_get_count_from_now(ctrl::heartbeat_period()), 0, ctrl::heartbeat);
+   }
+
+   /** Fire the timers and the bus events which are due */
+   void fire_due()
+   {
+      for (size_t i=0; i<timers.size(); )
+      {
+         if ( ms_to_us(timers[i].expiry) > now )
+         {
+            ++i;
+            continue;
+         }
+
+         armed_timer_t timer = timers[i];
+
+         if ( timer.repeat )
+         {
+            timers[i].expiry += timer.repeat;
+            ++i;
+         }
+         else
+         {
+            timers.erase(timers.begin() + i);
+         }
+
+         side = handlers[timer.reactor].side;
+         trace_event(trace_timer_fire, timer.reactor);
+         reactor_notify(timer.reactor, timer.arg);
+      }
+
+      while ( bus_phase != bus_idle && bus_at <= now )
+      {
+         if ( bus_phase == bus_writing )
+         {
+            bus_written();
+         }
+         else
+         {
+            bus_read();
+         }
+
+         if ( bus_phase == bus_idle && ! bus_queue.empty() )
+         {
+            bus_start();
+         }
+      }
+   }
+
+   /** @return The time of the next event, or UINT64_MAX if none */
+   uint64_t next_event()
+   {
+      uint64_t next = UINT64_MAX;
+
+      for (auto &timer : timers)
+      {
+         next = Min(next, ms_to_us(timer.expiry));
+      }
+
+      if ( bus_phase != bus_idle )
+      {
+         next = Min(next, bus_at);
+      }
+
+      for (int s=0; s<sides; ++s)
+      {
+         if ( busy_until[s] > now && has_pending(side_t(s)) )
+         {
+            next = Min(next, busy_until[s]);
+         }
+      }
+
+      return next;
+   }
+
+   /** Run both boards until the given time (us) */
+   void run_until(uint64_t end)
+   {
+      while ( true )
+      {
+         fire_due();
+
+         bool ran = false;
+
+         for (int s=0; s<sides; ++s)
+         {
+            if ( busy_until[s] <= now )
+            {
+               ran = run_one(side_t(s)) || ran;
+            }
+         }
+
+         if ( ran )
+         {
+            continue;
+         }
+
+         uint64_t next = next_event();
+
+         if ( next > end )
+         {
+            now = end;
+            return;
+         }
+
+         now = next;
+      }
+   }
+
+   void run_for(uint64_t us)
+   {
+      run_until(now + us);
+   }
+}
+
+/************************************************************************/
+/* Services of asx, per side                                            */
+/************************************************************************/
+
+extern "C"
+{
+   reactor_handle_t reactor_register(const reactor_handler_t handler, reactor_priorities_t priority, uint8_t queue_size)
+   {
+      cosim::handlers.push_back({ handler, cosim::side, (uint8_t)priority, queue_size, {}, false, 0 });
+
+      return (reactor_handle_t)(cosim::handlers.size() - 1);
+   }
+
+   void reactor_notify(reactor_handle_t handle, void *data)
+   {
+      auto &h = cosim::handlers.at(handle);
+
+      // If the queue is full - drop old data
+      if ( h.pending.size() == h.queue_size )
+      {
+         h.pending.pop_front();
+      }
+
+      h.pending.push_back(data);
+      trace_event(trace_notify, handle);
+   }
+
+   timer_count_t timer_get_count(void) { return cosim::now / 1000; }
+   timer_count_t timer_get_count_from_now(timer_count_t count) { return cosim::now / 1000 + count; }
+   timer_count_t timer_time_lapsed_since(timer_count_t count) { return cosim::now / 1000 - count; }
+   uint16_t timer_get_us(void) { return (uint16_t)cosim::now; }
+
+   timer_instance_t timer_arm(reactor_handle_t reactor, timer_count_t count, timer_count_t repeat, void *arg)
+   {
+      timer_instance_t instance = cosim::next_instance++;
+
+      cosim::timers.push_back({ instance, reactor, count, repeat, arg });
+      trace_event(trace_timer_arm, reactor);
+
+      return instance;
+   }
+
+   bool timer_cancel(timer_instance_t instance)
+   {
+      for (auto it=cosim::timers.begin(); it!=cosim::timers.end(); ++it)
+      {
+         if ( it->instance == instance )
+         {
+            trace_event(trace_timer_cancel, it->reactor);
+            cosim::timers.erase(it);
+            return true;
+         }
+      }
+
+      return false;
+   }
+
+   /*
+    * Virtual TWI master. The driver queues two transactions at most
+    */
+   status_code_t twi_master_init(TWI_t *)
+   {
+      return STATUS_OK;
+   }
+
+   status_code_t twi_master_queue(TWI_t *, const twi_package_t *package, bool)
+   {
+      if ( cosim::bus_queue.size() == 2 )
+      {
+         return ERR_BUSY;
+      }
+
+      cosim::bus_queue.push_back(package);
+
+      if ( cosim::bus_phase == cosim::bus_idle )
+      {
+         cosim::bus_start();
+      }
+
+      return STATUS_OK;
+   }
+
+   status_code_t twim_recover_bus(TWI_t *)
+   {
+      cosim::bus_queue.clear();
+      cosim::bus_phase = cosim::bus_idle;
+
+      return STATUS_OK;
+   }
+
+   /*
+    * Alerts stop the simulation
+    */
+   void alert_record(bool abort, int line, const char *file)
+   {
+      fprintf(stderr, "%s: alert at %s:%d\n", cosim::side_names[cosim::side], file, line);
+
+      if ( abort )
+      {
+         ::abort();
+      }
+   }
+
+   /*
+    * Pressure monitor of the hub - the pressure follows the chuck valve
+    */
+   opcodes_reply_t pressure_mon_reply(void)
+   {
+      return (cosim::valves & opcodes_valve_chuck) ? opcodes_reply_on : opcodes_reply_off;
+   }
+}
+
+#endif /* COSIM_HPP_ */
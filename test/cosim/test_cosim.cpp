@@ -0,0 +1,516 @@
+/*
+ * Co-simulation of the controller and the hub over a virtual TWI bus
+ * - A clean link: the heartbeat is negotiated, and each command reaches
+ *   the valves with no error
+ * - Faults on the bus: the valves only ever take the value of a command
+ *   sent, and settle on the last one
+ * - Loss of the link: the hub turns the valves off, and turns them back on
+ *   once the link is restored
+ * - A command which comes as the heartbeat fires: a single heartbeat
+ *   goes on
+ * - A late copy of the first command (sequence 0): the hub rejects it
+ * - Pulse sequences: the on and off times and the count, the heartbeat
+ *   which repeats the command, another command or the loss of the link
+ *   which stops it, and the compressor budget
+ * The latency from the command to the valves is reported for each.
+ */
+#include <stdio.h>
+#include <assert.h>
+
+#include <algorithm>
+
+#include "cpp.h"
+
+#include "cosim.hpp"
+
+namespace
+{
+   /** Valves driven by each command */
+   uint8_t valves_of(opcodes_cmd_t cmd, uint8_t valves)
+   {
+      switch ( cmd )
+      {
+      case opcodes_cmd_push_door:        return opcodes_valve_push_door;
+      case opcodes_cmd_pull_door:        return opcodes_valve_pull_door;
+      case opcodes_cmd_blast_toolsetter: return opcodes_valve_blast_toolsetter;
+      case opcodes_cmd_blast_spindle:    return opcodes_valve_blast_spindle;
+      case opcodes_cmd_unclamp_chuck:    return opcodes_valve_chuck;
+      case opcodes_cmd_valves:           return valves;
+      default:                           return 0;
+      }
+   }
+
+   const opcodes_cmd_t commands[] = {
+      opcodes_cmd_idle,
+      opcodes_cmd_push_door,
+      opcodes_cmd_pull_door,
+      opcodes_cmd_blast_toolsetter,
+      opcodes_cmd_blast_spindle,
+      opcodes_cmd_unclamp_chuck,
+   };
+
+   /** Valves expected, and the ones of the command before (during a change) */
+   uint8_t expected = 0, previous = 0;
+
+   /** Time of the command (us), and the latencies to the valves */
+   uint64_t requested_at = 0;
+   bool pending = false;
+   std::vector<uint32_t> latencies;
+
+   /** Number of values taken by the valves which no command asked for */
+   uint32_t unexpected = 0;
+
+   /** Changes of the valves (us, valves), to time the pulse sequences */
+   std::vector<std::pair<uint64_t, uint8_t>> edges;
+
+   void on_valves(uint8_t valves)
+   {
+      // A change of valves goes through the valves in common (changeover)
+      if ( valves != expected && valves != previous && valves != (expected & previous) )
+      {
+         ++unexpected;
+      }
+
+      edges.push_back({ cosim::now, valves });
+
+      if ( pending && valves == expected )
+      {
+         latencies.push_back(cosim::now - requested_at);
+         pending = false;
+      }
+   }
+
+   void request(opcodes_cmd_t cmd, uint8_t valves = 0)
+   {
+      previous = cosim::valves;
+      expected = valves_of(cmd, valves);
+      requested_at = cosim::now;
+      pending = (expected != cosim::valves);
+
+      cosim::ctrl::request(cmd, valves);
+   }
+
+   /**
+    * Start a pulse sequence. The valves go between the ones kept within the
+    *  budget and none
+    */
+   void request_pulse(uint8_t valves, uint8_t on, uint8_t off, uint8_t count, uint8_t kept = 0)
+   {
+      uint8_t payload[opcodes_pulse_payload];
+
+      payload[opcodes_pulse_valves] = valves;
+      payload[opcodes_pulse_on] = on;
+      payload[opcodes_pulse_off] = off;
+      payload[opcodes_pulse_count] = count;
+
+      previous = 0;
+      expected = kept ? kept : valves;
+      pending = false;
+      edges.clear();
+
+      cosim::ctrl::request(opcodes_cmd_pulse, payload, sizeof(payload));
+   }
+
+   /** Check the edges of a whole sequence, from its first pulse */
+   void check_pulses(uint8_t valves, uint8_t on, uint8_t off, uint8_t count)
+   {
+      assert( edges.size() == 2u * count );
+
+      for (size_t i=0; i<edges.size(); ++i)
+      {
+         assert( edges[i].second == ((i % 2) ? 0 : valves) );
+
+         if ( i != 0 )
+         {
+            // The timers of the hub tick every ms
+            uint64_t lapse = edges[i].first - edges[i-1].first;
+            uint64_t time = (uint64_t)((i % 2) ? on : off) * OPCODES_PULSE_UNIT_MS * 1000;
+
+            assert( lapse + 1000 >= time && lapse <= time + 1000 );
+         }
+      }
+   }
+
+   /** @return The timer of the step of the pulse sequence - the only one of the hub with an argument */
+   std::vector<cosim::armed_timer_t>::iterator pulse_step()
+   {
+      return std::find_if(cosim::timers.begin(), cosim::timers.end(),
+         [](const cosim::armed_timer_t &t) {
+            return cosim::handlers[t.reactor].side == cosim::hub && t.arg != nullptr;
+         });
+   }
+
+   /** A single chain of heartbeats, whatever was queued when a command is sent */
+   void check_one_transmit_timer()
+   {
+      auto armed = std::count_if(cosim::timers.begin(), cosim::timers.end(),
+         [](const cosim::armed_timer_t &t) { return t.reactor == cosim::ctrl::react_send; });
+
+      assert( armed <= 1 );
+   }
+
+   /** Write a frame to the hub between two transactions, and read the reply */
+   void inject(const uint8_t *frame, uint8_t size, uint8_t *reply, uint8_t length)
+   {
+      while ( cosim::bus_phase != cosim::bus_idle )
+      {
+         cosim::run_for(100);
+      }
+
+      cosim::side_t previous = cosim::side;
+      cosim::side = cosim::hub;
+
+      cosim::slave_interrupt(TWI_APIF_bm | TWI_AP_bm);
+
+      for (uint8_t i=0; i<size; ++i)
+      {
+         cosim::slave_interrupt(TWI_DIF_bm, frame[i]);
+      }
+
+      cosim::settle_ports();
+      cosim::slave_interrupt(TWI_APIF_bm | TWI_AP_bm | TWI_DIR_bm);
+
+      for (uint8_t i=0; i<length; ++i)
+      {
+         reply[i] = cosim::slave_interrupt(TWI_DIF_bm | TWI_DIR_bm);
+      }
+
+      cosim::slave_interrupt(TWI_DIF_bm | TWI_DIR_bm | TWI_RXACK_bm);
+      cosim::side = previous;
+   }
+
+   /** @return The sequence number of the command in force in the hub */
+   uint8_t hub_ack()
+   {
+      uint8_t frame[OPCODES_FRAME_MAX_SIZE];
+      uint8_t reply[OPCODES_QUERY_REPLY_SIZE];
+      const uint8_t item = 0;
+
+      inject(frame, opcodes_encode_frame(frame, opcodes_cmd_query, 0, &item), reply, sizeof(reply));
+
+      return reply[1];
+   }
+
+   void report(const char *name)
+   {
+      std::sort(latencies.begin(), latencies.end());
+
+      if ( latencies.empty() )
+      {
+         printf("%-8s no change\n", name);
+         return;
+      }
+
+      auto at = [](unsigned percent) { return latencies[(latencies.size() - 1) * percent / 100]; };
+
+      printf("%-8s %5zu changes, latency (us) min %u p50 %u p99 %u max %u\n",
+         name, latencies.size(), latencies.front(), at(50), at(99), latencies.back());
+
+      latencies.clear();
+   }
+
+   void test_clean_link()
+   {
+      // The hub accepts the proposal on the first heartbeat
+      cosim::run_for(1000000);
+      assert( i2c_heartbeat_period() == cosim::ctrl::I2C_HEARTBEAT_PROPOSED );
+
+      for (int i=0; i<200; ++i)
+      {
+         request(commands[i % COUNTOF(commands)]);
+         cosim::run_for(100000);
+         assert( cosim::valves == expected );
+         check_one_transmit_timer();
+      }
+
+      // The pressure follows the chuck, and is read back on the next heartbeat
+      request(opcodes_cmd_unclamp_chuck);
+      cosim::run_for(2 * cosim::ctrl::I2C_HEARTBEAT_PROPOSED * 1000);
+      assert( cosim::ctrl::pressure );
+
+      request(opcodes_cmd_idle);
+      cosim::run_for(2 * cosim::ctrl::I2C_HEARTBEAT_PROPOSED * 1000);
+      assert( ! cosim::ctrl::pressure );
+
+      assert( cosim::ctrl::errors == 0 );
+      assert( unexpected == 0 );
+      assert( latencies.size() > 150 );
+
+      report("Clean");
+   }
+
+   void test_all_valves()
+   {
+      // Every set of valves within the budget, pins on both ports
+      for (uint8_t valves=0; valves<=OPCODES_VALVES_MASK; ++valves)
+      {
+         bool both_door = (valves & opcodes_valve_push_door) && (valves & opcodes_valve_pull_door);
+
+         if ( both_door || __builtin_popcount(valves) > 2 )
+         {
+            continue;
+         }
+
+         request(opcodes_cmd_valves, valves);
+         cosim::run_for(200000);
+         assert( cosim::valves == valves );
+      }
+
+      request(opcodes_cmd_idle);
+      cosim::run_for(100000);
+
+      assert( cosim::ctrl::errors == 0 );
+      assert( unexpected == 0 );
+
+      report("Valves");
+   }
+
+   void test_faults()
+   {
+      cosim::faults = { 20, 20, 20, 50, 200 };
+
+      for (int i=0; i<2000; ++i)
+      {
+         request(commands[cosim::rng() % COUNTOF(commands)]);
+
+         // Settles within a few heartbeats. The stale commands are sent again
+         cosim::run_for(50000 + cosim::rng() % 1000000);
+
+         if ( cosim::valves != expected )
+         {
+            cosim::run_for(3 * cosim::ctrl::I2C_HEARTBEAT_PROPOSED * 1000);
+         }
+
+         assert( cosim::valves == expected );
+         check_one_transmit_timer();
+      }
+
+      cosim::faults = {};
+      cosim::run_for(1000000);
+
+      assert( unexpected == 0 );
+      assert( cosim::ctrl::errors > 0 );
+      assert( cosim::injected[cosim::fault_frame_flip] > 0 );
+      assert( cosim::injected[cosim::fault_reply_flip] > 0 );
+
+      printf("Faults: %u transactions, %u NACK, %u frame flips, %u reply flips, %u stretched\n",
+         cosim::transactions,
+         cosim::injected[cosim::fault_nack], cosim::injected[cosim::fault_frame_flip],
+         cosim::injected[cosim::fault_reply_flip], cosim::injected[cosim::fault_stretch]);
+      printf("        %u errors seen by the controller, %u recoveries\n",
+         cosim::ctrl::errors, cosim::ctrl::recoveries);
+
+      report("Faults");
+   }
+
+   void test_queued_heartbeat()
+   {
+      // The heartbeat fires, and a command comes before the reactor runs it
+      for (int i=0; i<20; ++i)
+      {
+         auto heartbeat = std::find_if(cosim::timers.begin(), cosim::timers.end(),
+            [](const cosim::armed_timer_t &t) { return t.reactor == cosim::ctrl::react_send; });
+         assert( heartbeat != cosim::timers.end() );
+
+         cosim::run_until(cosim::ms_to_us(heartbeat->expiry) - 1);
+         cosim::now += 1;
+         cosim::fire_due();
+
+         request(commands[i % COUNTOF(commands)]);
+         cosim::run_for(100000);
+
+         assert( cosim::valves == expected );
+         check_one_transmit_timer();
+      }
+
+      assert( cosim::ctrl::errors == 0 );
+   }
+
+   void test_seq_reset_replay()
+   {
+      // New commands, until 0 is older than the command in force
+      uint8_t ack;
+
+      for (int i=1; (ack = hub_ack()) == OPCODES_SEQ_RESET || ack >= 0x80; ++i)
+      {
+         request(commands[i % COUNTOF(commands)]);
+         cosim::run_for(100000);
+         assert( cosim::valves == expected );
+      }
+
+      // A late copy of the first command after the reset, with other valves
+      uint8_t before = cosim::valves;
+      opcodes_cmd_t cmd = before ? opcodes_cmd_idle : opcodes_cmd_push_door;
+      uint8_t frame[OPCODES_FRAME_MAX_SIZE];
+      uint8_t reply[OPCODES_REPLY_SIZE];
+
+      inject(frame, opcodes_encode_frame(frame, cmd, OPCODES_SEQ_RESET, nullptr), reply, sizeof(reply));
+
+      // Rejected. The reply acks the command in force
+      assert( reply[1] == ack );
+
+      cosim::run_for(100000);
+      assert( cosim::valves == before );
+      assert( unexpected == 0 );
+   }
+
+   void test_pulse()
+   {
+      uint64_t heartbeat = cosim::ctrl::I2C_HEARTBEAT_PROPOSED * 1000;
+
+      request(opcodes_cmd_idle);
+      cosim::run_for(100000);
+
+      // 4 pulses of 100ms, 50ms apart. The heartbeat repeats the command meanwhile
+      uint32_t transactions = cosim::transactions;
+
+      request_pulse(opcodes_valve_blast_spindle, 10, 5, 4);
+      cosim::run_for(600000);
+      assert( cosim::transactions - transactions >= 600000 / heartbeat );
+
+      // Done. The heartbeat does not start it again
+      cosim::run_for(4 * heartbeat);
+
+      check_pulses(opcodes_valve_blast_spindle, 10, 5, 4);
+      assert( cosim::valves == 0 );
+
+      // The budget applies to the valves pulsed
+      request_pulse(
+         opcodes_valve_chuck | opcodes_valve_blast_spindle | opcodes_valve_blast_toolsetter, 5, 5, 2,
+         opcodes_valve_chuck | opcodes_valve_blast_spindle
+      );
+      cosim::run_for(4 * heartbeat);
+
+      check_pulses(opcodes_valve_chuck | opcodes_valve_blast_spindle, 5, 5, 2);
+      assert( cosim::valves == 0 );
+
+      assert( cosim::ctrl::errors == 0 );
+      assert( unexpected == 0 );
+   }
+
+   void test_pulse_cancel()
+   {
+      uint64_t heartbeat = cosim::ctrl::I2C_HEARTBEAT_PROPOSED * 1000;
+
+      // Another command stops the sequence, and holds
+      request_pulse(opcodes_valve_blast_spindle, 10, 10, 20);
+      cosim::run_for(150000);
+
+      request(opcodes_cmd_push_door);
+      cosim::run_for(100000);
+      assert( cosim::valves == opcodes_valve_push_door );
+
+      edges.clear();
+      cosim::run_for(4 * heartbeat);
+      assert( edges.empty() );
+
+      request(opcodes_cmd_idle);
+      cosim::run_for(100000);
+
+      // A step fires, and a new sequence is applied before the timer reactor runs it
+      request_pulse(opcodes_valve_blast_spindle, 10, 10, 20);
+      cosim::run_for(50000);
+
+      auto step = pulse_step();
+      assert( step != cosim::timers.end() );
+
+      cosim::run_until(cosim::ms_to_us(step->expiry) - 1);
+      cosim::now += 1;
+      cosim::fire_due();
+
+      // The hub is held in a handler whilst the new sequence comes
+      uint64_t fired = cosim::now;
+      cosim::busy_until[cosim::hub] = fired + 5000;
+
+      request_pulse(opcodes_valve_blast_spindle, 10, 10, 2);
+      cosim::run_for(4 * heartbeat);
+
+      // The pulse in progress is the first of the new sequence, in full
+      assert( edges.size() == 3 );
+      assert( edges[0].first >= fired + 100000 );
+      assert( edges[0].second == 0 && edges[1].second == opcodes_valve_blast_spindle );
+      assert( cosim::valves == 0 );
+
+      assert( cosim::ctrl::errors == 0 );
+      assert( unexpected == 0 );
+   }
+
+   void test_pulse_link_loss()
+   {
+      uint64_t heartbeat = cosim::ctrl::I2C_HEARTBEAT_PROPOSED * 1000;
+
+      request_pulse(opcodes_valve_blast_spindle, 10, 10, 255);
+      cosim::run_for(100000);
+
+      // The hub stops the sequence once the link is lost
+      cosim::faults.nack = 1000;
+      cosim::run_for(5 * heartbeat);
+
+      edges.clear();
+      cosim::run_for(4 * heartbeat);
+      assert( edges.empty() );
+      assert( cosim::valves == 0 );
+      assert( pulse_step() == cosim::timers.end() );
+
+      // Once restored, the heartbeat starts it again, as any other command
+      cosim::faults.nack = 0;
+      cosim::run_for(2 * heartbeat);
+      assert( ! edges.empty() );
+
+      request(opcodes_cmd_idle);
+      cosim::run_for(100000);
+      assert( cosim::valves == 0 );
+   }
+
+   void test_link_loss()
+   {
+      uint64_t heartbeat = cosim::ctrl::I2C_HEARTBEAT_PROPOSED * 1000;
+
+      request(opcodes_cmd_push_door);
+      cosim::run_for(100000);
+      assert( cosim::valves == opcodes_valve_push_door );
+
+      // The hub gives up after 3 heartbeats without a command
+      cosim::faults.nack = 1000;
+      uint64_t lost_at = cosim::now;
+
+      while ( cosim::valves != 0 )
+      {
+         cosim::run_for(1000);
+         assert( cosim::now - lost_at < 5 * heartbeat );
+      }
+
+      assert( cosim::now - lost_at >= 2 * heartbeat );
+      printf("Link lost: valves off after %u ms\n", (unsigned)((cosim::now - lost_at) / 1000));
+
+      // The heartbeat turns the valve back on
+      cosim::faults.nack = 0;
+      cosim::run_for(2 * heartbeat);
+      assert( cosim::valves == opcodes_valve_push_door );
+
+      request(opcodes_cmd_idle);
+      cosim::run_for(100000);
+      assert( cosim::valves == 0 );
+   }
+}
+
+int main()
+{
+   cosim::on_valves = on_valves;
+   cosim::start();
+
+   test_clean_link();
+   test_all_valves();
+   test_queued_heartbeat();
+   test_seq_reset_replay();
+   test_pulse();
+   test_pulse_cancel();
+   test_faults();
+   test_link_loss();
+   test_pulse_link_loss();
+
+   link_stats_dump("Controller", "us", &i2c_link_stats);
+   link_stats_dump("Hub", "ms", &i2c_slave_link_stats);
+
+   return 0;
+}
@@ -0,0 +1,102 @@
+/*
+ * Learning of the travel times of the door
+ * Check the averages converge, the timeouts follow within their limits, and
+ *  the profile is only worth saving when it drifts.
+ */
+#include <stdio.h>
+#include <assert.h>
+
+#include "door_profile.h"
+
+namespace
+{
+   constexpr uint16_t fallback = 3000;
+
+   /** Until measured, the default timeout applies */
+   void test_fallback()
+   {
+      door_profile_t profile = {};
+
+      assert( door_profile_timeout(profile.average[door_profile_opening][door_profile_release], fallback) == fallback );
+   }
+
+   /** The first measurement is taken as is, then the average converges */
+   void test_average()
+   {
+      door_profile_t profile = {};
+      uint16_t &average = profile.average[door_profile_closing][door_profile_travel];
+
+      door_profile_record(&profile, door_profile_closing, door_profile_travel, 2000);
+      assert( average == 2000 );
+
+      // Other phases are not affected
+      assert( profile.average[door_profile_opening][door_profile_travel] == 0 );
+      assert( profile.average[door_profile_closing][door_profile_release] == 0 );
+
+      // The door slows down (cold morning) and the average follows
+      for (int i=0; i<20; ++i)
+      {
+         door_profile_record(&profile, door_profile_closing, door_profile_travel, 3000);
+      }
+
+      assert( average > 2950 && average <= 3000 );
+      printf("Average after 20 moves at 3000ms: %u\n", average);
+
+      // A single slow move only moves the average by a quarter
+      door_profile_record(&profile, door_profile_closing, door_profile_travel, 7000);
+      assert( average < 4100 );
+
+      // A null time still counts as measured
+      door_profile_t other = {};
+      door_profile_record(&other, door_profile_opening, door_profile_release, 0);
+      assert( other.average[door_profile_opening][door_profile_release] == 1 );
+
+      // A long time saturates
+      door_profile_record(&other, door_profile_opening, door_profile_travel, 100000);
+      assert( other.average[door_profile_opening][door_profile_travel] == UINT16_MAX );
+   }
+
+   /** Twice the average plus the margin, within the limits */
+   void test_timeout()
+   {
+      assert( door_profile_timeout(1000, fallback) == 2 * 1000 + DOOR_PROFILE_MARGIN_MS );
+      assert( door_profile_timeout(1, fallback) == DOOR_PROFILE_MIN_TIMEOUT_MS );
+      assert( door_profile_timeout(UINT16_MAX, fallback) == DOOR_PROFILE_MAX_TIMEOUT_MS );
+
+      // A typical door is faster to fault than with the default timeouts of 3s and 8s
+      assert( door_profile_timeout(300, 3000) < 3000 );
+      assert( door_profile_timeout(2000, 8000) < 8000 );
+   }
+
+   /** Small changes are not worth an EEPROM write */
+   void test_drift()
+   {
+      door_profile_t saved = {};
+      door_profile_t profile = {};
+
+      assert( ! door_profile_drifted(&saved, &profile) );
+
+      profile.average[door_profile_opening][door_profile_release] = 400;
+      assert( door_profile_drifted(&saved, &profile) );
+
+      saved = profile;
+      profile.average[door_profile_opening][door_profile_release] = 440;
+      assert( ! door_profile_drifted(&saved, &profile) );
+
+      profile.average[door_profile_opening][door_profile_release] = 351;
+      assert( ! door_profile_drifted(&saved, &profile) );
+
+      profile.average[door_profile_opening][door_profile_release] = 460;
+      assert( door_profile_drifted(&saved, &profile) );
+   }
+}
+
+int main()
+{
+   test_fallback();
+   test_average();
+   test_timeout();
+   test_drift();
+
+   return 0;
+}
@@ -0,0 +1,137 @@
+/*
+ * Host environment of the door and chuck state machines
+ * Stands for the parts of controller/main.cpp which state_machine.hpp uses,
+ *  so the machines are built and driven on the host.
+ * The clock only moves when told, and each machine has a single timer slot
+ *  which the test fires.
+ * Include once per program, then state_machine.hpp.
+ */
+#ifndef DOOR_ENV_HPP_
+#define DOOR_ENV_HPP_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "timer.h"
+
+// The pins of the controller. Any distinct values do on the host
+#define IN_DOOR_UP 1
+#define IN_DOOR_DOWN 2
+#define IN_CHUCK_OPEN 3
+
+namespace door_env
+{
+   /** Current time (ms) */
+   timer_count_t now = 0;
+
+   /** Timer slot of each machine (the reactor handle) */
+   enum { door_timer, chuck_timer, timers };
+
+   /** Expiry of the timer armed by each machine, if armed */
+   timer_count_t expiry[timers] = {};
+   bool armed[timers] = {};
+   void *arg[timers] = {};
+
+   /** Level of each valve, as last set by the machines */
+   bool valve[IN_CHUCK_OPEN + 1] = {};
+
+   /** Level of the chuck released output to Masso */
+   bool chuck_released = false;
+
+   /** Number of valve changes */
+   uint32_t valve_changes = 0;
+
+   /** Back to power up, with the clock at 0 */
+   inline void reset()
+   {
+      now = 0;
+
+      for (int i=0; i<timers; ++i)
+      {
+         armed[i] = false;
+      }
+
+      for (auto &level : valve)
+      {
+         level = false;
+      }
+
+      chuck_released = false;
+      valve_changes = 0;
+   }
+}
+
+/*
+ * Timer service - one slot
+ */
+extern "C" timer_count_t timer_get_count(void) { return door_env::now; }
+extern "C" timer_count_t timer_get_count_from_now(timer_count_t count) { return door_env::now + count; }
+extern "C" timer_count_t timer_time_lapsed_since(timer_count_t count) { return door_env::now - count; }
+
+extern "C" timer_instance_t timer_arm(reactor_handle_t reactor, timer_count_t count, timer_count_t, void *arg)
+{
+   door_env::expiry[reactor] = count;
+   door_env::armed[reactor] = true;
+   door_env::arg[reactor] = arg;
+
+   return reactor;
+}
+
+extern "C" bool timer_cancel(timer_instance_t instance)
+{
+   bool was_armed = false;
+
+   if ( instance < door_env::timers )
+   {
+      was_armed = door_env::armed[instance];
+      door_env::armed[instance] = false;
+   }
+
+   return was_armed;
+}
+
+/*
+ * Outputs - the LEDs do nothing
+ */
+typedef bool *digital_output_t;
+
+inline void digitial_output_set(digital_output_t output, bool level)
+{
+   if ( output )
+   {
+      *output = level;
+   }
+}
+
+inline void digitial_output_start(digital_output_t, timer_count_t, const char *, bool) {}
+
+digital_output_t led_door_opening = nullptr;
+digital_output_t led_door_closing = nullptr;
+digital_output_t led_chuck = nullptr;
+digital_output_t chuck_released_oc = &door_env::chuck_released;
+
+/*
+ * Controller - the valves of the door are fake inputs of the pneumatics
+ */
+reactor_handle_t react_cmd_timeout = door_env::door_timer;
+reactor_handle_t react_chuck_timeout = door_env::chuck_timer;
+
+inline void *pin_and_value_as_arg(uint8_t pin, bool value)
+{
+   return reinterpret_cast<void *>((uintptr_t)(pin | (value << 8)));
+}
+
+inline void set_output_status(uint8_t pin, bool state)
+{
+   door_env::valve[pin] = state;
+   ++door_env::valve_changes;
+}
+
+inline void on_input_change(void *arg)
+{
+   uintptr_t pin_and_value = reinterpret_cast<uintptr_t>(arg);
+
+   set_output_status(pin_and_value & 0xFF, pin_and_value >> 8);
+}
+
+#endif /* DOOR_ENV_HPP_ */
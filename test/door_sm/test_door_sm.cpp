@@ -0,0 +1,600 @@
+/*
+ * Scenario tests of the door state machine
+ * Replay the scenario files given on the command line (or all of the files
+ *  in scenarios/), then drive the machine with randomized sequences checked
+ *  against a model of the transition table.
+ * The chuck machine is checked against a timeout which fired just before a
+ *  new operation.
+ * The logger of main.cpp is installed on the door machine, and must keep
+ *  the last transitions in order once its ring wrapped.
+ *
+ * A scenario is a list of timestamped lines:
+ *   <time ms> event <name>      Send the event (names as given by c_str)
+ *   <time ms> state <name>      The machine must be in this state
+ *   <time ms> valves <v>        The door valves must be: none, up or down
+ *   <time ms> timer <t|off>     The timeout must expire at t (ms), or be off
+ * Times never go back. The clock is moved to the time of each line first,
+ *  and a timeout which expires on the way is fired at its expiry.
+ * '#' starts a comment.
+ *
+ * Run from test/door_sm: ./test_door_sm [scenario...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "door_env.hpp"
+#include "state_machine.hpp"
+#include "sm_logger.hpp"
+
+namespace
+{
+   using door_sm_t = sml::sm<door_sm, door_sm_dispatch>;
+
+   /** Randomized sequences and the events of each */
+   constexpr int sequences = 20000;
+   constexpr int steps = 40;
+
+   /** Door open and close cycles with the sensors following the valves */
+   constexpr int door_runs = 2000;
+   constexpr int door_cycles = 20;
+
+   /** An event which can be sent by name */
+   struct event_entry_t
+   {
+      const char *name;
+      void (*send)(door_sm_t &);
+   };
+
+   template <class TEvent>
+   void send(door_sm_t &sm)
+   {
+      sm.process_event(TEvent{});
+   }
+
+   const event_entry_t events[] = {
+      { event_open::c_str(),             send<event_open> },
+      { event_close::c_str(),            send<event_close> },
+      { event_door_is_up::c_str(),       send<event_door_is_up> },
+      { event_door_is_down::c_str(),     send<event_door_is_down> },
+      { event_door_moving_up::c_str(),   send<event_door_moving_up> },
+      { event_door_moving_down::c_str(), send<event_door_moving_down> },
+      { event_timeout::c_str(),          send<event_timeout> },
+   };
+
+   /** Index of the events in the table above */
+   enum { ev_open, ev_close, ev_is_up, ev_is_down, ev_moving_up, ev_moving_down, ev_timeout, ev_count };
+
+   const char *state_of(door_sm_t &sm)
+   {
+      const char *name = "";
+
+      sm.visit_current_states([&](auto state) { name = state.c_str(); });
+
+      return name;
+   }
+
+   const char *valves_of()
+   {
+      bool up = door_env::valve[IN_DOOR_UP];
+      bool down = door_env::valve[IN_DOOR_DOWN];
+
+      return up ? (down ? "both" : "up") : (down ? "down" : "none");
+   }
+
+   /** Start from the power up, with nothing learned */
+   void reset()
+   {
+      door_env::reset();
+      valve::profile = {};
+      valve::timer = TIMER_INVALID_INSTANCE;
+   }
+
+   /** Move the clock to the given time, firing the timeout on the way */
+   void advance(door_sm_t &sm, timer_count_t to)
+   {
+      auto &armed = door_env::armed[door_env::door_timer];
+      auto &expiry = door_env::expiry[door_env::door_timer];
+
+      if ( armed && expiry <= to )
+      {
+         door_env::now = expiry;
+         armed = false;
+         sm.process_event(event_timeout{});
+      }
+
+      door_env::now = to;
+   }
+
+   /************************************************************************/
+   /* Scenario files                                                       */
+   /************************************************************************/
+
+   /** @return The number of failed checks of the scenario */
+   int run_scenario(const char *path)
+   {
+      FILE *file = fopen(path, "r");
+      char line[128];
+      int lineno = 0;
+      int failures = 0;
+
+      if ( file == nullptr )
+      {
+         printf("%s: cannot open\n", path);
+         return 1;
+      }
+
+      reset();
+      door_sm_t sm;
+
+      while ( fgets(line, sizeof(line), file) )
+      {
+         ++lineno;
+
+         if ( char *comment = strchr(line, '#') )
+         {
+            *comment = '\0';
+         }
+
+         unsigned long time;
+         char verb[16], arg[32];
+         int fields = sscanf(line, "%lu %15s %31s", &time, verb, arg);
+
+         if ( fields <= 0 )
+         {
+            continue;
+         }
+
+         if ( fields != 3 || time < door_env::now )
+         {
+            printf("%s:%d: bad line\n", path, lineno);
+            ++failures;
+            continue;
+         }
+
+         advance(sm, time);
+
+         std::string actual, expected = arg;
+
+         if ( strcmp(verb, "event") == 0 )
+         {
+            auto found = std::find_if(std::begin(events), std::end(events),
+               [&](const event_entry_t &e) { return strcmp(e.name, arg) == 0; });
+
+            if ( found == std::end(events) )
+            {
+               printf("%s:%d: unknown event %s\n", path, lineno, arg);
+               ++failures;
+            }
+            else
+            {
+               found->send(sm);
+            }
+
+            continue;
+         }
+         else if ( strcmp(verb, "state") == 0 )
+         {
+            actual = state_of(sm);
+         }
+         else if ( strcmp(verb, "valves") == 0 )
+         {
+            actual = valves_of();
+         }
+         else if ( strcmp(verb, "timer") == 0 )
+         {
+            actual = door_env::armed[door_env::door_timer] ?
+               std::to_string(door_env::expiry[door_env::door_timer]) : "off";
+         }
+         else
+         {
+            printf("%s:%d: unknown command %s\n", path, lineno, verb);
+            ++failures;
+            continue;
+         }
+
+         if ( actual != expected )
+         {
+            printf("%s:%d: %s is %s, expected %s\n", path, lineno, verb, actual.c_str(), arg);
+            ++failures;
+         }
+      }
+
+      fclose(file);
+
+      return failures;
+   }
+
+   /** @return The scenario files of the directory, in name order */
+   std::vector<std::string> list_scenarios(const char *dir)
+   {
+      std::vector<std::string> paths;
+
+      if ( DIR *d = opendir(dir) )
+      {
+         while ( dirent *entry = readdir(d) )
+         {
+            if ( entry->d_name[0] != '.' )
+            {
+               paths.push_back(std::string(dir) + "/" + entry->d_name);
+            }
+         }
+
+         closedir(d);
+      }
+
+      std::sort(paths.begin(), paths.end());
+
+      return paths;
+   }
+
+   /************************************************************************/
+   /* Randomized sequences                                                 */
+   /************************************************************************/
+
+   enum model_state_t { unknown, closed, opened, opening, closing };
+
+   const char *const model_names[] = { "unknown", "closed", "opened", "opening", "closing" };
+
+   /**
+    * The transition table of door_sm, written again
+    * @return The next state, or the same state if the event is not expected
+    */
+   model_state_t model_next(model_state_t state, int event)
+   {
+      switch ( state )
+      {
+      case unknown:
+         if ( event == ev_is_up ) return opened;
+         if ( event == ev_is_down ) return closed;
+         break;
+      case closed:
+         if ( event == ev_open ) return opening;
+         break;
+      case opened:
+         if ( event == ev_close ) return closing;
+         break;
+      case opening:
+         if ( event == ev_timeout ) return unknown;
+         if ( event == ev_is_up ) return opened;
+         break;
+      case closing:
+         if ( event == ev_timeout ) return unknown;
+         if ( event == ev_is_down ) return closed;
+         break;
+      }
+
+      return state;
+   }
+
+   /** Check the machine and its outputs against the model */
+   void check(door_sm_t &sm, model_state_t state, timer_count_t phase_start)
+   {
+      bool moving = (state == opening || state == closing);
+
+      assert( strcmp(state_of(sm), model_names[state]) == 0 );
+      assert( door_env::valve[IN_DOOR_UP] == (state == opening) );
+      assert( door_env::valve[IN_DOOR_DOWN] == (state == closing) );
+      assert( door_env::armed[door_env::door_timer] == moving );
+
+      if ( moving )
+      {
+         // The timeout runs from the start of the phase, within the limits
+         timer_count_t timeout = door_env::expiry[door_env::door_timer] - phase_start;
+
+         assert( timeout >= DOOR_PROFILE_MIN_TIMEOUT_MS );
+         assert( timeout <= DOOR_PROFILE_MAX_TIMEOUT_MS );
+      }
+   }
+
+   /** Random events at random times, including the unexpected ones */
+   void run_random(std::mt19937 &rng)
+   {
+      reset();
+      door_sm_t sm;
+
+      model_state_t state = unknown;
+      timer_count_t phase_start = 0;
+      bool travelling = false;
+
+      for (int i=0; i<steps; ++i)
+      {
+         // Mostly short gaps, so the sensors beat the timeout
+         timer_count_t gap = (rng() % 4) ? rng() % 2000 : rng() % 20000;
+         timer_count_t to = door_env::now + gap;
+
+         if ( door_env::armed[door_env::door_timer] && door_env::expiry[door_env::door_timer] <= to )
+         {
+            state = model_next(state, ev_timeout);
+         }
+
+         advance(sm, to);
+         check(sm, state, phase_start);
+
+         int event = rng() % ev_timeout;
+         model_state_t next = model_next(state, event);
+
+         // Entering a move or a travel starts a timed phase. The sensor
+         //  leaving again once travelling does not
+         if ( next != state && (next == opening || next == closing) )
+         {
+            phase_start = door_env::now;
+            travelling = false;
+         }
+         else if ( ((state == opening && event == ev_moving_up) ||
+                    (state == closing && event == ev_moving_down)) && ! travelling )
+         {
+            phase_start = door_env::now;
+            travelling = true;
+         }
+
+         events[event].send(sm);
+         state = next;
+         check(sm, state, phase_start);
+      }
+   }
+
+   /**
+    * Open and close a door which takes its time, with some jitter.
+    * The learned timeouts must never cut a move short.
+    */
+   void run_door(std::mt19937 &rng)
+   {
+      reset();
+      door_sm_t sm;
+
+      timer_count_t release = 100 + rng() % 1400;
+      timer_count_t travel = 1000 + rng() % 4000;
+
+      auto jitter = [&](timer_count_t t) { return t - t / 10 + rng() % (t / 5 + 1); };
+
+      sm.process_event(event_door_is_down{});
+
+      for (int i=0; i<door_cycles; ++i)
+      {
+         bool open = (i % 2) == 0;
+
+         if ( open )
+         {
+            sm.process_event(event_open{});
+         }
+         else
+         {
+            sm.process_event(event_close{});
+         }
+
+         assert( strcmp(state_of(sm), open ? "opening" : "closing") == 0 );
+
+         advance(sm, door_env::now + jitter(release));
+
+         if ( open )
+         {
+            sm.process_event(event_door_moving_up{});
+         }
+         else
+         {
+            sm.process_event(event_door_moving_down{});
+         }
+
+         advance(sm, door_env::now + jitter(travel));
+
+         if ( open )
+         {
+            sm.process_event(event_door_is_up{});
+         }
+         else
+         {
+            sm.process_event(event_door_is_down{});
+         }
+
+         assert( strcmp(state_of(sm), open ? "opened" : "closed") == 0 );
+         assert( strcmp(valves_of(), "none") == 0 );
+         assert( ! door_env::armed[door_env::door_timer] );
+      }
+   }
+
+   /************************************************************************/
+   /* Logger                                                               */
+   /************************************************************************/
+
+   /** Ring of the logger, shorter than the transitions of a run */
+   constexpr uint8_t log_size = 8;
+
+   using logger_t = sm_logger<log_size>;
+
+   /** A transition as it must be logged */
+   struct transition_t
+   {
+      timer_count_t time;
+      const char *event;
+      const char *src;
+      const char *dst;
+   };
+
+   /** @return The output of the dump of the logger */
+   std::string dump_of(const logger_t &log)
+   {
+      FILE *capture = tmpfile();
+      int out = dup(STDOUT_FILENO);
+      char line[128];
+      std::string text;
+
+      fflush(stdout);
+      dup2(fileno(capture), STDOUT_FILENO);
+      log.dump("door_sm");
+      fflush(stdout);
+      dup2(out, STDOUT_FILENO);
+      close(out);
+
+      rewind(capture);
+
+      while ( fgets(line, sizeof(line), capture) )
+      {
+         text += line;
+      }
+
+      fclose(capture);
+
+      return text;
+   }
+
+   /** Open and close the door with the logger installed, as main.cpp does */
+   void run_logger()
+   {
+      using logged_sm_t = sml::sm<door_sm, sml::logger<logger_t>, door_sm_dispatch>;
+
+      reset();
+      logger_t log{};
+      logged_sm_t sm{log};
+      std::vector<transition_t> expected;
+
+      auto step = [&](timer_count_t time, auto event, const char *src, const char *dst) {
+         door_env::now = time;
+         sm.process_event(event);
+         expected.push_back({ time, decltype(event)::c_str(), src, dst });
+      };
+
+      step(0, event_door_is_down{}, "unknown", "closed");
+
+      for (timer_count_t t=1000; t<=10000; t+=3000)
+      {
+         step(t,        event_open{},             "closed",  "opening");
+         step(t + 400,  event_door_moving_up{},   "opening", "opening");
+         step(t + 1400, event_door_is_up{},       "opening", "opened");
+         step(t + 1500, event_close{},            "opened",  "closing");
+         step(t + 1800, event_door_moving_down{}, "closing", "closing");
+         step(t + 2800, event_door_is_down{},     "closing", "closed");
+      }
+
+      // The last transitions, oldest first
+      assert( expected.size() > log_size );
+      assert( log.count == log_size );
+
+      std::string dump = "door_sm transitions\n";
+      const transition_t *last = &expected[expected.size() - log_size];
+
+      for (uint8_t i=0; i<log_size; ++i)
+      {
+         const logger_t::entry_t &e = log[i];
+         char line[80];
+
+         assert( e.time == last[i].time );
+         assert( strcmp(e.event, last[i].event) == 0 );
+         assert( strcmp(e.src, last[i].src) == 0 );
+         assert( strcmp(e.dst, last[i].dst) == 0 );
+
+         snprintf(line, sizeof(line), "  %8lu %-14s %s -> %s\n",
+            (unsigned long)last[i].time, last[i].event, last[i].src, last[i].dst);
+         dump += line;
+      }
+
+      assert( dump_of(log) == dump );
+
+      log.clear();
+      assert( log.count == 0 );
+      assert( dump_of(log) == "door_sm transitions\n" );
+   }
+
+   /************************************************************************/
+   /* Chuck                                                                */
+   /************************************************************************/
+
+   /** As on_chuck_timeout of main.cpp */
+   void chuck_timeout(sml::sm<chuck_sm> &sm, void *arg)
+   {
+      if ( chuck::timeout_is_current(arg) )
+      {
+         sm.process_event(event_chuck_timeout{});
+      }
+   }
+
+   /** The timeout of an unclamp, queued behind a clamp, must not abort the clamp */
+   void run_chuck_stale_timeout()
+   {
+      using namespace sml;
+
+      reset();
+      sml::sm<chuck_sm> sm;
+
+      sm.process_event(event_unclamp{});
+      assert( sm.is("unclamping"_s) );
+      assert( door_env::valve[IN_CHUCK_OPEN] );
+
+      // The timeout fires, then the clamp is handled first
+      void *stale = door_env::arg[door_env::chuck_timer];
+      door_env::now = door_env::expiry[door_env::chuck_timer];
+      door_env::armed[door_env::chuck_timer] = false;
+
+      sm.process_event(event_clamp{});
+      assert( sm.is("clamping"_s) );
+
+      chuck_timeout(sm, stale);
+      assert( sm.is("clamping"_s) );
+      assert( door_env::armed[door_env::chuck_timer] );
+
+      // The timeout of the clamp still ends it
+      door_env::now = door_env::expiry[door_env::chuck_timer];
+      door_env::armed[door_env::chuck_timer] = false;
+      chuck_timeout(sm, door_env::arg[door_env::chuck_timer]);
+      assert( sm.is("clamped"_s) );
+      assert( ! door_env::valve[IN_CHUCK_OPEN] );
+   }
+}
+
+int main(int argc, char *argv[])
+{
+   std::vector<std::string> paths(argv + 1, argv + argc);
+   int failures = 0;
+
+   if ( paths.empty() )
+   {
+      paths = list_scenarios("scenarios");
+   }
+
+   for (auto &path : paths)
+   {
+      int failed = run_scenario(path.c_str());
+
+      printf("%-40s %s\n", path.c_str(), failed ? "FAILED" : "ok");
+      failures += failed;
+   }
+
+   std::mt19937 rng(1);
+
+   auto start = std::chrono::steady_clock::now();
+
+   for (int i=0; i<sequences; ++i)
+   {
+      run_random(rng);
+   }
+
+   auto stop = std::chrono::steady_clock::now();
+   double seconds = std::chrono::duration<double>(stop - start).count();
+
+   printf("Random: %d sequences of %d events, %.0f sequences per second\n",
+      sequences, steps, sequences / seconds);
+
+   for (int i=0; i<door_runs; ++i)
+   {
+      run_door(rng);
+   }
+
+   printf("Door: %d runs of %d moves\n", door_runs, door_cycles);
+
+   run_logger();
+   printf("Logger: the last %d transitions, oldest first\n", log_size);
+
+   run_chuck_stale_timeout();
+   printf("Chuck: a stale timeout is ignored\n");
+
+   return failures ? 1 : 0;
+}
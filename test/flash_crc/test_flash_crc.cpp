@@ -0,0 +1,182 @@
+/*
+ * Test of the flash self-test
+ * The image is built as srec_cat does: filled with 0xFF, with the CRC-16 of
+ *  all that comes before stored big endian at CRC_AT.
+ * The idle task is driven as the reactor would, with a clock moved by hand,
+ *  to check each pass, the time between passes, the detection of a single
+ *  bit flip, and the cost of a step.
+ */
+#include <stdio.h>
+#include <assert.h>
+
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "crc.h"
+#include "alert.h"
+#include "reactor.h"
+#include "timer.h"
+#include "flash_crc.h"
+
+/*
+ * Host stand-ins of the flash, the reactor, the timer and the alert
+ */
+const uint8_t *flash_crc_posix_image = nullptr;
+uint16_t flash_crc_posix_crc_at = 0;
+
+namespace
+{
+   reactor_idle_task_t idle_task = nullptr;
+   timer_count_t now = 0;
+   int alerts = 0;
+}
+
+extern "C" void reactor_set_idle_task(reactor_idle_task_t task) { idle_task = task; }
+extern "C" timer_count_t timer_get_count(void) { return now; }
+extern "C" timer_count_t timer_time_lapsed_since(timer_count_t count) { return now - count; }
+extern "C" void alert_record(bool, int, const char *) { ++alerts; }
+
+namespace
+{
+   /** Size of the flash of the controller */
+   constexpr uint16_t crc_at = 0x3FFE;
+
+   /** The program, then erased flash, then the CRC */
+   std::vector<uint8_t> make_image(std::mt19937 &rng)
+   {
+      std::vector<uint8_t> image(crc_at + 2, 0xFF);
+
+      for (uint16_t i=0; i<crc_at/2; ++i)
+      {
+         image[i] = rng();
+      }
+
+      uint16_t crc = crc16(image.data(), crc_at, CRC16_INIT);
+      image[crc_at] = crc >> 8;
+      image[crc_at + 1] = crc & 0xFF;
+
+      return image;
+   }
+
+   /** Run the idle task until it lets the reactor sleep. @return The steps */
+   uint32_t run_pass()
+   {
+      uint32_t steps = 0;
+
+      while ( idle_task() )
+      {
+         ++steps;
+      }
+
+      return steps + 1;
+   }
+
+   void test_known_value()
+   {
+      const uint8_t check[] = "123456789";
+
+      // CRC-16/CCITT-FALSE, as srec_cat -CRC16_Big_Endian -broken
+      assert( crc16(check, 9, CRC16_INIT) == 0x29B1 );
+
+      // Chaining blocks gives the same CRC
+      assert( crc16(check + 4, 5, crc16(check, 4, CRC16_INIT)) == 0x29B1 );
+   }
+
+   void test_passes()
+   {
+      std::mt19937 rng(1);
+      auto image = make_image(rng);
+
+      flash_crc_posix_image = image.data();
+      flash_crc_posix_crc_at = crc_at;
+      flash_crc_init();
+      assert( idle_task != nullptr );
+
+      // A pass when idle, in steps of FLASH_CRC_BLOCK bytes
+      uint32_t steps = run_pass();
+      assert( steps == (crc_at + 1) / 2 );
+      assert( flash_crc_passes() == 1 );
+      assert( ! flash_crc_failed() );
+      assert( alerts == 0 );
+
+      // Nothing more until the next pass is due
+      for (int i=0; i<9; ++i)
+      {
+         now += TIMER_SECONDS(1) - 1;
+         assert( ! idle_task() );
+         now += 1;
+      }
+
+      assert( flash_crc_passes() == 1 );
+
+      now += TIMER_SECONDS(1);
+      run_pass();
+      assert( flash_crc_passes() == 2 );
+      assert( alerts == 0 );
+
+      // A single bit flip is caught on the next pass
+      image[rng() % crc_at] ^= 1 << (rng() % 8);
+      now += TIMER_SECONDS(10);
+      run_pass();
+      assert( flash_crc_passes() == 3 );
+      assert( flash_crc_failed() );
+      assert( alerts == 1 );
+
+      printf("Pass: %u steps of the idle task for %u bytes\n", steps, crc_at);
+   }
+
+   void test_detection()
+   {
+      std::mt19937 rng(2);
+
+      for (int i=0; i<200; ++i)
+      {
+         auto image = make_image(rng);
+
+         // Up to 3 bit flips, anywhere including the CRC
+         for (int flips = 1 + rng() % 3; flips; --flips)
+         {
+            image[rng() % image.size()] ^= 1 << (rng() % 8);
+         }
+
+         flash_crc_posix_image = image.data();
+         alerts = 0;
+         flash_crc_init();
+         run_pass();
+
+         // Flips which cancel out leave the image intact
+         bool intact = (crc16(image.data(), crc_at, CRC16_INIT) ==
+            ((image[crc_at] << 8) | image[crc_at + 1]));
+
+         assert( flash_crc_failed() == ! intact );
+         assert( alerts == (intact ? 0 : 1) );
+      }
+   }
+
+   void test_step_cost()
+   {
+      std::mt19937 rng(3);
+      auto image = make_image(rng);
+
+      flash_crc_posix_image = image.data();
+      flash_crc_init();
+
+      using clock = std::chrono::steady_clock;
+      auto start = clock::now();
+      uint32_t steps = run_pass();
+      double ns = std::chrono::duration<double, std::nano>(clock::now() - start).count() / steps;
+
+      printf("Step: %.1f ns on the host\n", ns);
+   }
+}
+
+int main()
+{
+   test_known_value();
+   test_passes();
+   test_detection();
+   test_step_cost();
+
+   return 0;
+}
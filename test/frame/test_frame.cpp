@@ -0,0 +1,403 @@
+/*
+ * Fuzz and throughput test of the CRC-8 protected frames and the opcodes
+ * Prove the detection rate of corrupted frames and replies, and measure
+ *  the cost of building and checking a frame on the master and the slave.
+ */
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+
+#include <chrono>
+#include <random>
+
+#include "op_codes.h"
+#include "link_stats.h"
+
+namespace
+{
+   std::mt19937 rng(0x5eed);
+
+   const opcodes_cmd_t all_cmds[] = {
+      opcodes_cmd_idle,
+      opcodes_cmd_push_door,
+      opcodes_cmd_pull_door,
+      opcodes_cmd_blast_toolsetter,
+      opcodes_cmd_blast_spindle,
+      opcodes_cmd_unclamp_chuck,
+      opcodes_cmd_valves,
+      opcodes_cmd_query,
+      opcodes_cmd_pulse,
+   };
+
+   /** Payload for the commands which take one */
+   const uint8_t payload[OPCODES_MAX_PAYLOAD] = { opcodes_valve_chuck, 0, 0, 0 };
+
+   uint8_t random_byte()
+   {
+      return (uint8_t)rng();
+   }
+
+   /** Build a frame of any size with a random content and a valid CRC */
+   uint8_t random_frame(uint8_t *frame)
+   {
+      uint8_t size = 3 + rng() % (OPCODES_MAX_PAYLOAD + 1);
+
+      for (uint8_t i=0; i<size-1; ++i)
+      {
+         frame[i] = random_byte();
+      }
+
+      frame[size-1] = crc8(frame, size-1, CRC8_INIT);
+
+      return size;
+   }
+
+   /** Flip n distinct bits in the frame */
+   void flip_bits(uint8_t *frame, uint8_t size, int n)
+   {
+      uint64_t flipped = 0;
+
+      while (n)
+      {
+         int bit = rng() % (size * 8);
+
+         if ( ! (flipped & (1ull << bit)) )
+         {
+            flipped |= (1ull << bit);
+            frame[bit / 8] ^= (1 << (bit % 8));
+            --n;
+         }
+      }
+   }
+
+   /**
+    * Flip a burst of bits which starts and ends with a flipped bit
+    * Bits are numbered in the order they go on the wire (MSB first)
+    */
+   void flip_burst(uint8_t *frame, uint8_t size, int length)
+   {
+      int start = rng() % (size * 8 - length + 1);
+
+      for (int i=0; i<length; ++i)
+      {
+         bool flip = (i == 0) || (i == length - 1) || (rng() & 1);
+
+         if (flip)
+         {
+            frame[(start + i) / 8] ^= (0x80 >> ((start + i) % 8));
+         }
+      }
+   }
+
+   /** The validity bitmap must accept the commands and nothing else */
+   void test_cmd_valid()
+   {
+      for (int value=0; value<256; ++value)
+      {
+         bool is_cmd = false;
+
+         for (auto cmd : all_cmds)
+         {
+            is_cmd = is_cmd || (cmd == value);
+         }
+
+         assert( opcodes_check_cmd_valid(value) == (is_cmd ? value : opcodes_cmd_error) );
+      }
+   }
+
+   void test_known_value()
+   {
+      const uint8_t check[] = "123456789";
+
+      // CRC-8/AUTOSAR check is 0xDF, which has a final XOR of 0xFF
+      assert( crc8(check, 9, CRC8_INIT) == (0xDF ^ 0xFF) );
+   }
+
+   void test_round_trip()
+   {
+      for (auto cmd : all_cmds)
+      {
+         uint8_t frame[OPCODES_FRAME_MAX_SIZE];
+         uint8_t size = opcodes_encode_frame(frame, cmd, 7, payload);
+
+         assert( size == opcodes_frame_size(cmd) );
+         assert( size == opcodes_payload_length(cmd) + 3 );
+         assert( size == ((cmd == opcodes_cmd_valves || cmd == opcodes_cmd_query) ? 4 :
+                          (cmd == opcodes_cmd_pulse) ? OPCODES_FRAME_MAX_SIZE : 3) );
+         assert( opcodes_check_frame(frame, size) );
+
+         for (auto status : {opcodes_reply_off, opcodes_reply_on})
+         {
+            uint8_t reply[OPCODES_FRAME_MAX_SIZE];
+            uint8_t crc = opcodes_frame_crc(frame, size);
+
+            uint8_t ack = 0;
+
+            assert( opcodes_encode_reply(reply, status, 7, nullptr, 0, crc) == OPCODES_REPLY_SIZE );
+            assert( opcodes_decode_reply(reply, OPCODES_REPLY_SIZE, crc, &ack) == status );
+            assert( ack == 7 );
+         }
+      }
+
+      // Replies with a payload
+      for (uint8_t length=0; length<=OPCODES_MAX_PAYLOAD; ++length)
+      {
+         uint8_t data[OPCODES_MAX_PAYLOAD] = {1, 2, 3, 4};
+         uint8_t reply[OPCODES_FRAME_MAX_SIZE];
+
+         uint8_t size = opcodes_encode_reply(reply, opcodes_reply_on, 1, data, length, 0x42);
+         assert( size == length + 3 );
+         assert( opcodes_decode_reply(reply, size, 0x42, nullptr) == opcodes_reply_on );
+      }
+   }
+
+   /** Any 1, 2 or 3 bit error and any burst up to 8 bits must be detected */
+   void test_guaranteed_detection()
+   {
+      const int iterations = 200000;
+
+      for (int n=1; n<=3; ++n)
+      {
+         for (int i=0; i<iterations; ++i)
+         {
+            uint8_t frame[OPCODES_FRAME_MAX_SIZE];
+            uint8_t size = random_frame(frame);
+
+            flip_bits(frame, size, n);
+            assert( ! opcodes_check_frame(frame, size) );
+         }
+
+         printf("%d bit errors: %d/%d detected\n", n, iterations, iterations);
+      }
+
+      for (int length=1; length<=8; ++length)
+      {
+         for (int i=0; i<iterations; ++i)
+         {
+            uint8_t frame[OPCODES_FRAME_MAX_SIZE];
+            uint8_t size = random_frame(frame);
+
+            flip_burst(frame, size, length);
+            assert( ! opcodes_check_frame(frame, size) );
+         }
+      }
+
+      printf("Bursts of up to 8 bits: %d/%d detected\n", iterations * 8, iterations * 8);
+   }
+
+   /** Heavier corruption is detected with a probability of 255/256 */
+   void test_random_detection()
+   {
+      const int iterations = 1000000;
+      int detected = 0;
+
+      for (int i=0; i<iterations; ++i)
+      {
+         uint8_t frame[OPCODES_FRAME_MAX_SIZE];
+         uint8_t size = random_frame(frame);
+
+         flip_bits(frame, size, 4 + rng() % (size * 8 - 4));
+
+         if ( ! opcodes_check_frame(frame, size) )
+         {
+            ++detected;
+         }
+      }
+
+      double rate = (double)detected / iterations;
+      printf("Random errors: %d/%d detected (%.3f%%)\n", detected, iterations, rate * 100);
+
+      assert( rate > 0.99 );
+   }
+
+   /** A reply must never validate against another command */
+   void test_reply_binding()
+   {
+      for (auto sent : all_cmds)
+      {
+         uint8_t frame[OPCODES_FRAME_MAX_SIZE];
+         uint8_t size = opcodes_encode_frame(frame, sent, 1, payload);
+         uint8_t crc_sent = opcodes_frame_crc(frame, size);
+
+         for (auto answered : all_cmds)
+         {
+            if ( answered == sent )
+            {
+               continue;
+            }
+
+            size = opcodes_encode_frame(frame, answered, 1, payload);
+            uint8_t crc_answered = opcodes_frame_crc(frame, size);
+
+            for (auto status : {opcodes_reply_off, opcodes_reply_on})
+            {
+               uint8_t reply[OPCODES_FRAME_MAX_SIZE];
+               opcodes_encode_reply(reply, status, 1, nullptr, 0, crc_answered);
+
+               assert( opcodes_decode_reply(reply, OPCODES_REPLY_SIZE, crc_sent, nullptr) == opcodes_reply_error );
+            }
+         }
+      }
+
+      // Single bit errors in the reply are caught too
+      for (int i=0; i<100000; ++i)
+      {
+         uint8_t reply[OPCODES_FRAME_MAX_SIZE];
+         uint8_t crc = random_byte();
+
+         opcodes_encode_reply(reply, (rng() & 1) ? opcodes_reply_on : opcodes_reply_off, random_byte(), nullptr, 0, crc);
+         flip_bits(reply, OPCODES_REPLY_SIZE, 1);
+
+         assert( opcodes_decode_reply(reply, OPCODES_REPLY_SIZE, crc, nullptr) == opcodes_reply_error );
+      }
+   }
+
+   /** Sequence numbers roll over, skip the reset value, and compare within half the range */
+   void test_sequence()
+   {
+      uint8_t seq = OPCODES_SEQ_RESET;
+
+      for (int i=0; i<1000; ++i)
+      {
+         uint8_t next = opcodes_seq_next(seq);
+
+         assert( next != OPCODES_SEQ_RESET );
+         assert( opcodes_seq_is_older(seq, next) || seq == OPCODES_SEQ_RESET );
+         assert( ! opcodes_seq_is_older(next, seq) );
+         assert( ! opcodes_seq_is_older(next, next) );
+
+         seq = next;
+      }
+
+      assert( opcodes_seq_next(UINT8_MAX) == 1 );
+      assert( opcodes_seq_is_older(10, 20) );
+      assert( ! opcodes_seq_is_older(20, 10) );
+
+      // Across the roll over
+      assert( opcodes_seq_is_older(250, 5) );
+      assert( ! opcodes_seq_is_older(5, 250) );
+   }
+
+   /** A proposal of heartbeat is a query item which never reads as an item of the statistics */
+   void test_heartbeat_item()
+   {
+      for (uint16_t ms=0; ms<=1260; ms+=OPCODES_HEARTBEAT_UNIT_MS)
+      {
+         uint8_t item = OPCODES_QUERY_HEARTBEAT_ITEM(ms);
+
+         assert( item & OPCODES_QUERY_HEARTBEAT );
+         assert( item >= LINK_STATS_ITEMS );
+         assert( (item & ~OPCODES_QUERY_HEARTBEAT) * OPCODES_HEARTBEAT_UNIT_MS == ms );
+      }
+
+      assert( OPCODES_QUERY_HEARTBEAT_ITEM(OPCODES_HEARTBEAT_DEFAULT_MS) == 0x80 + 50 );
+   }
+
+   /** Statistics saturate, bin by log2, and are read back item by item */
+   void test_link_stats()
+   {
+      link_stats_t stats = {};
+      link_stats_t copy = {};
+
+      assert( link_stats_bin(0) == 0 );
+      assert( link_stats_bin(1) == 0 );
+      assert( link_stats_bin(2) == 1 );
+      assert( link_stats_bin(570) == 9 );
+      assert( link_stats_bin(UINT16_MAX) == LINK_STATS_BINS - 1 );
+
+      for (int i=0; i<70000; ++i)
+      {
+         link_stats_count(&stats, link_stats_nack);
+      }
+
+      assert( stats.counters[link_stats_nack] == UINT16_MAX );
+
+      link_stats_record(&stats, 570);
+      link_stats_record(&stats, 1000);
+      assert( stats.histogram[9] == 2 );
+
+      // Query each item as the controller does, and rebuild a copy
+      for (uint8_t item=0; item<LINK_STATS_ITEMS; ++item)
+      {
+         uint8_t frame[OPCODES_FRAME_MAX_SIZE];
+         uint8_t size = opcodes_encode_frame(frame, opcodes_cmd_query, 1, &item);
+         uint8_t crc = opcodes_frame_crc(frame, size);
+
+         assert( opcodes_check_frame(frame, size) );
+
+         uint16_t value = link_stats_get_item(&stats, frame[2]);
+         uint8_t data[2] = { (uint8_t)value, (uint8_t)(value >> 8) };
+         uint8_t reply[OPCODES_FRAME_MAX_SIZE];
+
+         assert( opcodes_encode_reply(reply, opcodes_reply_on, 1, data, 2, crc) == OPCODES_QUERY_REPLY_SIZE );
+         assert( opcodes_decode_reply(reply, OPCODES_QUERY_REPLY_SIZE, crc, nullptr) == opcodes_reply_on );
+
+         link_stats_set_item(&copy, item, reply[2] | (uint16_t)reply[3] << 8);
+      }
+
+      assert( memcmp(&stats, &copy, sizeof(stats)) == 0 );
+      assert( link_stats_get_item(&stats, LINK_STATS_ITEMS) == 0 );
+
+      link_stats_dump("Test", "us", &copy);
+   }
+
+   /** Time spent per frame by the master and the slave */
+   void test_throughput()
+   {
+      using clock = std::chrono::steady_clock;
+      const int iterations = 5000000;
+      volatile uint8_t sink = 0;
+
+      // Master: build the command and check the reply
+      auto start = clock::now();
+
+      for (int i=0; i<iterations; ++i)
+      {
+         uint8_t frame[OPCODES_FRAME_MAX_SIZE];
+         uint8_t reply[OPCODES_REPLY_SIZE] = { opcodes_reply_on, 1, (uint8_t)i };
+
+         uint8_t size = opcodes_encode_frame(frame, all_cmds[i & 7], (uint8_t)i, payload);
+         sink = sink + opcodes_decode_reply(reply, OPCODES_REPLY_SIZE, opcodes_frame_crc(frame, size), nullptr);
+      }
+
+      double master_ns = std::chrono::duration<double, std::nano>(clock::now() - start).count() / iterations;
+
+      // Slave: check the command and build the reply
+      start = clock::now();
+
+      for (int i=0; i<iterations; ++i)
+      {
+         uint8_t frame[OPCODES_FRAME_MAX_SIZE] = { (uint8_t)all_cmds[i & 7], 1, (uint8_t)i };
+         uint8_t reply[OPCODES_REPLY_SIZE];
+
+         if ( opcodes_check_frame(frame, 3) )
+         {
+            ++sink;
+         }
+
+         opcodes_encode_reply(reply, opcodes_reply_on, frame[1], nullptr, 0, frame[2]);
+         sink = sink + reply[2];
+      }
+
+      double slave_ns = std::chrono::duration<double, std::nano>(clock::now() - start).count() / iterations;
+
+      printf("Master: %.1f ns per frame (encode + decode reply)\n", master_ns);
+      printf("Slave: %.1f ns per frame (check + encode reply)\n", slave_ns);
+   }
+}
+
+int main()
+{
+   test_cmd_valid();
+   test_known_value();
+   test_round_trip();
+   test_guaranteed_detection();
+   test_random_detection();
+   test_reply_binding();
+   test_sequence();
+   test_heartbeat_item();
+   test_link_stats();
+   test_throughput();
+
+   return 0;
+}
@@ -0,0 +1,80 @@
+/*
+ * Test of the compile-time pins
+ * The ports are plain memory, so each write to the set, clear and toggle
+ *  registers is seen as is: a group must write each of its ports once, with
+ *  the mask of all of its pins on that port.
+ */
+#include <assert.h>
+#include <string.h>
+
+#include "io_pin.hpp"
+
+uint8_t ioport_posix_ports[(IOPORT_PORTC + 1) * IOPORT_PORT_OFFSET];
+
+namespace
+{
+   constexpr ioport_pin_t PA1 = IOPORT_CREATE_PIN(PORTA, 1);
+   constexpr ioport_pin_t PA6 = IOPORT_CREATE_PIN(PORTA, 6);
+   constexpr ioport_pin_t PB3 = IOPORT_CREATE_PIN(PORTB, 3);
+   constexpr ioport_pin_t PC0 = IOPORT_CREATE_PIN(PORTC, 0);
+
+   static_assert(io_pin<PB3>::port == IOPORT_PORTB);
+   static_assert(io_pin<PB3>::mask == 0x08);
+   static_assert(io_pins<PA1, PA6, PB3>::mask_of<IOPORT_PORTA> == 0x42);
+   static_assert(io_pins<PA1, PA6, PB3>::mask_of<IOPORT_PORTB> == 0x08);
+   static_assert(io_pins<PA1, PA6, PB3>::mask_of<IOPORT_PORTC> == 0x00);
+
+   void reset()
+   {
+      memset(ioport_posix_ports, 0, sizeof(ioport_posix_ports));
+   }
+
+   void test_pin()
+   {
+      reset();
+
+      io_pin<PA6>::set();
+      assert( PORTA.OUTSET == 0x40 );
+
+      io_pin<PA6>::set(false);
+      assert( PORTA.OUTCLR == 0x40 );
+
+      io_pin<PB3>::toggle();
+      assert( PORTB.OUTTGL == 0x08 );
+
+      io_pin<PC0>::set_output();
+      assert( PORTC.DIRSET == 0x01 );
+
+      PORTB.IN = 0x08;
+      assert( io_pin<PB3>::get() );
+      assert( ! io_pin<PA1>::get() );
+   }
+
+   void test_group()
+   {
+      reset();
+
+      // One write per port, with all the pins of the port
+      io_pins<PA1, PB3, PA6>::set();
+      assert( PORTA.OUTSET == 0x42 );
+      assert( PORTB.OUTSET == 0x08 );
+      assert( PORTC.OUTSET == 0x00 );
+
+      io_pins<PA1, PB3, PA6>::clear();
+      assert( PORTA.OUTCLR == 0x42 );
+      assert( PORTB.OUTCLR == 0x08 );
+
+      // The ports without pins in the group are not touched
+      PORTC.OUTCLR = 0xAA;
+      io_pins<PA1, PB3>::set(false);
+      assert( PORTC.OUTCLR == 0xAA );
+   }
+}
+
+int main()
+{
+   test_pin();
+   test_group();
+
+   return 0;
+}
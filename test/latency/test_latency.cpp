@@ -0,0 +1,372 @@
+/*
+ * Latency from the inputs of Masso to the valves of the hub
+ * Runs the co-simulation (see test/cosim) with the input path of the
+ *  controller: the sampled digital inputs (asx/src/digital_input.c, 5ms
+ *  sampler and DI_FILT4 integrator), the door and chuck state machines,
+ *  and the selection of the command of main.cpp.
+ * Each input is toggled at a random time, and the time until the valve of
+ *  the hub changes is measured, with both boards under increasing
+ *  background load. The percentiles are the baseline of any optimisation.
+ * With TRACE (make TRACE=1), the last events are written to
+ *  test_latency.trace, to be converted by make/trace.py.
+ */
+#include <stdio.h>
+#include <assert.h>
+
+#include <algorithm>
+
+#include "cpp.h"
+#include "cosim.hpp"
+#include "digital_input.h"
+
+/*
+ * Inputs of the controller, as controller/conf/conf_board.h, which cannot be
+ *  included with the one of the hub
+ */
+#define IN_CHUCK_OPEN IOPORT_CREATE_PIN(PORTA, 4)
+#define IN_SPINDLE_AIR_BLAST IOPORT_CREATE_PIN(PORTA, 5)
+#define IN_TOOLSET_AIR_BLAST IOPORT_CREATE_PIN(PORTA, 6)
+#define IN_DOOR_OPEN_CLOSE IOPORT_CREATE_PIN(PORTB, 5)
+#define IN_DOOR_UP IOPORT_CREATE_PIN(PORTA, 3)
+#define IN_DOOR_DOWN IOPORT_CREATE_PIN(PORTB, 3)
+
+/*
+ * The parts of main.cpp used by the state machines
+ */
+static void on_input_change(void *arg);
+static void set_output_status(ioport_pin_t pin, bool state);
+
+namespace
+{
+   /** As in main.cpp */
+   constexpr auto DI_FILT4 = TIMER_MILLISECONDS(40);
+
+   typedef struct
+   {
+      ioport_pin_t pin;
+      opcodes_cmd_t opcode;
+      bool state;
+   } output_status_t;
+
+   output_status_t output_statuses[] = {
+      {IN_CHUCK_OPEN,        opcodes_cmd_unclamp_chuck,    false},
+      {IN_SPINDLE_AIR_BLAST, opcodes_cmd_blast_spindle,    false},
+      {IN_TOOLSET_AIR_BLAST, opcodes_cmd_blast_toolsetter, false},
+      {IN_DOOR_UP,           opcodes_cmd_pull_door,        false}, // Fake input
+      {IN_DOOR_DOWN,         opcodes_cmd_push_door,        false}, // Fake input
+   };
+
+   reactor_handle_t react_input_change, react_door_sensor, react_door_cmd;
+   reactor_handle_t react_cmd_timeout, react_chuck_timeout;
+
+   /** The LEDs and the output to Masso are not measured */
+   typedef bool *digital_output_t;
+
+   inline void digitial_output_set(digital_output_t, bool) {}
+   inline void digitial_output_start(digital_output_t, timer_count_t, const char *, bool) {}
+
+   digital_output_t led_door_opening = nullptr;
+   digital_output_t led_door_closing = nullptr;
+   digital_output_t led_chuck = nullptr;
+   digital_output_t chuck_released_oc = nullptr;
+}
+
+#include "state_machine.hpp"
+
+sml::sm<door_sm, door_sm_dispatch> door_sm;
+sml::sm<chuck_sm> chuck_sm;
+
+/** Only the command of highest priority is sent (single valve mode) */
+static void refresh_opcode(void)
+{
+   opcodes_cmd_t cmd = opcodes_cmd_idle;
+
+   for (auto &output : output_statuses)
+   {
+      if ( output.state )
+      {
+         cmd = output.opcode;
+         break;
+      }
+   }
+
+   if ( cmd != cosim::ctrl::command )
+   {
+      cosim::ctrl::request(cmd);
+   }
+}
+
+static void set_output_status(ioport_pin_t pin, bool state)
+{
+   for (auto &output : output_statuses)
+   {
+      if ( output.pin == pin )
+      {
+         output.state = state;
+         refresh_opcode();
+         break;
+      }
+   }
+}
+
+static void on_input_change(void *arg)
+{
+   pin_and_value_t pav {.as_arg = arg};
+
+   if ( pav.pin == IN_CHUCK_OPEN )
+   {
+      if ( pav.value )
+      {
+         chuck_sm.process_event(event_unclamp{});
+      }
+      else
+      {
+         chuck_sm.process_event(event_clamp{});
+      }
+
+      return;
+   }
+
+   set_output_status(pav.pin, pav.value);
+}
+
+static void on_door_cmd(void *arg)
+{
+   pin_and_value_t pav {.as_arg = arg};
+
+   if ( pav.value )
+   {
+      door_sm.process_event(event_open{});
+   }
+   else
+   {
+      door_sm.process_event(event_close{});
+   }
+}
+
+static void on_door_sensor_change(void *arg)
+{
+   pin_and_value_t pav {.as_arg = arg};
+
+   if ( pav.pin == IN_DOOR_DOWN )
+   {
+      if ( pav.value )
+      {
+         door_sm.process_event(event_door_is_down{});
+      }
+      else
+      {
+         door_sm.process_event(event_door_moving_up{});
+      }
+   }
+   else if ( pav.pin == IN_DOOR_UP )
+   {
+      if ( pav.value )
+      {
+         door_sm.process_event(event_door_is_up{});
+      }
+      else
+      {
+         door_sm.process_event(event_door_moving_down{});
+      }
+   }
+}
+
+static void on_cmd_timeout(void *)
+{
+   door_sm.process_event(event_timeout{});
+}
+
+static void on_chuck_timeout(void *arg)
+{
+   if ( chuck::timeout_is_current(arg) )
+   {
+      chuck_sm.process_event(event_chuck_timeout{});
+   }
+}
+
+namespace
+{
+   /** Toggles of each input per load */
+   constexpr int toggles = 100;
+
+   /** Background load of each board (us of every ms) */
+   const uint32_t loads[] = { 0, 250, 500, 900 };
+
+   /** Cost of the other handlers (us) */
+   constexpr uint32_t handler_us = 20;
+
+   reactor_handle_t react_load[cosim::sides];
+
+   /** The load runs at the lowest priority, but cannot be preempted */
+   void on_load(void *) {}
+
+   /** Set an input of the controller, as seen by the sampler */
+   void set_input(ioport_pin_t pin, bool level)
+   {
+      PORT_t *port = cosim::port(ioport_pin_to_port_id(pin));
+
+      if ( level )
+      {
+         port->IN |= ioport_pin_to_mask(pin);
+      }
+      else
+      {
+         port->IN &= ~ioport_pin_to_mask(pin);
+      }
+   }
+
+   /** @return The time (us) until the valves of the hub change */
+   uint32_t measure(ioport_pin_t pin, bool level)
+   {
+      uint8_t before = cosim::valves;
+
+      // Any phase of the sampler and the heartbeat
+      cosim::run_for(cosim::rng() % 10000);
+
+      uint64_t start = cosim::now;
+      set_input(pin, level);
+
+      while ( cosim::valves == before )
+      {
+         cosim::run_for(100);
+         assert( cosim::now - start < 1000000 );
+      }
+
+      return cosim::now - start;
+   }
+
+   struct path_t
+   {
+      const char *name;
+      std::vector<uint32_t> latencies;
+   };
+
+   path_t paths[] = { {"door open"}, {"door close"}, {"unclamp"}, {"clamp"} };
+
+   void report(uint32_t load)
+   {
+      printf("Load %3u%%\n", load / 10);
+
+      for (auto &path : paths)
+      {
+         auto &l = path.latencies;
+         std::sort(l.begin(), l.end());
+
+         auto at = [&](unsigned percent) { return l[(l.size() - 1) * percent / 100] / 1000.0; };
+
+         printf("  %-10s min %6.2f  p50 %6.2f  p90 %6.2f  p99 %6.2f  max %6.2f ms\n",
+            path.name, l.front() / 1000.0, at(50), at(90), at(99), l.back() / 1000.0);
+
+         // Never faster than the filter
+         assert( l.front() >= TIMER_MILLISECONDS(35) * 1000 );
+
+         l.clear();
+      }
+   }
+
+   void run(uint32_t load)
+   {
+      using namespace sml;
+
+      for (int s=0; s<cosim::sides; ++s)
+      {
+         cosim::handler_cost(react_load[s], load);
+      }
+
+      for (int i=0; i<toggles; ++i)
+      {
+         // The door opens, takes its time, then closes
+         paths[0].latencies.push_back(measure(IN_DOOR_OPEN_CLOSE, true));
+         cosim::run_for(300000);
+         set_input(IN_DOOR_DOWN, false);
+         cosim::run_for(1500000);
+         set_input(IN_DOOR_UP, true);
+         cosim::run_for(100000);
+         assert( cosim::valves == 0 );
+
+         paths[1].latencies.push_back(measure(IN_DOOR_OPEN_CLOSE, false));
+         cosim::run_for(300000);
+         set_input(IN_DOOR_UP, false);
+         cosim::run_for(1500000);
+         set_input(IN_DOOR_DOWN, true);
+         cosim::run_for(100000);
+         assert( cosim::valves == 0 );
+
+         // The chuck waits for the pressure before it is clamped again
+         paths[2].latencies.push_back(measure(IN_CHUCK_OPEN, true));
+         cosim::run_for(500000);
+         assert( chuck_sm.is("released"_s) );
+         paths[3].latencies.push_back(measure(IN_CHUCK_OPEN, false));
+         cosim::run_for(500000);
+      }
+
+      report(load);
+   }
+}
+
+int main()
+{
+   cosim::handler_us[cosim::controller] = handler_us;
+   cosim::handler_us[cosim::hub] = handler_us;
+   cosim::ctrl::on_pressure = [](bool on) {
+      if ( on )
+      {
+         chuck_sm.process_event(event_pressure_on{});
+      }
+      else
+      {
+         chuck_sm.process_event(event_pressure_off{});
+      }
+   };
+
+   cosim::side = cosim::controller;
+
+   auto input = [](ioport_pin_t p, reactor_handle_t h) {
+      return digital_input(p, h, IOPORT_SENSE_DISABLE, DI_FILT4);
+   };
+
+   react_input_change = reactor_register(on_input_change, reactor_prio_medium, 1);
+   react_door_sensor = reactor_register(on_door_sensor_change, reactor_prio_medium, 1);
+   react_door_cmd = reactor_register(on_door_cmd, reactor_prio_medium, 1);
+   react_cmd_timeout = reactor_register(on_cmd_timeout, reactor_prio_low, 1);
+   react_chuck_timeout = reactor_register(on_chuck_timeout, reactor_prio_low, 1);
+
+   input(IN_DOOR_UP,           react_door_sensor );
+   input(IN_DOOR_DOWN,         react_door_sensor );
+   input(IN_CHUCK_OPEN,        react_input_change);
+   input(IN_SPINDLE_AIR_BLAST, react_input_change);
+   input(IN_TOOLSET_AIR_BLAST, react_input_change);
+   input(IN_DOOR_OPEN_CLOSE,   react_door_cmd    );
+
+   digital_input_init();
+   cosim::start();
+
+   // A background load on each board, every ms
+   for (int s=0; s<cosim::sides; ++s)
+   {
+      cosim::side = cosim::side_t(s);
+      react_load[s] = reactor_register(on_load, reactor_prio_idle, 1);
+      timer_arm(react_load[s], timer_get_count_from_now(1), 1, 0);
+   }
+
+   // The door starts closed
+   set_input(IN_DOOR_DOWN, true);
+   cosim::run_for(1000000);
+
+   using namespace sml;
+   assert( door_sm.is("closed"_s) );
+
+   for (auto load : loads)
+   {
+      run(load);
+   }
+
+#ifdef TRACE
+   // The last events, for make/trace.py
+   bool dumped = trace_posix_dump("test_latency.trace");
+   assert( dumped );
+#endif
+
+   return 0;
+}
@@ -0,0 +1,69 @@
+/*
+ * Cost of the dispatch policies of the Boost SML on the door state machine
+ * Drive the door through open and close cycles, with an unexpected event at
+ *  each step, and report the time of process_event for each policy.
+ * All policies must end up in the same state with the same valve changes.
+ * The flash used by each policy on the AVR is given by 'make dispatch_sizes'
+ *  in the controller.
+ */
+#include <stdio.h>
+#include <assert.h>
+
+#include <chrono>
+
+#include "door_env.hpp"
+#include "state_machine.hpp"
+
+namespace
+{
+   constexpr int cycles = 200000;
+
+   /** Events per cycle */
+   constexpr int events = 12;
+
+   template <class TPolicy>
+   void bench(const char *name)
+   {
+      sml::sm<door_sm, sml::dispatch<TPolicy>> sm;
+
+      door_env::valve_changes = 0;
+      sm.process_event(event_door_is_down{});
+
+      auto start = std::chrono::steady_clock::now();
+
+      for (int i=0; i<cycles; ++i)
+      {
+         sm.process_event(event_open{});
+         sm.process_event(event_close{});            // Not expected
+         sm.process_event(event_door_moving_up{});
+         sm.process_event(event_door_is_down{});     // Not expected
+         sm.process_event(event_door_is_up{});
+         sm.process_event(event_timeout{});          // Not expected
+         sm.process_event(event_close{});
+         sm.process_event(event_open{});             // Not expected
+         sm.process_event(event_door_moving_down{});
+         sm.process_event(event_door_is_up{});       // Not expected
+         sm.process_event(event_door_is_down{});
+         sm.process_event(event_timeout{});          // Not expected
+      }
+
+      auto stop = std::chrono::steady_clock::now();
+      double ns = std::chrono::duration<double, std::nano>(stop - start).count() / (cycles * events);
+
+      using namespace sml;
+      assert( sm.is("closed"_s) );
+      assert( door_env::valve_changes == 4 * cycles );
+
+      printf("%-10s %6.1f ns per event\n", name, ns);
+   }
+}
+
+int main()
+{
+   bench<sml::back::policies::jump_table>("jump_table");
+   bench<sml::back::policies::branch_stm>("branch_stm");
+   bench<sml::back::policies::switch_stm>("switch_stm");
+   bench<sml::back::policies::fold_expr>("fold_expr");
+
+   return 0;
+}
@@ -0,0 +1,188 @@
+/*
+ * Test of the sampled inputs around a standby
+ * The timer and the reactor are stubs: the sampler is run by the test, and
+ *  the ports are plain memory as in the co-simulation.
+ * - No standby whilst an input is being integrated
+ * - In standby, the sampler is stopped and the sampled pins sense both edges
+ * - The edges of the sampled pins only wake up the CPU, the direct inputs
+ *   are handled as before
+ * - Once awake, the sampler runs again right away
+ */
+#include <assert.h>
+#include <string.h>
+
+#include <vector>
+
+#include "digital_input.h"
+
+uint8_t cosim_sreg;
+uint8_t ioport_posix_ports[(IOPORT_PORTC + 1) * IOPORT_PORT_OFFSET];
+
+extern "C" void PORTA_PORT_vect(void);
+
+namespace
+{
+   constexpr ioport_pin_t PA4 = IOPORT_CREATE_PIN(PORTA, 4);
+   constexpr ioport_pin_t PA6 = IOPORT_CREATE_PIN(PORTA, 6);
+   constexpr ioport_pin_t PB3 = IOPORT_CREATE_PIN(PORTB, 3);
+
+   /** As DIGITAL_INPUT_SAMPLE_PERIOD */
+   constexpr timer_count_t period = TIMER_MILLISECONDS(5);
+
+   /** Registered handlers, in order: sample, direct, acknowledge, then the test */
+   std::vector<reactor_handler_t> handlers;
+   enum { react_sample, react_direct };
+
+   /** Notifications of each handler */
+   std::vector<std::vector<void *>> notified;
+
+   /** The armed timers */
+   struct armed_t
+   {
+      timer_instance_t instance;
+      reactor_handle_t reactor;
+      timer_count_t count;
+      timer_count_t repeat;
+   };
+
+   std::vector<armed_t> timers;
+   timer_instance_t next_instance = 0;
+   timer_count_t now = 0;
+
+   bool sampler_armed()
+   {
+      for (auto &timer : timers)
+      {
+         if ( timer.reactor == react_sample )
+         {
+            return timer.count == now && timer.repeat == period;
+         }
+      }
+
+      return false;
+   }
+
+   uint8_t sense_of(ioport_pin_t pin)
+   {
+      PORT_t *port = (PORT_t *)&ioport_posix_ports[ioport_pin_to_port_id(pin) * IOPORT_PORT_OFFSET];
+
+      return (&port->PIN0CTRL)[ioport_pin_to_index(pin)] & PORT_ISC_gm;
+   }
+
+   void sample()
+   {
+      handlers[react_sample](nullptr);
+   }
+}
+
+extern "C"
+{
+   reactor_handle_t reactor_register(const reactor_handler_t handler, reactor_priorities_t, uint8_t)
+   {
+      handlers.push_back(handler);
+      notified.emplace_back();
+
+      return (reactor_handle_t)(handlers.size() - 1);
+   }
+
+   void reactor_notify(reactor_handle_t handle, void *data)
+   {
+      notified.at(handle).push_back(data);
+   }
+
+   timer_count_t timer_get_count_from_now(timer_count_t count) { return now + count; }
+
+   timer_instance_t timer_arm(reactor_handle_t reactor, timer_count_t count, timer_count_t repeat, void *)
+   {
+      timers.push_back({ next_instance, reactor, count, repeat });
+
+      return next_instance++;
+   }
+
+   bool timer_cancel(timer_instance_t instance)
+   {
+      for (auto it=timers.begin(); it!=timers.end(); ++it)
+      {
+         if ( it->instance == instance )
+         {
+            timers.erase(it);
+            return true;
+         }
+      }
+
+      return false;
+   }
+
+   void alert_record(bool, int, const char *) { assert( false ); }
+}
+
+int main()
+{
+   // 4 samples to change
+   constexpr timer_count_t filter = 4 * period;
+
+   reactor_handle_t react_change = 3;
+   digital_input(PA4, react_change, IOPORT_SENSE_DISABLE, filter);
+   digital_input(PB3, react_change, IOPORT_SENSE_DISABLE, filter);
+   digital_input(PA6, react_change, IOPORT_SENSE_RISING, 0);
+
+   digital_input_init();
+   handlers.push_back(nullptr);
+   notified.emplace_back();
+
+   assert( sampler_armed() );
+
+   // Mid-integration, the sampler must keep going
+   PORTA.IN = 0x10;
+   sample();
+   assert( ! digital_input_suspend() );
+   assert( sampler_armed() );
+   assert( sense_of(PA4) == 0 );
+
+   sample();
+   sample();
+   sample();
+   assert( notified[react_change].size() == 1 );
+
+   // Both inputs at rest, one on and one off
+   assert( digital_input_suspend() );
+   assert( timers.empty() );
+   assert( sense_of(PA4) == PORT_ISC_BOTHEDGES_gc );
+   assert( sense_of(PB3) == PORT_ISC_BOTHEDGES_gc );
+   assert( sense_of(PA6) == IOPORT_SENSE_RISING );
+
+   // An edge of a sampled pin and of the direct pin at once
+   PORTA.IN = 0x40;
+   PORTA.INTFLAGS = 0x50;
+   PORTA_PORT_vect();
+
+   assert( notified[react_direct].size() == 1 );
+   pin_and_value_t pav = { .as_arg = notified[react_direct][0] };
+   assert( pav.pin == PA6 );
+
+   // Awake, some time later
+   now = 1234;
+   PORTA.INTFLAGS = 0;
+   digital_input_resume();
+
+   assert( sampler_armed() );
+   assert( sense_of(PA4) == 0 );
+   assert( sense_of(PB3) == 0 );
+   assert( PORTA.INTFLAGS == 0x10 );
+   assert( PORTB.INTFLAGS == 0x08 );
+
+   // The change seen in standby is sampled as usual
+   for (int i=0; i<4; ++i)
+   {
+      sample();
+   }
+
+   assert( notified[react_change].size() == 2 );
+   pav.as_arg = notified[react_change][1];
+   assert( pav.pin == PA4 && ! pav.value );
+
+   // Nothing else, the sampled edges never reached the direct handler
+   assert( notified[react_direct].size() == 1 );
+
+   return 0;
+}
@@ -0,0 +1,145 @@
+/*
+ * Test of the trace
+ * The records are read back from the file of trace_posix_dump, which is the
+ *  stream of TRACE_PIN: the sync byte, then the event, the id and the time
+ *  (us, little endian).
+ * Checks the time stamps across the wrap of timer_get_us and with the tick
+ *  pending, the records dropped once the buffer is full, and that a dump
+ *  keeps the records.
+ */
+#include <stdio.h>
+#include <assert.h>
+
+#include <vector>
+
+#include "timer.h"
+#include "trace.h"
+
+uint8_t cosim_sreg;
+
+/*
+ * Host stand-ins of the timer
+ */
+namespace
+{
+   uint64_t now = 0;
+
+   /** The tick is pending, so timer_get_us is 1ms ahead of the count */
+   bool tick_pending = false;
+}
+
+extern "C" timer_count_t timer_get_count(void) { return now / 1000; }
+extern "C" uint16_t timer_get_us(void) { return (uint16_t)(now + (tick_pending ? 1000 : 0)); }
+
+namespace
+{
+   /** As TRACE_SIZE of the Makefile */
+   constexpr unsigned size = 8;
+
+   const char *const path = "test_trace.bin";
+
+   std::vector<trace_record_t> dump()
+   {
+      std::vector<trace_record_t> records;
+
+      bool dumped = trace_posix_dump(path);
+      assert( dumped );
+
+      FILE *file = fopen(path, "rb");
+      assert( file );
+
+      int sync;
+
+      while ( (sync = fgetc(file)) != EOF )
+      {
+         uint8_t bytes[6];
+
+         size_t read = fread(bytes, 1, sizeof(bytes), file);
+
+         assert( sync == TRACE_SYNC );
+         assert( read == sizeof(bytes) );
+
+         trace_record_t record;
+         record.event = bytes[0];
+         record.id = bytes[1];
+         record.us = bytes[2] | (bytes[3] << 8) | (bytes[4] << 16) | ((uint32_t)bytes[5] << 24);
+
+         records.push_back(record);
+      }
+
+      fclose(file);
+      remove(path);
+
+      return records;
+   }
+
+   void test_time()
+   {
+      // Across the wrap of the 16 bits us and on the ms boundary
+      const uint64_t times[] = { 0, 999, 1000, 65535, 65536, 70000123, 4000000000ull };
+
+      for (auto t : times)
+      {
+         now = t;
+         trace_record(trace_notify, 1);
+      }
+
+      // The tick is pending, the us are 1ms ahead
+      now = 5000250;
+      tick_pending = true;
+      trace_record(trace_timer_fire, 2);
+      tick_pending = false;
+
+      auto records = dump();
+      assert( records.size() == 8 );
+
+      for (unsigned i=0; i<7; ++i)
+      {
+         assert( records[i].event == trace_notify );
+         assert( records[i].id == 1 );
+         assert( records[i].us == (uint32_t)times[i] );
+      }
+
+      assert( records[7].event == trace_timer_fire );
+      assert( records[7].us == 5001250 );
+
+      // The dump keeps the records
+      assert( dump().size() == size );
+   }
+
+   void test_lost()
+   {
+      // 8 records held already, then 20 more
+      for (uint8_t i=0; i<20; ++i)
+      {
+         now += 10;
+         trace_record(trace_pin_edge, TRACE_ID_OF_PIN(i, i & 1));
+      }
+
+      auto records = dump();
+      assert( records.size() == size + 1 );
+
+      // The number dropped, time stamped as the oldest record left
+      assert( records[0].event == trace_lost );
+      assert( records[0].id == 20 );
+      assert( records[0].us == records[1].us );
+
+      for (unsigned i=1; i<=size; ++i)
+      {
+         uint8_t pin = 12 + (i - 1);
+
+         assert( records[i].event == trace_pin_edge );
+         assert( records[i].id == ((pin & 1) ? (pin | 0x80) : pin) );
+      }
+
+      printf("%u records dropped, last at %u us\n", records[0].id, (unsigned)records[size].us);
+   }
+}
+
+int main()
+{
+   test_time();
+   test_lost();
+
+   return 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * Timing model of the TWI bus between the controller and the hub
+ * Report the actual bus frequency and the duration of each frame for the
+ *  standard mode, fast mode and fast mode plus profiles.
+ */
+#include <stdio.h>
+#include <assert.h>
+
+#include "twi_timing.h"
+#include "op_codes.h"
+
+namespace
+{
+   /** Both boards run from the 20MHz internal oscillator */
+   constexpr uint32_t f_cpu = 20000000;
+
+   /** Lowest baud value allowed at 20MHz (see twim_calc_baud) */
+   constexpr int16_t baud_limit = 2;
+
+   struct profile_t
+   {
+      const char *name;
+      uint32_t f_scl;
+   };
+
+   const profile_t profiles[] = {
+      {"SM  100kHz", 100000},
+      {"FM  400kHz", TWI_FM_MAX_FREQUENCY},
+      {"FM+ 1MHz",   TWI_FMP_FREQUENCY},
+   };
+
+   /** Duration of a command and its reply for the given profile */
+   uint32_t frame_ns(uint32_t f_scl, opcodes_cmd_t cmd)
+   {
+      uint16_t t_rise = twi_timing_rise_time(f_scl);
+      int16_t baud = twi_timing_baud(f_cpu, f_scl, t_rise);
+
+      assert( baud >= baud_limit && baud <= 255 );
+
+      uint32_t actual = twi_timing_frequency(f_cpu, (uint8_t)baud, t_rise);
+
+      return twi_timing_transaction_ns(actual, opcodes_frame_size(cmd), OPCODES_REPLY_SIZE);
+   }
+}
+
+int main()
+{
+   printf("Profile     BAUD  Actual   Command  Valves\n");
+
+   for (auto &p : profiles)
+   {
+      uint16_t t_rise = twi_timing_rise_time(p.f_scl);
+      int16_t baud = twi_timing_baud(f_cpu, p.f_scl, t_rise);
+      uint32_t actual = twi_timing_frequency(f_cpu, (uint8_t)baud, t_rise);
+
+      printf(
+         "%-10s  %4d  %4ukHz  %5.1fus  %5.1fus\n",
+         p.name, baud, (unsigned)(actual / 1000),
+         frame_ns(p.f_scl, opcodes_cmd_idle) / 1000.0,
+         frame_ns(p.f_scl, opcodes_cmd_valves) / 1000.0
+      );
+
+      // The actual frequency must be within 10% below and 5% above the target
+      assert( actual <= p.f_scl * 105 / 100 );
+      assert( actual >= p.f_scl * 90 / 100 );
+   }
+
+   // A command and its reply hold the bus for 75 clocks, i.e. 750us at 100kHz
+   assert( twi_timing_transaction_ns(100000, opcodes_frame_size(opcodes_cmd_idle), OPCODES_REPLY_SIZE) == 750000 );
+
+   // Fast mode plus must cut the time the bus is locked by 5 at least
+   assert( frame_ns(TWI_FMP_FREQUENCY, opcodes_cmd_idle) * 5 < frame_ns(100000, opcodes_cmd_idle) );
+
+   // A whole frame must fit well within the 1ms tick of the transmit retry
+   assert( frame_ns(100000, opcodes_cmd_valves) < 1000000 );
+
+   return 0;
+}